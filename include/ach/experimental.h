@@ -124,6 +124,58 @@ ach_evhandle( struct ach_evhandler *handlers,
               void *periodic_context,
               int options );
 
+
+/** Get the sequence number of the last frame read from the channel.
+ *
+ *  Kernel channels do not track sequence numbers in user space and
+ *  return ACH_ENOTSUP.
+ */
+enum ach_status ACH_WARN_UNUSED
+ach_channel_seq( const struct ach_channel *channel, uint64_t *seq );
+
+/** Copy out the frame with a given sequence number.
+ *
+ *  Unlike ach_get(), this does not wait and does not change the read
+ *  position of the channel.  It is meant for fetching older frames
+ *  that are still in the channel, e.g., to retransmit them.
+ *
+ *  \param[in,out] chan The previously opened channel handle
+ *  \param[in] seq The sequence number to get
+ *  \param[out] buf Buffer to store data
+ *  \param[in] size Length of user buffer in bytes
+ *  \param[out] frame_size Length of the frame
+ *
+ *  \return ACH_OK on success, ACH_MISSED_FRAME if the frame was
+ *  already overwritten, ACH_STALE_FRAMES if it has not been put yet,
+ *  ACH_OVERFLOW if buf is too small, or ACH_ENOTSUP for kernel
+ *  channels.
+ */
+enum ach_status ACH_WARN_UNUSED
+ach_get_seq( ach_channel_t *chan, uint64_t seq,
+             void *buf, size_t size, size_t *frame_size );
+
+/** Put a frame by writing it straight into the channel.
+ *
+ *  The channel reserves len bytes for the frame and calls
+ *  transfer(cx, dst, obj) to fill them, e.g., by reading from a
+ *  socket, which saves copying through an intermediate buffer.  The
+ *  frame is published only if transfer() returns ACH_OK; otherwise
+ *  the channel is unchanged and the status of transfer() is
+ *  returned.
+ *
+ *  transfer() is called while holding the channel lock, so it must
+ *  not block.  dst may overlap the oldest frames, which are only
+ *  dropped once transfer() succeeds, so transfer() must not write to
+ *  dst when it fails.
+ *
+ *  \return ACH_OK on success, ACH_OVERFLOW if the channel cannot
+ *  hold len bytes, the status of a failed transfer(), or ACH_ENOTSUP
+ *  for kernel channels.
+ */
+enum ach_status ACH_WARN_UNUSED
+ach_put_transfer( ach_channel_t *chan, ach_put_fun transfer, void *cx,
+                  const void *obj, size_t len );
+
 #ifdef __cplusplus
 }
 #endif
@@ -348,6 +348,7 @@ ach_xput( ach_channel_t *chan,
     ach_index_t *index_ar;
     unsigned char *data_ar;
     ach_index_t *idx;
+    size_t i, n_evict, head, dfree, ifree;
 
     if( 0 == len || NULL == transfer || NULL == chan->shm ) {
         return ACH_EINVAL;
@@ -377,51 +378,53 @@ ach_xput( ach_channel_t *chan,
     /* find next index entry */
     idx = index_ar + shm->index_head;
 
-    /* clear entry used by index */
-    if( 0 == shm->index_free ) { free_index(shm,shm->index_head); }
-    /* else { assert(0== index_ar[shm->index_head].seq_num);} */
+    /* Find the oldest entries the frame displaces.  Nothing is freed
+     * till transfer() succeeds, so a failed transfer leaves the
+     * channel unchanged. */
+    n_evict = 0;
+    head = shm->data_head;
+    dfree = shm->data_free;
+    ifree = shm->index_free;
+    i = oldest_index_i(shm);
+#define ACH_XPUT_EVICT()                        \
+    do {                                        \
+        dfree += index_ar[i].size;              \
+        ifree++;                                \
+        n_evict++;                              \
+        i = (i + 1) % shm->index_cnt;           \
+    } while(0)
 
-    /* assert( shm->index_free > 0 ); */
+    /* clear entry used by index */
+    if( 0 == ifree ) { ACH_XPUT_EVICT(); }
 
     /* Avoid wraparound */
-    if( shm->data_size - shm->data_head < len ) {
-        size_t i;
+    if( shm->data_size - head < len ) {
         /* clear to end of array */
-        /* assert( 0 == index_ar[shm->index_head].offset ); */
-        for(i = (shm->index_head + shm->index_free) % shm->index_cnt;
-            index_ar[i].offset > shm->data_head;
-            i = (i + 1) % shm->index_cnt)
-        {
-            /* assert( i != shm->index_head ); */
-            free_index(shm,i);
+        while( ifree < shm->index_cnt && index_ar[i].offset > head ) {
+            ACH_XPUT_EVICT();
         }
         /* Set counts to beginning of array */
-        if( i == shm->index_head ) {
-            shm->data_free = shm->data_size;
+        if( ifree == shm->index_cnt ) {
+            dfree = shm->data_size;
         } else {
-            shm->data_free = index_ar[oldest_index_i(shm)].offset;
+            dfree = index_ar[i].offset;
         }
-        shm->data_head = 0;
+        head = 0;
     }
 
     /* clear overlapping entries */
-    {
-        size_t i;
-        for(i = (shm->index_head + shm->index_free) % shm->index_cnt;
-            shm->data_free < len;
-            i = (i + 1) % shm->index_cnt)
-        {
-            if( i == shm->index_head ) {
-                shm->data_free = shm->data_size;
-            } else {
-                free_index(shm,i);
-            }
+    while( dfree < len ) {
+        if( ifree == shm->index_cnt ) {
+            dfree = shm->data_size;
+        } else {
+            ACH_XPUT_EVICT();
         }
     }
+#undef ACH_XPUT_EVICT
 
-    /* assert( shm->data_free >= len ); */
+    /* assert( dfree >= len ); */
 
-    if( shm->data_size - shm->data_head < len ) {
+    if( shm->data_size - head < len ) {
         enum ach_status r2 = unwrlock( shm );
         if( r2 != ACH_OK ) {
             ACH_ERRF("ach bug: another error on unwrlock()");
@@ -431,7 +434,7 @@ ach_xput( ach_channel_t *chan,
 
     /* transfer */
     {
-        enum ach_status r = transfer(cx, data_ar + shm->data_head, obj);
+        enum ach_status r = transfer(cx, data_ar + head, obj);
         if( ACH_OK != r ) {
             enum ach_status r2 = unwrlock( shm );
             if( r2 != ACH_OK ) {
@@ -441,6 +444,13 @@ ach_xput( ach_channel_t *chan,
         }
     }
 
+    /* free displaced entries */
+    for( i = 0; i < n_evict; i++ ) {
+        free_index( shm, oldest_index_i(shm) );
+    }
+    shm->data_free = dfree;
+    shm->data_head = head;
+
     /* modify counts */
     shm->last_seq++;
     idx->seq_num = shm->last_seq;
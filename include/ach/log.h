@@ -0,0 +1,256 @@
+/*
+ * Copyright (c) 2015, Rice University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *     * Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials
+ *       provided with the distribution.
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written
+ *       permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/** \file log.h
+ *
+ *  \brief This header file declares the achlog file format and a
+ *         reader for achlog files, in libach-log.
+ *
+ *  Include ach.h before this file.
+ */
+
+#ifndef ACH_LOG_H
+#define ACH_LOG_H
+
+#include <stdint.h>
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Current version of the achlog file format for a single channel */
+#define ACH_LOG_VERSION 1
+
+/** Version of the achlog file format for logs of several channels.
+ *
+ * These logs name their channels in headers "channel-0: name",
+ * "channel-1: name", and so on, instead of "channel-name", and each
+ * record holds the number of its channel.  Otherwise, they are the
+ * same as version 1 logs.
+ */
+#define ACH_LOG_VERSION_MULTI 2
+
+/** Record type: a logged frame, followed by its data */
+#define ACH_LOG_REC_FRAME 'F'
+
+/** Record type: frames that were not logged, no data follows */
+#define ACH_LOG_REC_GAP 'G'
+
+/** Record type: a compressed block of other records.
+ *
+ * The data is the 8 byte little endian size of the records once
+ * decompressed, followed by the records compressed with
+ * ach_lz_compress().  Each block decompresses independently, and seq
+ * and time are those of the first frame in the block.
+ */
+#define ACH_LOG_REC_BLOCK 'Z'
+
+/** Header of each record in a version 1 or 2 achlog file.
+ *
+ *  All fields are stored little endian.  In version 2 logs, channel
+ *  is the number of the record's channel, and it is zero in
+ *  version 1 logs.  For a frame record, seq is
+ *  the channel sequence number of the frame, and size is the number
+ *  of data bytes that follow.  For a gap record, seq is the first
+ *  frame that was not logged and size is the number of such frames.
+ *  Both are zero when unknown, e.g., for kernel channels.  time is
+ *  when the frame (or gap) was seen, in nanoseconds on the same clock
+ *  as the log-time-ach header.
+ */
+typedef struct {
+    uint8_t type;          /**< ACH_LOG_REC_FRAME or ACH_LOG_REC_GAP */
+    uint8_t channel_bytes[4];  /**< channel number */
+    uint8_t reserved[3];   /**< reserved, zero */
+    uint8_t seq_bytes[8];  /**< sequence number */
+    uint8_t time_bytes[8]; /**< capture time in nanoseconds */
+    uint8_t size_bytes[8]; /**< data size or missed frame count */
+} ach_log_rec_t;
+
+/** Fill in a log record header. */
+void ach_log_rec_set( ach_log_rec_t *rec, uint8_t type,
+                      uint64_t seq, uint64_t time, uint64_t size );
+
+/** Read a log record header.
+ *
+ * \return the record type
+ */
+uint8_t ach_log_rec_get( const ach_log_rec_t *rec,
+                         uint64_t *seq, uint64_t *time, uint64_t *size );
+
+/** Set the channel number of a log record header. */
+void ach_log_rec_set_channel( ach_log_rec_t *rec, uint32_t channel );
+
+/** Read the channel number of a log record header. */
+uint32_t ach_log_rec_get_channel( const ach_log_rec_t *rec );
+
+/** Magic number at the start of an achlog index file */
+#define ACH_LOG_IDX_MAGIC "achidx"
+
+/** Entry in an achlog index file.
+ *
+ *  The index file is written next to the log as "<log>.idx".  It
+ *  is the 8 byte magic number followed by an array of entries, each
+ *  giving the file offset of a record in the log and that frame's
+ *  capture time and sequence number.  Entries are in file order, so
+ *  both time and seq are nondecreasing and can be binary searched.
+ *  Logs whose sequence numbers are not in file order, such as merges
+ *  of several logs, give seq as ACH_LOG_IDX_NO_SEQ in every entry.
+ */
+typedef struct {
+    uint8_t time_bytes[8];   /**< capture time in nanoseconds */
+    uint8_t seq_bytes[8];    /**< sequence number */
+    uint8_t offset_bytes[8]; /**< file offset of the record */
+} ach_log_idx_t;
+
+/** Index seq of a log whose sequence numbers are not in file order */
+#define ACH_LOG_IDX_NO_SEQ UINT64_MAX
+
+/** Fill in an index entry. */
+void ach_log_idx_set( ach_log_idx_t *ent,
+                      uint64_t time, uint64_t seq, uint64_t offset );
+
+/** Read an index entry. */
+void ach_log_idx_get( const ach_log_idx_t *ent,
+                      uint64_t *time, uint64_t *seq, uint64_t *offset );
+
+/** Keys for ach_log_idx_find() */
+enum ach_log_key {
+    ACH_LOG_KEY_TIME, /**< search by capture time */
+    ACH_LOG_KEY_SEQ   /**< search by sequence number */
+};
+
+/** Binary search an index.
+ *
+ * \return the position of the last of the n entries whose key is at
+ * most value, or 0 if there is none.  Reading forward from that
+ * entry's offset finds the first frame at or after value.
+ */
+size_t ach_log_idx_find( const ach_log_idx_t *ents, size_t n,
+                         enum ach_log_key key, uint64_t value );
+
+/** An achlog file opened for reading.
+ *
+ * The log is mapped into memory, so frames are read in place, without
+ * copying.
+ */
+struct ach_log_file {
+    int fd;
+    const uint8_t *map;         /**< the mapped log */
+    size_t map_len;             /**< length of the mapping */
+    size_t pos;                 /**< offset of the next record */
+    size_t ahead;               /**< end of the range advised for readahead */
+    size_t behind;              /**< start of the pages not yet released */
+    char *channel;              /**< channel-name header, or the first channel */
+    char **channels;            /**< names of the channels, by number */
+    size_t n_channels;          /**< number of channels */
+    int version;                /**< log-version header */
+    struct timespec time_ach;   /**< log-time-ach header */
+    struct timespec time_real;  /**< log-time-real header */
+    uint64_t data_offset;       /**< file offset of the first record */
+    ach_log_idx_t *idx;         /**< index entries, NULL if no index */
+    size_t n_idx;               /**< number of index entries */
+    int pending;                /**< the current record has not been returned */
+    ach_log_rec_t rec;          /**< the current record */
+    uint8_t *block;             /**< decompressed records of a block */
+    size_t block_max;           /**< size of block */
+    size_t block_len;           /**< length of decompressed records in block */
+    size_t block_pos;           /**< position of the next record in block */
+    const void *data;           /**< data of the current record */
+};
+
+/** A record read from an achlog file */
+struct ach_log_frame {
+    uint8_t type;       /**< ACH_LOG_REC_FRAME or ACH_LOG_REC_GAP */
+    uint32_t channel;   /**< index of the channel in ach_log_file.channels */
+    uint64_t seq;       /**< sequence number */
+    uint64_t time;      /**< capture time in nanoseconds */
+    uint64_t size;      /**< data size or missed frame count */
+    const void *data;   /**< frame data, valid until the next call.
+                         *   Points into the mapped log unless the
+                         *   frame came from a compressed block. */
+};
+
+/** Open an achlog file and read its header.
+ *
+ * The log must be a regular file, which is mapped and read
+ * sequentially, advising the kernel to read ahead of the frames.
+ * Loads the index file next to the log, if there is one.  Version 0
+ * logs are read with sequence numbers and times of zero.  Compressed
+ * blocks are expanded transparently, so ach_log_next() never returns
+ * ACH_LOG_REC_BLOCK.
+ *
+ * \return ACH_OK on success, ACH_FAILED_SYSCALL if the file could not
+ * be opened or mapped, or ACH_BAD_HEADER if it is not an achlog file
+ * of a known version.
+ */
+enum ach_status
+ach_log_open( struct ach_log_file *lf, const char *path );
+
+/** Read the next record.
+ *
+ * At the end of the mapping, checks whether the log has grown, so a
+ * log that is still being written can be followed.  A record that is
+ * only partly written is left for a later call.
+ *
+ * \return ACH_OK on success, ACH_STALE_FRAMES at the end of the log
+ * or at a partly written record, ACH_CORRUPT if the log is malformed,
+ * or ACH_FAILED_SYSCALL on a read error.
+ */
+enum ach_status
+ach_log_next( struct ach_log_file *lf, struct ach_log_frame *frame );
+
+/** Seek to the first frame whose time or sequence number is at least
+ * value.
+ *
+ * Uses the index to skip close to the frame, if there is one, then
+ * reads forward.  The next call to ach_log_next() returns that frame.
+ *
+ * Sequence numbers are per channel, so seeking by ACH_LOG_KEY_SEQ
+ * applies only to logs of one channel whose index, if any, gives
+ * sequence numbers.
+ *
+ * \return as for ach_log_next(), or ACH_EINVAL when seeking by
+ * sequence number does not apply to the log
+ */
+enum ach_status
+ach_log_seek( struct ach_log_file *lf, enum ach_log_key key, uint64_t value );
+
+/** Close an achlog file and release its memory. */
+void ach_log_close( struct ach_log_file *lf );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ACH_LOG_H */
@@ -49,6 +49,9 @@
  * \author Neil T. Dantam
  */
 
+#include <sys/uio.h>
+#include <netinet/in.h>
+
 #define ACHD_PORT 8076
 #define INIT_BUF_SIZE 512
 
@@ -58,6 +61,61 @@
 
 #define ACHD_LINE_LENGTH 1024
 
+/** Largest header block */
+#define ACHD_HEADER_LENGTH 4096
+
+/** Maximum datagrams per sendmmsg()/recvmmsg() call */
+#define ACHD_UDP_BATCH 32
+
+/** Most paths of a multipath UDP link */
+#define ACHD_UDP_PATHS 4
+
+/** Interval to check the TCP control connection of UDP links */
+#define ACHD_UDP_CHECK_NS (100 * 1000 * 1000)
+
+/** Size of the timestamp trailer on frames */
+#define ACHD_STAMP_SIZE 16
+
+/** Interval between pings to estimate clock offset */
+#define ACHD_PING_NS (1000 * 1000 * 1000)
+
+/** Interval between latency reports */
+#define ACHD_STATS_NS (10 * (uint64_t)1000 * 1000 * 1000)
+
+/** Sequence number trailer on frames of resumable TCP links */
+#define ACHD_SEQ_SIZE 8
+
+/** Smallest raw frame received straight into the channel */
+#define ACHD_DIRECT_MIN 4096
+
+/** Longest wait for a whole frame to be buffered before reading it
+ *  into the channel */
+#define ACHD_DIRECT_WAIT_MS 100
+
+/** Sequence number prefix of reliable UDP datagrams */
+#define ACHD_RUDP_SEQ_SIZE 8
+
+/** Reorder window of reliable UDP receivers, in frames */
+#define ACHD_RUDP_WINDOW 64
+
+/** Interval between NACKs for the same missing frame */
+#define ACHD_RUDP_NACK_NS (20 * 1000 * 1000)
+
+/** Time after which a reliable UDP receiver gives up on a missing frame */
+#define ACHD_RUDP_GIVEUP_NS (500 * 1000 * 1000)
+
+/** Frames a fan-out peer may fall behind before it skips to the latest */
+#define ACHD_FANOUT_QUEUE 16
+
+/** Time a fan-out peer has to send its request headers */
+#define ACHD_FANOUT_HANDSHAKE_SEC 2
+
+/** Fan-out peers that may be sending their request headers at once */
+#define ACHD_FANOUT_HANDSHAKE_MAX 64
+
+/** Multicast time-to-live, 1 keeps packets on the local subnet */
+#define ACHD_MCAST_TTL 1
+
 #ifdef __GNUC__
 #define ACHD_ATTR_PRINTF(m,n) __attribute__((format(printf, m, n)))
 #else
@@ -76,7 +134,10 @@ enum achd_mode {
     ACHD_MODE_VOID = 0,
     ACHD_MODE_SERVE,
     ACHD_MODE_PUSH,
-    ACHD_MODE_PULL
+    ACHD_MODE_PULL,
+    ACHD_MODE_FANOUT,
+    ACHD_MODE_RELAY,
+    ACHD_MODE_LISTEN
 };
 
 struct achd_headers {
@@ -90,12 +151,19 @@ struct achd_headers {
     int retry;
     int get_last;
     int retry_delay_us;
+    int delta_keyframe;
+    const char *compression;
+    int timestamps;
+    int resume;                  ///< resume-seq header present
+    uint64_t resume_seq;         ///< last frame the receiver got
     unsigned long period_ns;
+    const char *udp_paths;       ///< client's addresses on its other paths
     const char *remote_host;
     const char *transport;
     enum achd_direction direction;
     enum ach_status status;
     const char *message;
+    char error[ACHD_LINE_LENGTH]; ///< why achd_parse_headers() failed
 };
 
 struct achd_conn;
@@ -110,6 +178,7 @@ struct achd_conn_vtab {
     enum achd_direction direction;
     achd_io_connect_t connect;
     achd_io_handler_t handler;
+    int standalone;  ///< transport needs no achd server (e.g., multicast)
 };
 
 const struct achd_conn_vtab *achd_get_vtab( const char *transport, enum achd_direction direction );
@@ -131,17 +200,42 @@ struct achd_conn {
 
     const struct achd_conn_vtab *vtab;
 
+    struct achd_codec *codec; ///< frame encoding, NULL for raw frames
+
+    struct achd_latency *latency; ///< latency measurement, NULL if off
+
+    struct achd_rudp *rudp;       ///< reliable UDP state, NULL if off
+
+    struct achd_ctrl *ctrl;       ///< sender's control thread, NULL if unused
+
+    int resume;                   ///< frames carry sequence numbers
+    uint64_t resume_seq;          ///< receiver: seq of the last frame received
+
+    int direct_off;               ///< receiver: channel can't be read into directly
+    size_t rcvlowat;              ///< receiver: SO_RCVLOWAT of conn->in, 0 if unknown
+
     void *cx;
 };
 
 int achd_reconnect( struct achd_conn *conn );
 
 
+/* Read a block of headers from fd.  On failure, headers->error says
+ * why, if it is not a failed read. */
 enum ach_status achd_parse_headers(int fd, struct achd_headers *headers);
 
 void achd_serve(void);
 void achd_client(void);
 
+/** Serve TCP pulls of one channel, reading each frame once for all peers */
+void achd_fanout( const char *chan_name );
+
+/** Pull a remote channel once and fan it out, see achd_fanout() */
+void achd_relay(void);
+
+/** Accept connections in cx.workers processes and serve each as achd_serve() */
+void achd_listen(void);
+
 void achd_sleep_till( const struct timespec *t0, unsigned long ns );
 
 /* logging and error handlers */
@@ -153,29 +247,217 @@ void achd_error_log( enum ach_status code, const char fmt[], ... )    ACHD_ATTR_
 /* basic i/o */
 ssize_t achd_read(int fd, void *buf, size_t cnt );
 ssize_t achd_write(int fd, const void *buf, size_t cnt );
+ssize_t achd_writev(int fd, struct iovec *iov, int iovcnt );
 enum ach_status achd_readline(int fd, char *buf, size_t n );
 enum ach_status achd_printf(int fd, const char fmt[], ...) ACHD_ATTR_PRINTF(2,3);
 
+/** Send small writes, i.e., headers and control messages, right away */
+void achd_nodelay( int fd );
+
+/** Read a header block through its "." line into buf, leaving any
+ * following bytes unread for the frame stream */
+enum ach_status achd_read_headers( int fd, char *buf, size_t cnt, size_t *len );
+
+/** Hold achd_printf() output to fd until achd_hdr_end() sends it in
+ * one write */
+void achd_hdr_begin( int fd );
+enum ach_status achd_hdr_end( int fd );
+
+/** Store x little endian in 8 bytes at p */
+void achd_put_u64( uint8_t *p, uint64_t x );
+
+/** Load 8 little endian bytes at p */
+uint64_t achd_get_u64( const uint8_t *p );
+
+/* frame codecs */
+struct achd_codec;
+
+/** Create codec state for the encoding in hdr, or return NULL if
+ * frames are sent raw.  max_size bounds the size of decoded frames. */
+struct achd_codec *achd_codec_create( const struct achd_headers *hdr, size_t max_size );
+
+/** Forget previous frames, e.g., after reconnecting */
+void achd_codec_reset( struct achd_codec *codec );
+
+void achd_codec_destroy( struct achd_codec *codec );
+
+/** Largest encoding of an n byte frame */
+size_t achd_codec_bound( size_t n );
+
+/** Encode n bytes of buf into *pframe, enlarging it as needed */
+void achd_encode( struct achd_codec *codec, const uint8_t *buf, size_t n,
+                  ach_pipe_frame_t **pframe, size_t *psize );
+
+/** Decode n bytes of buf.
+ *
+ * \return the decoded frame, valid till the next call, or NULL if
+ * the frame must be dropped.
+ */
+const uint8_t *achd_decode( struct achd_codec *codec, const uint8_t *buf, size_t n,
+                            size_t *out_size );
+
+/* control messages */
+enum achd_ctrl_type {
+    ACHD_CTRL_PING = 1,  ///< receiver to sender, arg[0] is send time
+    ACHD_CTRL_PONG = 2,  ///< sender to receiver, args are ping, arrival, and send times
+    ACHD_CTRL_NACK = 3,  ///< receiver to sender, resend arg[1] frames from seq arg[0]
+    ACHD_CTRL_SKIP = 4,  ///< sender to receiver, arg[1] frames from seq arg[0] are gone
+    ACHD_CTRL_HIGH = 5   ///< sender to receiver, arg[0] is the last seq sent
+};
+
+struct achd_ctrl_msg {
+    enum achd_ctrl_type type;
+    uint64_t arg[3];
+};
+
+struct achd_ctrl;
+
+/** True if the link needs control messages */
+int achd_ctrl_wanted( const struct achd_conn *conn );
+
+/** Write a control message to conn->out */
+ssize_t achd_ctrl_write( struct achd_conn *conn, enum achd_ctrl_type type,
+                         uint64_t a, uint64_t b, uint64_t c );
+
+/** Start the sender's control thread, if needed and not yet running */
+void achd_ctrl_start( struct achd_conn *conn );
+
+/** Stop the sender's control thread, e.g., before reconnecting */
+void achd_ctrl_stop( struct achd_conn *conn );
+
+/** True if the sender's control thread saw the connection close */
+int achd_ctrl_closed( struct achd_conn *conn );
+
+/** Serialize sender writes with the control thread */
+void achd_ctrl_lock( struct achd_conn *conn );
+void achd_ctrl_unlock( struct achd_conn *conn );
+
+/** Receiver: handle a control message whose header was already read */
+int achd_ctrl_recv( struct achd_conn *conn, const ach_pipe_frame_t *hdr );
+
+/** Receiver: read and handle a control message */
+int achd_ctrl_read( struct achd_conn *conn );
+
+/* latency measurement */
+struct achd_latency;
+
+/** Create latency state if hdr turns on timestamps, else return NULL */
+struct achd_latency *achd_latency_create( const struct achd_headers *hdr );
+
+uint64_t achd_realtime_ns( void );
+
+/** Fill a frame trailer of ACHD_STAMP_SIZE bytes */
+void achd_stamp( uint8_t *stamp, uint64_t get_ns, uint64_t send_ns );
+
+/** Sender: answer a ping */
+int achd_latency_ping( struct achd_conn *conn, const struct achd_ctrl_msg *msg, uint64_t recv_ns );
+
+/** Receiver: update the clock offset from a pong */
+void achd_latency_pong( struct achd_conn *conn, const struct achd_ctrl_msg *msg, uint64_t t4 );
+
+/** Receiver: record a frame's trailer, maybe ping and report */
+void achd_latency_frame( struct achd_conn *conn, const uint8_t *stamp,
+                         uint64_t recv_ns, uint64_t put_ns );
+
+/* reliable UDP */
+struct achd_rudp;
+
+/** Set up reliable UDP state for conn, once */
+void achd_rudp_setup( struct achd_conn *conn );
+
+/** Sender: note the peer to send retransmissions to */
+void achd_rudp_peer( struct achd_conn *conn, const struct sockaddr_in *addr );
+
+/** Sender: note the last seq sent */
+void achd_rudp_sent( struct achd_conn *conn, uint64_t seq );
+
+/** Sender: retransmit frames for a NACK */
+void achd_rudp_nack( struct achd_conn *conn, const struct achd_ctrl_msg *msg );
+
+/** Sender: announce the last seq when idle */
+void achd_rudp_idle( struct achd_conn *conn );
+
+/** Receiver: handle a SKIP or HIGH message */
+void achd_rudp_ctrl( struct achd_conn *conn, const struct achd_ctrl_msg *msg );
+
+/** Receiver: take a datagram, delivering frames in order */
+void achd_rudp_recv( struct achd_conn *conn, const uint8_t *buf, size_t cnt, uint64_t recv_ns );
+
+/** Receiver: send NACKs and give up on old gaps */
+void achd_rudp_check( struct achd_conn *conn );
+
+/** Receiver: milliseconds till achd_rudp_check() has work, or -1 */
+int achd_rudp_timeout( struct achd_conn *conn );
+
+/* io_uring */
+struct achd_uring;
+
+/** Create an io_uring, or return NULL if the kernel lacks io_uring
+ * or timed waits (IORING_FEAT_EXT_ARG) */
+struct achd_uring *achd_uring_create( unsigned entries );
+
+void achd_uring_destroy( struct achd_uring *ring );
+
+/** Register buffers for achd_uring_read_fixed(), return 0 on success */
+int achd_uring_register( struct achd_uring *ring, const struct iovec *iov, unsigned n );
+int achd_uring_unregister( struct achd_uring *ring );
+
+/* Queue requests, return 0 on success or -1 if the queue is full.
+ * data identifies the request's completion. */
+int achd_uring_recvmsg( struct achd_uring *ring, int fd, struct msghdr *msg, uint64_t data );
+int achd_uring_sendmsg( struct achd_uring *ring, int fd, const struct msghdr *msg,
+                        uint64_t data, int link );
+int achd_uring_read_fixed( struct achd_uring *ring, int fd, void *buf, size_t n,
+                           unsigned buf_index, uint64_t data );
+int achd_uring_poll( struct achd_uring *ring, int fd, uint64_t data );
+int achd_uring_cancel( struct achd_uring *ring, uint64_t target, uint64_t data );
+
+/** Submit queued requests and wait up to timeout_ms (-1 for ever)
+ * for wait_nr completions.  Timeouts and signals are not errors. */
+int achd_uring_submit( struct achd_uring *ring, unsigned wait_nr, int timeout_ms );
+
+/** Take one completion, return 0 if there is none */
+int achd_uring_reap( struct achd_uring *ring, uint64_t *data, int32_t *res );
+
+/** Requests queued or submitted but not yet reaped */
+unsigned achd_uring_inflight( const struct achd_uring *ring );
+
+/** Put a received frame, undoing the sender's trailer and encoding */
+void achd_recv_frame( struct achd_conn *conn, const uint8_t *buf, size_t cnt, uint64_t recv_ns );
+
 /* i/o handlers */
 
 int achd_connect_nop( struct achd_conn *conn );
 int achd_udp_sock( struct achd_conn *conn );
+int achd_mcast_sock( struct achd_conn *conn );
+int achd_rudp_sock( struct achd_conn *conn );
+int achd_mpudp_sock( struct achd_conn *conn );
 
 void achd_push_tcp( struct achd_conn *);
 void achd_pull_tcp( struct achd_conn *);
 void achd_push_udp( struct achd_conn *);
 void achd_pull_udp( struct achd_conn *);
+void achd_push_mcast( struct achd_conn *);
+void achd_pull_mcast( struct achd_conn *);
+void achd_push_rudp( struct achd_conn *);
+void achd_pull_rudp( struct achd_conn *);
 
 
 struct achd_cx {
     struct achd_headers cl_opts; /** Options from command line */
     int mode;
     int port;
+    int listen_port;             ///< port a relay serves on
+    int workers;                 ///< listen processes, 0 for one per CPU
     int reconnect;
     int detach;
+    int io_uring;                ///< use io_uring for UDP if available
+    const char *paths[ACHD_UDP_PATHS-1]; ///< server's other addresses, for multipath UDP
+    int n_paths;
     const char *pidfile;
     sig_atomic_t sig_received;
     ach_channel_t channel;
+    const char *chan_name;       ///< name of channel
     void (*error)(enum ach_status code, const char fmt[], ...);
 };
 
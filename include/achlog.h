@@ -0,0 +1,227 @@
+/*
+ * Copyright (c) 2015, Rice University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *     * Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials
+ *       provided with the distribution.
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written
+ *       permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef ACHLOG_H
+#define ACHLOG_H
+
+/** \file achlog.h
+ *
+ * \brief This file contains declarations for the achlog utility.
+ */
+
+/** Raw size at which a compressed block is closed */
+#define ACHLOG_BLOCK_SIZE (64*1024)
+
+/** Compressed blocks in flight per channel */
+#define ACHLOG_BLOCK_RING 4
+
+/** Close a partially filled compressed block after this long */
+#define ACHLOG_BLOCK_FLUSH_NS 1000000000
+
+/** Default size of output buffers */
+#define ACHLOG_BUF_SIZE (64*1024)
+
+/** Alignment of output buffers, and of writes with O_DIRECT */
+#define ACHLOG_ALIGN 4096
+
+/** First and largest amounts of file space to preallocate */
+#define ACHLOG_PREALLOC_MIN (1024*1024)
+#define ACHLOG_PREALLOC_MAX (64*1024*1024)
+
+/** Output buffers queued for the writer before loggers must wait */
+#define ACHLOG_BUF_QUEUE 64
+
+/** Write out a partially filled output buffer after this long */
+#define ACHLOG_BUF_FLUSH_NS 100000000
+
+/** Polling period for event loop threads */
+#define ACHLOG_EV_PERIOD_NS 10000000
+
+/** Check idle channels for due rotations this often */
+#define ACHLOG_ROTATE_POLL_NS 100000000
+
+enum achlog_block_state {
+    ACHLOG_BLOCK_FREE,      /**< empty or filling */
+    ACHLOG_BLOCK_QUEUED,    /**< waiting for or being compressed */
+    ACHLOG_BLOCK_DONE       /**< compressed, waiting to be written */
+};
+
+/** A block of records to compress */
+struct achlog_block {
+    uint8_t *raw;           /**< records */
+    size_t raw_len;
+    size_t raw_max;
+    uint8_t *out;           /**< block record, header and compressed data */
+    size_t out_len;
+    size_t out_max;
+    uint64_t seq;           /**< first frame in the block */
+    uint64_t time;          /**< first frame in the block */
+    uint64_t frames;        /**< frames in the block */
+    enum achlog_block_state state;
+    struct achlog_block *next;  /**< compression queue */
+};
+
+enum achlog_buf_op {
+    ACHLOG_BUF_WRITE,       /**< write the data to the file */
+    ACHLOG_BUF_OPEN,        /**< open the next segment of the channel */
+    ACHLOG_BUF_CLOSE        /**< close the file */
+};
+
+/** An output buffer, or another request for the writer thread */
+struct achlog_buf {
+    struct achlog_buf *next;    /**< free list or write queue */
+    enum achlog_buf_op op;
+    struct achlog_desc *desc;   /**< channel the data is for */
+    struct achlog_file *file;   /**< file to write to or close */
+    uint8_t *data;
+    size_t len;
+    uint64_t time;              /**< when the first byte was added */
+};
+
+/** A log file, or one segment of a rotated log */
+struct achlog_file {
+    struct achlog_desc *desc;
+    char *path;
+    FILE *fout;         /**< log file or gzip pipe */
+    int fd;             /**< descriptor of fout */
+    int pipe;           /**< fout is from popen() */
+    FILE *fidx;         /**< index file, NULL when not indexing */
+
+    /* Owned by the writer thread */
+    int regular;        /**< fd is a regular file */
+    uint64_t file_off;  /**< bytes of the log written to the file */
+    uint64_t alloc_end; /**< end of preallocated file space */
+    uint64_t alloc_size;    /**< size of the next preallocation */
+    uint8_t *tail;      /**< O_DIRECT: data past the last full block */
+    size_t tail_len;
+    int tail_fd;        /**< O_DIRECT: fd without O_DIRECT to write tail, else -1 */
+    uint64_t sync_off;  /**< file offset up to which data is synced */
+    uint64_t sync_time; /**< when data was last synced */
+};
+
+/** A logged channel */
+struct achlog_desc {
+    const char *name;
+    ach_channel_t chan;
+    struct achlog_file *file;   /**< file being logged to */
+    struct achlog_file *next;   /**< next segment, opened ahead by the writer */
+    int next_ready;     /**< the writer has set next */
+    unsigned segment;   /**< number of the current segment */
+    uint64_t seg_time;  /**< when the current segment was started */
+    int rotate_gen;     /**< rotation requests seen */
+    uint64_t offset;    /**< current offset in the log file */
+    int indexed;        /**< an index entry has been written */
+    uint64_t idx_frames;    /**< frames since the last index entry */
+    uint64_t idx_time;      /**< time of the last index entry */
+    uint64_t last_seq;  /**< sequence number of the last frame */
+    struct achlog_buf *buf;     /**< output buffer being filled */
+    int error;          /**< errno of a failed write, set by the writer */
+
+    struct achlog_block ring[ACHLOG_BLOCK_RING];  /**< compressed blocks, in file order */
+    size_t ring_head;   /**< oldest block in flight */
+    size_t n_flight;    /**< blocks queued or done but not written */
+};
+
+/* Options */
+extern size_t opt_buf_size;
+extern int opt_direct;
+extern double opt_sync;
+extern int opt_rotate;
+extern uint64_t opt_rotate_size;
+extern int opt_lz;
+extern int opt_level;
+extern uint64_t opt_idx_frames;
+extern double opt_idx_time;
+
+/* Records */
+
+/** Write size bytes of a record, returning -1 on error */
+int achlog_write_rec( struct achlog_desc *desc, const ach_log_rec_t *rec, size_t size );
+
+/** Index the record at offset holding the frame at time and seq, if
+ * an entry is due.  frames are the frames the record holds. */
+void achlog_write_idx( struct achlog_desc *desc, uint64_t time, uint64_t seq,
+                       uint64_t offset, uint64_t frames );
+
+/** Open the log file of desc, or segment `segment' when rotating.
+ * Returns NULL on failure. */
+struct achlog_file *achlog_segment_open( struct achlog_desc *desc, unsigned segment );
+
+/* Compression */
+
+/** Start n compression threads */
+void achlog_block_start( long n );
+
+/** The block being filled */
+struct achlog_block *achlog_block_cur( struct achlog_desc *desc );
+
+/** Append n bytes to a block */
+void achlog_block_append( struct achlog_block *b, const void *p, size_t n );
+
+/** Queue the filling block for compression */
+int achlog_block_submit( struct achlog_desc *desc );
+
+/** Write compressed blocks in order, waiting for at least `wait' */
+int achlog_block_write( struct achlog_desc *desc, size_t wait );
+
+/** Release the blocks of desc */
+void achlog_block_free( struct achlog_desc *desc );
+
+/* Output */
+
+/** Start the writer thread */
+void achlog_writer_start( void );
+
+/** Prepare a newly opened log file for the writer */
+void achlog_writer_open( struct achlog_file *f );
+
+/** Sync a log file, trim it to the logged size, and close it, after
+ * its buffers are written */
+void achlog_writer_close( struct achlog_file *f );
+
+/** Have the writer open the next segment of desc ahead of time */
+void achlog_writer_prepare( struct achlog_desc *desc );
+
+/** Switch desc to its next segment, queueing the current one to be
+ * closed once its buffers are written */
+int achlog_writer_rotate( struct achlog_desc *desc );
+
+/** Copy n bytes to the log file of desc through its output buffer */
+int achlog_write( struct achlog_desc *desc, const void *p, size_t n, uint64_t now );
+
+/** Queue the output buffer of desc for writing */
+int achlog_flush( struct achlog_desc *desc );
+
+/** Wait until all queued buffers are written */
+void achlog_writer_drain( void );
+
+#endif //ACHLOG_H
@@ -44,6 +44,7 @@
 #define ACHUTIL_H
 
 #include <signal.h>
+#include "ach/log.h"
 
 /** \file achutil.h
  *
@@ -171,7 +172,10 @@ uint64_t ach_pipe_get_size(const ach_pipe_frame_t *frame );
 /** Lookup the host providing specified channel via DNS/mDNS SRV
  *  records.
  *
- *
+ *  Answers are cached for the record's TTL and shared by all threads
+ *  in the process.  After the TTL, the old answer is still returned
+ *  while it is refreshed in the background.  Failed lookups are
+ *  cached for a few seconds.
  *
  *  \param[in] channel Name of the channel
  *
@@ -194,4 +198,31 @@ ach_srv_search( const char *channel, const char *domain,
                 int *port );
 
 
+/*-- LZ Compression --*/
+
+/** Largest possible compressed size of n bytes */
+size_t ach_lz_bound( size_t n );
+
+/** Compress n bytes of src into dst.
+ *
+ * \return the compressed size, or 0 if it would exceed cap.  Passing
+ * cap less than n gives up early on data that doesn't compress.
+ */
+size_t ach_lz_compress( const void *src, size_t n, void *dst, size_t cap );
+
+/** Compress n bytes of src into dst at the given level.
+ *
+ * Levels run from 1, fastest, to 9, which searches harder for
+ * matches in poorly compressible data.  ach_lz_compress() uses level
+ * 3.  The output is decompressed the same way for all levels.
+ */
+size_t ach_lz_compress_level( const void *src, size_t n, void *dst, size_t cap, int level );
+
+/** Decompress n bytes of src into dst.
+ *
+ * \return 0 on success, or -1 if src is malformed or does not fit in
+ * cap bytes.
+ */
+int ach_lz_decompress( const void *src, size_t n, void *dst, size_t cap, size_t *out_size );
+
 #endif //ACHUTIL_H
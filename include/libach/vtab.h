@@ -84,6 +84,16 @@ struct ach_channel_vtab {
             const struct timespec *ACH_RESTRICT abstime,
             int options );
 
+    /** Implementation of ach_get_seq() */
+    enum ach_status ACH_WARN_UNUSED
+    (*get_seq)( ach_channel_t *chan, uint64_t seq,
+                void *buf, size_t size, size_t *frame_size );
+
+    /** Implementation of ach_put_transfer() */
+    enum ach_status ACH_WARN_UNUSED
+    (*put_transfer)( ach_channel_t *chan, ach_put_fun transfer, void *cx,
+                     const void *obj, size_t len );
+
     /** Implementation of ach_cancel() */
     enum ach_status ACH_WARN_UNUSED
     (*cancel)( ach_channel_t *chan, const ach_cancel_attr_t *attr );
@@ -135,6 +145,14 @@ libach_channel_fd_notsup( const struct ach_channel *channel, int *file_descripto
 enum ach_status
 libach_name_ok( const char *name );
 
+enum ach_status
+libach_get_seq_notsup( ach_channel_t *chan, uint64_t seq,
+                       void *buf, size_t size, size_t *frame_size );
+
+enum ach_status
+libach_put_transfer_notsup( ach_channel_t *chan, ach_put_fun transfer, void *cx,
+                            const void *obj, size_t len );
+
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2015, Rice University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *     * Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials
+ *       provided with the distribution.
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written
+ *       permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef LOGSOURCE_H
+#define LOGSOURCE_H
+
+/** \file logsource.h
+ *
+ * \brief This file contains declarations for reading several achlog
+ * files in order of real capture time, shared by achreplay and
+ * achlogmerge.
+ */
+
+/** An achlog file being read */
+struct log_source {
+    const char *path;
+    struct ach_log_file log;
+    struct ach_log_frame frame;
+    void *chans;        /**< the tool's data for each channel of the log */
+    int64_t offset;     /**< add to capture time to get real time */
+    uint64_t time;      /**< real time of the current record */
+    int failed;         /**< reading the log failed */
+};
+
+/** Convert t to nanoseconds, as log times are given */
+uint64_t log_source_ns( const struct timespec *t );
+
+/** Append a log at path to the array *sources of *n logs */
+void log_source_add( struct log_source **sources, size_t *n, const char *path );
+
+/** Open the log of s, or die.
+ *
+ * \return the real time of the start of the log in nanoseconds
+ */
+uint64_t log_source_open( struct log_source *s );
+
+/** Read the next record of s, or the next frame when frames_only.
+ *
+ * Read errors are logged and set s->failed.
+ *
+ * \return 0 on success and -1 at the end of the log or on an error
+ */
+int log_source_next( struct log_source *s, int frames_only );
+
+/** Restore the min-heap order by time of the n sources in heap below
+ * position i */
+void log_source_heap_down( struct log_source **heap, size_t n, size_t i );
+
+#endif /* LOGSOURCE_H */
@@ -67,6 +67,7 @@
 
 #include "ach.h"
 #include "ach/private_posix.h"
+#include "ach/experimental.h"
 #include "achutil.h"
 #include "achd.h"
 
@@ -100,6 +101,32 @@ static const struct achd_conn_vtab handlers[] = {
      .direction = ACHD_DIRECTION_PULL,
      .connect = achd_udp_sock,
      .handler = achd_pull_udp },
+    {.transport = "rudp",
+     .direction = ACHD_DIRECTION_PUSH,
+     .connect = achd_rudp_sock,
+     .handler = achd_push_rudp },
+    {.transport = "rudp",
+     .direction = ACHD_DIRECTION_PULL,
+     .connect = achd_rudp_sock,
+     .handler = achd_pull_rudp },
+    {.transport = "mpudp",
+     .direction = ACHD_DIRECTION_PUSH,
+     .connect = achd_mpudp_sock,
+     .handler = achd_push_udp },
+    {.transport = "mpudp",
+     .direction = ACHD_DIRECTION_PULL,
+     .connect = achd_mpudp_sock,
+     .handler = achd_pull_udp },
+    {.transport = "mcast",
+     .direction = ACHD_DIRECTION_PUSH,
+     .connect = achd_mcast_sock,
+     .handler = achd_push_mcast,
+     .standalone = 1 },
+    {.transport = "mcast",
+     .direction = ACHD_DIRECTION_PULL,
+     .connect = achd_mcast_sock,
+     .handler = achd_pull_mcast,
+     .standalone = 1 },
     {.transport = NULL,
      .direction = ACHD_DIRECTION_VOID,
      .connect = NULL,
@@ -126,7 +153,7 @@ int main(int argc, char **argv) {
     /* process options */
     int c = 0, i = 0;
     while( -1 != c ) {
-        while( (c = getopt( argc, argv, "dp:t:f:z:u:lqrvV?")) != -1 ) {
+        while( (c = getopt( argc, argv, "dp:P:t:f:z:u:x:c:i:a:w:slqrvV?")) != -1 ) {
             switch(c) {
             case 'z':
                 cx.cl_opts.remote_chan_name = strdup(optarg);
@@ -142,6 +169,14 @@ int main(int argc, char **argv) {
                     exit(EXIT_FAILURE);
                 }
                 break;
+            case 'P':
+                errno = 0;
+                cx.listen_port = (int)strtoul(optarg, NULL, 10);
+                if( errno ) {
+                    ACH_LOG(LOG_ERR, "Invalid port: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
             case 'u':
                 errno = 0;
                 cx.cl_opts.period_ns = 1000 * strtoul( optarg, NULL, 10 );
@@ -155,6 +190,44 @@ int main(int argc, char **argv) {
             case 'f':
                 cx.pidfile = strdup(optarg);
                 break;
+            case 'x':
+                errno = 0;
+                cx.cl_opts.delta_keyframe = (int)strtol( optarg, NULL, 10 );
+                if( errno || cx.cl_opts.delta_keyframe <= 0 ) {
+                    ACH_LOG(LOG_ERR, "Invalid key frame interval: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'c':
+                cx.cl_opts.compression = strdup(optarg);
+                if( strcasecmp( optarg, "lz" ) && strcasecmp( optarg, "none" ) ) {
+                    ACH_LOG(LOG_ERR, "Invalid compression: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'i':
+                if( 0 == strcasecmp( optarg, "uring" ) ) {
+                    cx.io_uring = 1;
+                } else if( 0 == strcasecmp( optarg, "posix" ) ) {
+                    cx.io_uring = 0;
+                } else {
+                    ACH_LOG(LOG_ERR, "Invalid I/O engine: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'w':
+                cx.workers = (int)strtoul(optarg, NULL, 10);
+                break;
+            case 'a':
+                if( cx.n_paths >= ACHD_UDP_PATHS-1 ) {
+                    ACH_LOG(LOG_ERR, "At most %d paths\n", ACHD_UDP_PATHS );
+                    exit(EXIT_FAILURE);
+                }
+                cx.paths[cx.n_paths++] = strdup(optarg);
+                break;
+            case 's':
+                cx.cl_opts.timestamps = 1;
+                break;
             case 'r':
                 cx.reconnect = 1;
                 break;
@@ -171,16 +244,24 @@ int main(int argc, char **argv) {
                 ach_print_version("achd");
                 exit(EXIT_SUCCESS);
             case '?':
-                puts( "Usage: achd [OPTIONS...] [serve|push|pull] [HOST  CHANNEL] \n"
+                puts( "Usage: achd [OPTIONS...] [serve|listen|fanout|relay|push|pull] [HOST  CHANNEL] \n"
                       "Daemon process to forward ach channels over network and dump to files\n"
                       "\n"
                       "Options:\n"
                       "  -p PORT,                     port\n"
+                      "  -P PORT,                     port a relay serves on (default 8076)\n"
                       "  -f FILE,                     TODO: lock FILE and write pid\n"
-                      "  -t (tcp|udp),                transport (default tcp)\n"
+                      "  -t TRANSPORT,                tcp, udp, rudp, mpudp, or mcast (default tcp)\n"
+                      "  -a ADDRESS                   another address of the server, one per extra\n"
+                      "                               path of -t mpudp\n"
                       "  -z CHANNEL_NAME,             remote channel name\n"
                       "  -u microseconds              transmit period in microseconds (implies -l)\n"
                       "  -l                           transmit latest frames\n"
+                      "  -x COUNT                     delta encode frames, sending a key frame every COUNT\n"
+                      "  -c (lz|none)                 compress frames (default none)\n"
+                      "  -s                           measure and log frame latency at the receiver\n"
+                      "  -i (posix|uring)             UDP I/O engine (default posix)\n"
+                      "  -w COUNT                     listen worker processes (default one per CPU)\n"
                       "  -r,                          reconnect if connection is lost\n"
                       "  -q,                          be quiet\n"
                       "  -v,                          be verbose\n"
@@ -196,6 +277,18 @@ int main(int argc, char **argv) {
                       "  achd serve                   Server process reading from stdin/stdout.\n"
                       "                               This can be run from inetd.\n"
                       "\n"
+                      "  achd -w 4 listen             Serve on the achd port without inetd, accepting\n"
+                      "                               in four processes pinned to separate CPUs.\n"
+                      "\n"
+                      "  achd -p 8077 fanout state    Serve TCP pulls of channel 'state' on port 8077,\n"
+                      "                               reading each frame once for all clients.\n"
+                      "                               Clients fall behind at most 16 frames.\n"
+                      "\n"
+                      "  achd -P 8077 relay golem state\n"
+                      "                               Pull channel 'state' from host 'golem' once and\n"
+                      "                               serve it to clients on port 8077 as with fanout.\n"
+                      "                               New clients get the latest frame right away.\n"
+                      "\n"
                       "  achd pull golem state-chan   Forward frames via TCP from remote channel\n"
                       "                               'state-chan' on host 'golem' to local channel\n"
                       "                               (a pull from the remote server).\n"
@@ -210,6 +303,15 @@ int main(int argc, char **argv) {
                       "\n"
                       "  achd -u 100000 pull hubo state     Forward frames from remote state channel at 10 Hz\n"
                       "\n"
+                      "  achd -t mcast push 239.255.0.1 state\n"
+                      "                               Send frames from local channel 'state' to\n"
+                      "                               multicast group 239.255.0.1 on the achd port.\n"
+                      "                               No achd server is needed.\n"
+                      "\n"
+                      "  achd -t mcast pull 239.255.0.1 state\n"
+                      "                               Join the group and put received frames in\n"
+                      "                               local channel 'state', creating it if needed.\n"
+                      "\n"
                       "Report bugs to " PACKAGE_BUGREPORT "\n"
                        );
 
@@ -235,6 +337,15 @@ int main(int argc, char **argv) {
         cx.error = achd_error_header;
         achd_serve();
         return 0;
+    } else if ( ACHD_MODE_FANOUT == cx.mode ) {
+        achd_fanout( opt_posarg[0] );
+        return 0;
+    } else if ( ACHD_MODE_RELAY == cx.mode ) {
+        achd_relay();
+        return 0;
+    } else if ( ACHD_MODE_LISTEN == cx.mode ) {
+        achd_listen();
+        return 0;
     } else {
         achd_client();
         return 0;
@@ -288,6 +399,13 @@ void achd_posarg(int i, const char *arg) {
         ACH_LOG(LOG_DEBUG, "mode %s\n", arg);
         if( 0 == strcasecmp(arg, "serve") ) {
             cx.mode = ACHD_MODE_SERVE;
+        } else if( 0 == strcasecmp(arg, "listen") ) {
+            cx.mode = ACHD_MODE_LISTEN;
+        } else if( 0 == strcasecmp(arg, "fanout") ) {
+            cx.mode = ACHD_MODE_FANOUT;
+        } else if( 0 == strcasecmp(arg, "relay") ) {
+            cx.mode = ACHD_MODE_RELAY;
+            cx.cl_opts.direction = ACHD_DIRECTION_PULL;
         } else if( 0 == strcasecmp(arg, "push") ) {
             cx.mode = ACHD_MODE_PUSH;
             cx.cl_opts.direction = ACHD_DIRECTION_PUSH;
@@ -331,10 +449,11 @@ void achd_serve() {
     conn.in = STDIN_FILENO;
     conn.out = STDOUT_FILENO;
     conn.mode = ACHD_MODE_SERVE;
+    achd_nodelay( conn.out );
     {
         enum ach_status r = achd_parse_headers( conn.in, &conn.recv_hdr );
         if( ACH_OK != r ) {
-            cx.error(r, "Bad headers\n");
+            cx.error( r, "%s\n", conn.recv_hdr.error[0] ? conn.recv_hdr.error : "Bad headers" );
         }
     }
 
@@ -363,6 +482,7 @@ void achd_serve() {
             cx.error( r, "Couldn't open channel %s - %s\n", conn.recv_hdr.chan_name, strerror(errno) );
             assert(0);
         }
+        cx.chan_name = conn.recv_hdr.chan_name;
     }
     { /* else, channel opened */
         enum ach_status r = ach_flush(&cx.channel);
@@ -376,8 +496,36 @@ void achd_serve() {
                                                        conn.recv_hdr.direction );
     assert( conn.vtab && conn.vtab->handler );
 
-    /* print headers */
+    /* setup encoding */
+    conn.codec = achd_codec_create( &conn.recv_hdr, cx.channel.shm->data_size );
+    conn.latency = achd_latency_create( &conn.recv_hdr );
+
+    /* The flush above dropped what the receiver missed while
+     * reconnecting, but those frames may still be in the channel. */
+    if( conn.recv_hdr.resume &&
+        ACHD_DIRECTION_PUSH == conn.recv_hdr.direction &&
+        0 == strcasecmp( conn.recv_hdr.transport, "tcp" ) )
+    {
+        uint64_t seq;
+        conn.resume = ( ACH_OK == ach_channel_seq( &cx.channel, &seq ) );
+    }
+
+    /* print headers, all in one segment */
+    achd_hdr_begin( conn.out );
     if( conn.vtab->connect ) conn.vtab->connect( &conn );
+    if( conn.recv_hdr.delta_keyframe ) {
+        /* acknowledge the encoding */
+        achd_printf(conn.out, "delta-keyframe: %d\n", conn.recv_hdr.delta_keyframe );
+    }
+    if( conn.recv_hdr.compression ) {
+        achd_printf(conn.out, "compression: %s\n", conn.recv_hdr.compression );
+    }
+    if( conn.recv_hdr.timestamps ) {
+        achd_printf(conn.out, "timestamps: 1\n" );
+    }
+    if( conn.resume ) {
+        achd_printf(conn.out, "resume-seq: %" PRIu64 "\n", conn.recv_hdr.resume_seq );
+    }
     achd_printf(conn.out,
                 "frame-count: %" PRIuPTR "\n"
                 "frame-size: %" PRIuPTR "\n"
@@ -387,6 +535,9 @@ void achd_serve() {
                 cx.channel.shm->data_size / cx.channel.shm->index_cnt,
                 ACH_OK, ach_result_to_string(ACH_OK)
         );
+    if( ACH_OK != achd_hdr_end( conn.out ) ) {
+        cx.error( ACH_FAILED_SYSCALL, "Couldn't write headers: %s\n", strerror(errno) );
+    }
 
     /* Set error handler */
     cx.error = achd_error_log;
@@ -407,17 +558,27 @@ void achd_serve() {
 /**********
 * HEADERS *
 **********/
-static void achd_set_header
+static enum ach_status achd_set_header
 (const char *key, const char *val, struct achd_headers *headers);
-static void achd_set_int(int *pint, const char *name, const char *val);
-static void achd_set_status(enum ach_status *pint, const char *name, const char *val);
+
+/* Note why headers are invalid, for the caller to report */
+static enum ach_status header_error( struct achd_headers *headers, const char fmt[], ... ) {
+    va_list argp;
+    va_start( argp, fmt );
+    vsnprintf( headers->error, sizeof(headers->error), fmt, argp );
+    va_end( argp );
+    return ACH_BAD_HEADER;
+}
 
 #define REGEX_WORD "([^:=\n]*)"
 #define REGEX_SPACE "[[:blank:]\n\r]*"
 
-enum ach_status achd_parse_headers(int fd, struct achd_headers *headers) {
-    regex_t line_regex, dot_regex;
-    regmatch_t match[3];
+/* Compiled once, a relay or fan-out parses many header blocks */
+static regex_t line_regex, dot_regex;
+static pthread_once_t regex_once = PTHREAD_ONCE_INIT;
+static int regex_ok;
+
+static void regex_init(void) {
     if (regcomp(&line_regex,
                 "^"REGEX_SPACE"$|"     /* empty line */
                 "^"REGEX_SPACE         /* beginning space */
@@ -429,21 +590,49 @@ enum ach_status achd_parse_headers(int fd, struct achd_headers *headers) {
                 REGEX_SPACE            /* end space */
                 "$",
                 REG_EXTENDED ) ) {
-        cx.error(ACH_BUG, "couldn't compile regex\n");
-        assert(0);
+        return;
     }
     if( regcomp(&dot_regex,
                 "^"REGEX_SPACE "." REGEX_SPACE "$",
                 REG_EXTENDED) ) {
-        cx.error(ACH_BUG, "couldn't compile regex\n");
-        assert(0);
+        regfree( &line_regex );
+        return;
     }
+    regex_ok = 1;
+}
+
+enum ach_status achd_parse_headers(int fd, struct achd_headers *headers) {
+    regmatch_t match[3];
+    headers->error[0] = '\0';
+    if( pthread_once( &regex_once, regex_init ) || !regex_ok ) {
+        snprintf( headers->error, sizeof(headers->error), "couldn't compile regex" );
+        return ACH_BUG;
+    }
+
+    /* Read the whole block at once, rather than a syscall per byte */
+    char block[ACHD_HEADER_LENGTH];
+    size_t len;
+    enum ach_status r = achd_read_headers( fd, block, sizeof(block), &len );
+    if( ACH_OK != r ) return r;
 
     int line = 0;
     size_t n = ACHD_LINE_LENGTH;
     char lineptr[n];
-    enum ach_status r;
-    while( ACH_OK == (r = achd_readline(fd, lineptr, n)) ) {
+    const char *p = block;
+    const char *end = block + len;
+    while( p < end ) {
+        /* copy a line, eating '\r' */
+        size_t k = 0;
+        while( p < end && '\n' != *p ) {
+            if( k + 1 >= n ) {
+                header_error( headers, "header line %d too long", line + 1 );
+                return ACH_OVERFLOW;
+            }
+            if( '\r' != *p ) lineptr[k++] = *p;
+            p++;
+        }
+        lineptr[k] = '\0';
+        p++;
         line++;
         /* Break on ".\n" */
         if (! regexec(&dot_regex, lineptr, 0, NULL, 0)) break;
@@ -453,10 +642,7 @@ enum ach_status achd_parse_headers(int fd, struct achd_headers *headers) {
         if( cmt ) *cmt = '\0';
         /* match key/value */
         int i = regexec(&line_regex, lineptr, sizeof(match)/sizeof(match[0]), match, 0);
-        if( i ) {
-            cx.error( ACH_BAD_HEADER, "malformed header\n");
-            assert(0);
-        }
+        if( i ) return header_error( headers, "malformed header line %d", line );
         assert( ! strchr(lineptr, '#') );
         if( match[1].rm_so >= 0 && match[2].rm_so >=0 ) {
             lineptr[match[1].rm_eo] = '\0';
@@ -464,47 +650,51 @@ enum ach_status achd_parse_headers(int fd, struct achd_headers *headers) {
             char *key = lineptr+match[1].rm_so;
             char *val = lineptr+match[2].rm_so;
             ACH_LOG( LOG_DEBUG, "header line %d parsed `%s' : `%s'\n", line, key, val );
-            achd_set_header(key, val, headers);
+            r = achd_set_header(key, val, headers);
+            if( ACH_OK != r ) return r;
         }
 
     }
-    regfree(&line_regex);
-    regfree(&dot_regex);
-    return r;
+    return ACH_OK;
 }
 
-void achd_set_int(int *pint, const char *name, const char *val) {
+static enum ach_status achd_set_int
+(struct achd_headers *headers, int *pint, const char *name, const char *val) {
     errno = 0;
     long i = strtol( val, NULL, 10 );
-    if( errno ) {
-        cx.error( ACH_BAD_HEADER, "Invalid %s %s: %s\n", name, val, strerror(errno) );
-        assert(0);
-    }
+    if( errno ) return header_error( headers, "Invalid %s %s: %s", name, val, strerror(errno) );
     *pint = (int) i;
+    return ACH_OK;
 }
 
-void achd_set_ul(unsigned long *pint, const char *name, const char *val) {
+static enum ach_status achd_set_ul
+(struct achd_headers *headers, unsigned long *pint, const char *name, const char *val) {
     errno = 0;
     unsigned long i = strtoul( val, NULL, 10 );
-    if( errno ) {
-        cx.error( ACH_BAD_HEADER, "Invalid %s %s: %s\n", name, val, strerror(errno) );
-        assert(0);
-    }
+    if( errno ) return header_error( headers, "Invalid %s %s: %s", name, val, strerror(errno) );
     *pint = i;
+    return ACH_OK;
 }
 
-void achd_set_status(enum ach_status *pint, const char *name, const char *val) {
+static enum ach_status achd_set_u64
+(struct achd_headers *headers, uint64_t *pint, const char *name, const char *val) {
+    errno = 0;
+    unsigned long long i = strtoull( val, NULL, 10 );
+    if( errno ) return header_error( headers, "Invalid %s %s: %s", name, val, strerror(errno) );
+    *pint = (uint64_t)i;
+    return ACH_OK;
+}
+
+static enum ach_status achd_set_status
+(struct achd_headers *headers, enum ach_status *pint, const char *name, const char *val) {
     errno = 0;
     long i = strtol( val, NULL, 10 );
-    if( errno ) {
-        cx.error( ACH_BAD_HEADER, "Invalid %s %s: %s\n", name, val, strerror(errno) );
-        assert(0);
-    }
+    if( errno ) return header_error( headers, "Invalid %s %s: %s", name, val, strerror(errno) );
     *pint = (enum ach_status) i;
+    return ACH_OK;
 }
 
-
-int achd_parse_boolean( const char *value ) {
+static int achd_parse_boolean( const char *value ) {
     const char *yes[] = {"yes", "true", "1", "t", "y", "+", "aye", NULL};
     const char *no[] = {"no", "false", "0", "f", "n", "-", "nay", NULL};
     const char** s;
@@ -512,47 +702,66 @@ int achd_parse_boolean( const char *value ) {
         if( 0 == strcasecmp(*s, value) ) return 1;
     for( s = no; *s; s++ )
         if( 0 == strcasecmp(*s, value) ) return 0;
-    cx.error(ACH_BAD_HEADER, "Invalid boolean: %s\n", value);
-    abort();
+    return -1;
 }
 
-void achd_set_header (const char *key, const char *val, struct achd_headers *headers) {
+static enum ach_status achd_set_boolean
+(struct achd_headers *headers, int *pint, const char *name, const char *val) {
+    int b = achd_parse_boolean( val );
+    if( b < 0 ) return header_error( headers, "Invalid %s: %s", name, val );
+    *pint = b;
+    return ACH_OK;
+}
+
+enum ach_status achd_set_header (const char *key, const char *val, struct achd_headers *headers) {
     if       ( 0 == strcasecmp(key, "channel-name")) {
         headers->chan_name = strdup(val);
     } else if( 0 == strcasecmp(key, "frame-size")) {
-        achd_set_int( &headers->frame_size, "frame size", val );
+        return achd_set_int( headers, &headers->frame_size, "frame size", val );
     } else if( 0 == strcasecmp(key, "frame-count")) {
-        achd_set_int( &headers->frame_count, "frame count", val );
+        return achd_set_int( headers, &headers->frame_count, "frame count", val );
     } else if( 0 == strcasecmp(key, "remote-port")) {
-        achd_set_int( &headers->remote_port, "remote port", val );
+        return achd_set_int( headers, &headers->remote_port, "remote port", val );
     } else if( 0 == strcasecmp(key, "local-port")) {
-        achd_set_int( &headers->local_port, "local port", val );
+        return achd_set_int( headers, &headers->local_port, "local port", val );
     } else if( 0 == strcasecmp(key, "remote-host")) {
         headers->remote_host = strdup(val);
     } else if( 0 == strcasecmp(key, "period-ns")) {
-        achd_set_ul( &headers->period_ns, "period-ns", val );
+        return achd_set_ul( headers, &headers->period_ns, "period-ns", val );
+    } else if( 0 == strcasecmp(key, "delta-keyframe")) {
+        return achd_set_int( headers, &headers->delta_keyframe, "delta key frame interval", val );
+    } else if( 0 == strcasecmp(key, "compression")) {
+        if( strcasecmp(val, "lz") && strcasecmp(val, "none") ) {
+            return header_error( headers, "Unsupported compression: %s", val );
+        }
+        headers->compression = strdup(val);
+    } else if( 0 == strcasecmp(key, "timestamps")) {
+        return achd_set_boolean( headers, &headers->timestamps, "timestamps", val );
+    } else if( 0 == strcasecmp(key, "resume-seq")) {
+        headers->resume = 1;
+        return achd_set_u64( headers, &headers->resume_seq, "resume-seq", val );
     } else if( 0 == strcasecmp(key, "get-last")) {
-        headers->get_last = achd_parse_boolean( val );
+        return achd_set_boolean( headers, &headers->get_last, "get-last", val );
     } else if( 0 == strcasecmp(key, "transport")) {
         headers->transport = strdup(val);
+    } else if( 0 == strcasecmp(key, "udp-paths")) {
+        headers->udp_paths = strdup(val);
     } else if( 0 == strcasecmp(key, "tcp-nodelay")) {
-        headers->tcp_nodelay = achd_parse_boolean( val );
+        return achd_set_boolean( headers, &headers->tcp_nodelay, "tcp-nodelay", val );
     } else if( 0 == strcasecmp(key, "retry")) {
-        headers->retry = achd_parse_boolean( val );
+        return achd_set_boolean( headers, &headers->retry, "retry", val );
     } else if( 0 == strcasecmp(key, "direction")) {
         if( 0 == strcasecmp(val, "push") ) headers->direction = ACHD_DIRECTION_PUSH;
         else if( 0 == strcasecmp(val, "pull") ) headers->direction = ACHD_DIRECTION_PULL;
-        else {
-            cx.error( ACH_BAD_HEADER, "Invalid direction: %s\n", val);
-            abort();
-        }
+        else return header_error( headers, "Invalid direction: %s", val );
     } else if ( 0 == strcasecmp(key, "status") ) {
-        achd_set_status( &headers->status, "status", val );
+        return achd_set_status( headers, &headers->status, "status", val );
     } else if ( 0 == strcasecmp(key, "message") ) {
         headers->message = strdup(val);
     } else {
-        cx.error( ACH_BAD_HEADER, "Invalid header: `%s: %s'\n", key, val );
+        return header_error( headers, "Invalid header: `%s: %s'", key, val );
     }
+    return ACH_OK;
 }
 
 
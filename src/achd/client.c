@@ -71,6 +71,12 @@
 
 static int socket_connect(void);
 static int server_connect( struct achd_conn*);
+static int standalone_connect( struct achd_conn*);
+static void channel_open( int frame_size, int frame_count );
+static void codec_setup( struct achd_conn *conn );
+
+/* The host came from an SRV record, look it up again on reconnect */
+static int srv_lookup = 0;
 
 void achd_client() {
     /* open log */
@@ -96,9 +102,15 @@ void achd_client() {
         conn.send_hdr.chan_name = cx.cl_opts.chan_name;
     }
 
+    conn.vtab = achd_get_vtab( cx.cl_opts.transport, cx.cl_opts.direction );
+    assert( conn.vtab && conn.vtab->handler );
+
     /* Determine remote host */
     if( opt_posarg[1] ) {
         cx.cl_opts.remote_host = opt_posarg[0];
+    } else if( conn.vtab->standalone ) {
+        cx.error( ACH_BAD_HEADER, "No address given for %s transport\n", cx.cl_opts.transport );
+        assert(0);
     } else {
         /* DNS Lookup */
         char host[512];
@@ -109,12 +121,10 @@ void achd_client() {
         }
         // TODO: port
         cx.cl_opts.remote_host = strdup(host);
+        srv_lookup = 1;
     }
 
     /* Create request headers */
-    conn.vtab = achd_get_vtab( cx.cl_opts.transport, cx.cl_opts.direction );
-    assert( conn.vtab && conn.vtab->handler );
-
     assert( cx.cl_opts.transport );
     assert( cx.cl_opts.direction == ACHD_DIRECTION_PUSH ||
             cx.cl_opts.direction == ACHD_DIRECTION_PULL );
@@ -122,6 +132,13 @@ void achd_client() {
 
     conn.send_hdr.period_ns = cx.cl_opts.period_ns;
     conn.send_hdr.get_last = cx.cl_opts.get_last;
+    conn.send_hdr.delta_keyframe = cx.cl_opts.delta_keyframe;
+    conn.send_hdr.compression = cx.cl_opts.compression;
+    conn.send_hdr.timestamps = cx.cl_opts.timestamps;
+    /* a reconnecting TCP pull picks up where it left off */
+    conn.send_hdr.resume = cx.reconnect &&
+        ACHD_DIRECTION_PULL == cx.cl_opts.direction &&
+        0 == strcasecmp( cx.cl_opts.transport, "tcp" );
 
     sighandler_install();
 
@@ -144,7 +161,7 @@ void achd_client() {
     /* Start the show */
 
     /* Open initial connection */
-    int fd = server_connect( &conn );
+    int fd = conn.vtab->standalone ? standalone_connect( &conn ) : server_connect( &conn );
     if( fd < 0 ) {
         ACH_DIE( "Couldn't connect to server\n" );
     }
@@ -202,11 +219,55 @@ send_headers( int fd, const struct achd_headers *hdr, enum achd_direction dir )
         if( ACH_OK != r ) return r;
     }
 
+    /* maybe request delta encoding */
+    if( hdr->delta_keyframe ) {
+        r = achd_printf( fd,
+                         "delta-keyframe: %d\n",
+                         hdr->delta_keyframe );
+        if( ACH_OK != r ) return r;
+    }
+
+    /* maybe request compression */
+    if( hdr->compression ) {
+        r = achd_printf( fd,
+                         "compression: %s\n",
+                         hdr->compression );
+        if( ACH_OK != r ) return r;
+    }
+
+    /* maybe request timestamps */
+    if( hdr->timestamps ) {
+        r = achd_printf( fd, "timestamps: 1\n" );
+        if( ACH_OK != r ) return r;
+    }
+
+    /* maybe ask to resume */
+    if( hdr->resume ) {
+        r = achd_printf( fd, "resume-seq: %" PRIu64 "\n", hdr->resume_seq );
+        if( ACH_OK != r ) return r;
+    }
+
     /* end of headers */
     return  achd_printf(fd, ".\n");
 }
 
+/* Follow the channel if its SRV record moved to another host.  The
+ * lookup is cached, so this rarely waits on the network. */
+static void srv_refresh( const char *chan_name ) {
+    char host[512];
+    int port;
+    if( ACH_OK != ach_srv_search( chan_name, "local", host, sizeof(host), &port ) ) {
+        ACH_LOG( LOG_DEBUG, "Could not refresh host for channel '%s', using %s\n",
+                 chan_name, cx.cl_opts.remote_host );
+    } else if( strcmp( host, cx.cl_opts.remote_host ) ) {
+        ACH_LOG( LOG_NOTICE, "Channel '%s' moved to %s\n", chan_name, host );
+        free( (char*)cx.cl_opts.remote_host );
+        cx.cl_opts.remote_host = strdup(host);
+    }
+}
+
 static int server_connect( struct achd_conn *conn) {
+    if( srv_lookup ) srv_refresh( conn->send_hdr.chan_name );
     ACH_LOG( LOG_NOTICE, "Connecting to %s:%d\n", cx.cl_opts.remote_host, cx.port );
     conn->in = conn->out = conn->aux = -1;
 
@@ -221,12 +282,16 @@ static int server_connect( struct achd_conn *conn) {
         ACH_LOG( LOG_DEBUG, "Socket connected\n");
     }
 
-    /* Write request */
+    /* Write request, all in one segment */
     {
+        achd_hdr_begin( fd );
         conn->in = conn->out = fd;
         if( conn->vtab->connect ) conn->vtab->connect(conn);
         conn->in = conn->out = -1;
+        conn->send_hdr.resume_seq = conn->resume_seq;
         enum ach_status r = send_headers( fd, &conn->send_hdr, cx.cl_opts.direction );
+        enum ach_status r_end = achd_hdr_end( fd );
+        if( ACH_OK == r ) r = r_end;
 
         if( ACH_OK != r ) {
             ACH_LOG(LOG_DEBUG, "couldn't send headers\n");
@@ -239,10 +304,25 @@ static int server_connect( struct achd_conn *conn) {
 
     /* Get Response */
     conn->recv_hdr.status = ACH_BUG;
+    conn->recv_hdr.delta_keyframe = 0;
+    conn->recv_hdr.compression = NULL;
+    conn->recv_hdr.timestamps = 0;
+    conn->recv_hdr.resume = 0;
     {
         enum ach_status r = achd_parse_headers( fd, &conn->recv_hdr );
+        if( ACH_BAD_HEADER == conn->recv_hdr.status && conn->send_hdr.resume ) {
+            /* Servers from before resume reject the header, quoting
+             * it in a message line we may not parse, so ask again
+             * without it */
+            ACH_LOG( LOG_NOTICE, "Server refused to resume, reconnecting without resume\n" );
+            close( fd );
+            conn->send_hdr.resume = 0;
+            return server_connect( conn );
+        }
         if( ACH_OK != r ) {
-            if( errno ) {
+            if( conn->recv_hdr.error[0] ) {
+                cx.error( r, "Bad response from server: %s\n", conn->recv_hdr.error );
+            } else if( errno ) {
                 cx.error( r, "Bad response from server: %s\n", strerror(errno) );
             } else {
                 cx.error( r, "Bad response from server\n");
@@ -262,26 +342,75 @@ static int server_connect( struct achd_conn *conn) {
 
     /* Try to create channel if needed */
     if( ! cx.channel.shm ) {
-        ach_status_t r = ach_open(&cx.channel, cx.cl_opts.chan_name, NULL);
-        if( ACH_ENOENT == r) {
-            int frame_size = conn->recv_hdr.frame_size ? conn->recv_hdr.frame_size : ACH_DEFAULT_FRAME_SIZE;
-            int frame_count = conn->recv_hdr.frame_count ? conn->recv_hdr.frame_count : ACH_DEFAULT_FRAME_COUNT;
-            /* Fixme: should sanity check these counts */
-            r = ach_create( cx.cl_opts.chan_name, (size_t)frame_count, (size_t)frame_size, NULL );
-            if( ACH_OK != r )  cx.error( r, "Couldn't create channel\n");
-            r = ach_open( &cx.channel, cx.cl_opts.chan_name, NULL );
-            if( ACH_OK != r )  cx.error( r, "Couldn't open channel\n");
-        } else if (ACH_OK != r ) {
-            cx.error( r, "Couldn't open channel\n");
-        }
-        r = ach_flush(&cx.channel );
-        if( ACH_OK != r )  cx.error( r, "Couldn't flush channel\n");
+        channel_open( conn->recv_hdr.frame_size, conn->recv_hdr.frame_count );
+    }
+
+    /* Server must acknowledge the encoding */
+    if( conn->send_hdr.delta_keyframe != conn->recv_hdr.delta_keyframe ) {
+        cx.error( ACH_BAD_HEADER, "Server did not accept delta encoding\n" );
+    }
+    if( conn->send_hdr.compression &&
+        ( !conn->recv_hdr.compression ||
+          strcasecmp(conn->send_hdr.compression, conn->recv_hdr.compression) ) )
+    {
+        cx.error( ACH_BAD_HEADER, "Server did not accept compression\n" );
+    }
+    if( conn->send_hdr.timestamps && !conn->recv_hdr.timestamps ) {
+        cx.error( ACH_BAD_HEADER, "Server did not accept timestamps\n" );
     }
+    codec_setup( conn );
+
+    /* the server may decline, e.g., for kernel channels */
+    conn->resume = conn->send_hdr.resume && conn->recv_hdr.resume;
 
     return conn->in = conn->out = fd;
 }
 
 
+/* Transports without a server only need the channel and their socket */
+static int standalone_connect( struct achd_conn *conn ) {
+    ACH_LOG( LOG_NOTICE, "Using %s %s:%d\n", cx.cl_opts.transport, cx.cl_opts.remote_host, cx.port );
+    conn->in = conn->out = conn->aux = -1;
+    clock_gettime( ACH_DEFAULT_CLOCK, &conn->t0 );
+
+    channel_open( 0, 0 );
+    codec_setup( conn );
+    conn->vtab->connect( conn );
+
+    return conn->aux;
+}
+
+static void channel_open( int frame_size, int frame_count ) {
+    ach_status_t r = ach_open(&cx.channel, cx.cl_opts.chan_name, NULL);
+    if( ACH_ENOENT == r) {
+        if( ! frame_size ) frame_size = ACH_DEFAULT_FRAME_SIZE;
+        if( ! frame_count ) frame_count = ACH_DEFAULT_FRAME_COUNT;
+        /* Fixme: should sanity check these counts */
+        r = ach_create( cx.cl_opts.chan_name, (size_t)frame_count, (size_t)frame_size, NULL );
+        if( ACH_OK != r )  cx.error( r, "Couldn't create channel\n");
+        r = ach_open( &cx.channel, cx.cl_opts.chan_name, NULL );
+        if( ACH_OK != r )  cx.error( r, "Couldn't open channel\n");
+    } else if (ACH_OK != r ) {
+        cx.error( r, "Couldn't open channel\n");
+    }
+    r = ach_flush(&cx.channel );
+    if( ACH_OK != r )  cx.error( r, "Couldn't flush channel\n");
+    cx.chan_name = cx.cl_opts.chan_name;
+}
+
+/* Start each connection with fresh codec state */
+static void codec_setup( struct achd_conn *conn ) {
+    if( conn->codec ) {
+        achd_codec_reset( conn->codec );
+    } else {
+        conn->codec = achd_codec_create( &conn->send_hdr, cx.channel.shm->data_size );
+    }
+    /* latency statistics carry over reconnects */
+    if( ! conn->latency ) {
+        conn->latency = achd_latency_create( &conn->send_hdr );
+    }
+}
+
 
 int achd_reconnect( struct achd_conn *conn) {
 
@@ -332,6 +461,8 @@ static int socket_connect() {
             ACH_LOG(LOG_ERR, "Couldn't connect: %s\n", strerror(errno));
             close(sockfd);
             sockfd = -1;
+        } else {
+            achd_nodelay( sockfd );
         }
     }
 
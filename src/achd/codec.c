@@ -0,0 +1,395 @@
+/*
+ * Copyright (c) 2015, Rice University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *     * Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials
+ *       provided with the distribution.
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written
+ *       permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Frame codecs for achd links.
+ *
+ * Each encoded frame starts with a flags byte and a 32-bit little
+ * endian sequence number.  Key frames carry the raw message.  Delta
+ * frames carry the message XORed with the previous one: the varint
+ * message size, then pairs of (zero-run, literal count) varints, each
+ * pair followed by its literal bytes.
+ *
+ * Deltas only decode against the frame just before them, so a
+ * receiver that loses a frame drops deltas until the next key frame.
+ *
+ * With compression, the key or delta payload may then be LZ
+ * compressed, stored as its varint size and the ach_lz_compress()
+ * block.  Payloads that don't shrink are sent as is, and after
+ * repeated failures we stop trying for a while.
+ */
+
+#include <time.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <syslog.h>
+
+#include "ach.h"
+#include "achutil.h"
+#include "achd.h"
+
+#define CODEC_HEADER 5
+#define CODEC_DELTA 0x1
+#define CODEC_LZ    0x2
+
+/* Most frames to skip compressing after failures */
+#define LZ_BACKOFF_MAX 64
+
+/* Shorter zero runs are cheaper to send as literals */
+#define DELTA_MIN_RUN 4
+
+#define VARINT_MAX 10
+
+struct achd_codec {
+    unsigned keyframe;   ///< key frame interval, 0 for no delta coding
+    int lz;              ///< whether to compress
+    unsigned lz_skip;    ///< frames left before trying compression again
+    unsigned lz_backoff; ///< next value for lz_skip on failure
+    size_t max_size;     ///< largest frame we will decode
+    uint32_t seq;        ///< sequence number of last frame
+    unsigned since_key;  ///< deltas since the last key frame
+    int prev_valid;      ///< whether prev holds frame seq
+    uint8_t *prev;       ///< last frame sent or received
+    size_t prev_size;
+    size_t prev_cap;
+    uint8_t *tmp;        ///< uncompressed payload
+    size_t tmp_cap;
+};
+
+static size_t put_varint( uint8_t *p, uint64_t x ) {
+    size_t i = 0;
+    while( x >= 0x80 ) {
+        p[i++] = (uint8_t)(x | 0x80);
+        x >>= 7;
+    }
+    p[i++] = (uint8_t)x;
+    return i;
+}
+
+static int get_varint( const uint8_t **pp, const uint8_t *end, uint64_t *px ) {
+    uint64_t x = 0;
+    unsigned shift;
+    const uint8_t *p = *pp;
+    for( shift = 0; p < end && shift < 64; shift += 7 ) {
+        uint8_t b = *p++;
+        x |= (uint64_t)(b & 0x7f) << shift;
+        if( !(b & 0x80) ) {
+            *pp = p;
+            *px = x;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static void put_u32( uint8_t *p, uint32_t x ) {
+    p[0] = (uint8_t)x;
+    p[1] = (uint8_t)(x >> 8);
+    p[2] = (uint8_t)(x >> 16);
+    p[3] = (uint8_t)(x >> 24);
+}
+
+static uint32_t get_u32( const uint8_t *p ) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 |
+        (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint8_t *tmp_reserve( struct achd_codec *codec, size_t n ) {
+    if( codec->tmp_cap < n ) {
+        free( codec->tmp );
+        codec->tmp = (uint8_t*)malloc( n );
+        codec->tmp_cap = n;
+    }
+    return codec->tmp;
+}
+
+static void prev_reserve( struct achd_codec *codec, size_t n ) {
+    if( codec->prev_cap < n ) {
+        free( codec->prev );
+        codec->prev = (uint8_t*)malloc( n );
+        codec->prev_cap = n;
+        codec->prev_size = 0;
+        codec->prev_valid = 0;
+    }
+}
+
+struct achd_codec *achd_codec_create( const struct achd_headers *hdr, size_t max_size ) {
+    int lz = hdr->compression && 0 == strcasecmp( hdr->compression, "lz" );
+    if( hdr->delta_keyframe <= 0 && !lz ) return NULL;
+
+    struct achd_codec *codec = (struct achd_codec*)calloc( 1, sizeof(*codec) );
+    codec->keyframe = hdr->delta_keyframe > 0 ? (unsigned)hdr->delta_keyframe : 0;
+    codec->lz = lz;
+    codec->max_size = max_size;
+    return codec;
+}
+
+void achd_codec_reset( struct achd_codec *codec ) {
+    if( codec ) {
+        codec->seq = 0;
+        codec->since_key = 0;
+        codec->prev_valid = 0;
+        codec->lz_skip = 0;
+        codec->lz_backoff = 0;
+    }
+}
+
+void achd_codec_destroy( struct achd_codec *codec ) {
+    if( codec ) {
+        free( codec->prev );
+        free( codec->tmp );
+        free( codec );
+    }
+}
+
+size_t achd_codec_bound( size_t n ) {
+    return CODEC_HEADER + n;
+}
+
+/* Write the delta from prev to buf into out.  Return the encoded
+ * length, or 0 if that would exceed limit. */
+static size_t delta_encode( const uint8_t *prev, size_t prev_size,
+                            const uint8_t *buf, size_t n,
+                            uint8_t *out, size_t limit )
+{
+#define X(j) ( buf[j] ^ ((j) < prev_size ? prev[j] : 0) )
+    uint8_t *p = out;
+    uint8_t *end = out + limit;
+    if( limit < VARINT_MAX ) return 0;
+    p += put_varint( p, n );
+
+    size_t i = 0;
+    while( i < n ) {
+        /* zero run */
+        size_t z = i;
+        while( z < n && 0 == X(z) ) z++;
+        /* literals, up to the next worthwhile zero run */
+        size_t lit_end = z, zeros = 0, j;
+        for( j = z; j < n; j++ ) {
+            if( X(j) ) {
+                zeros = 0;
+                lit_end = j+1;
+            } else if( ++zeros >= DELTA_MIN_RUN ) break;
+        }
+        if( (size_t)(end - p) < 2*VARINT_MAX + (lit_end - z) ) return 0;
+        p += put_varint( p, z - i );
+        p += put_varint( p, lit_end - z );
+        for( j = z; j < lit_end; j++ ) *p++ = X(j);
+        i = lit_end;
+    }
+    return (size_t)(p - out);
+#undef X
+}
+
+/* Apply delta from p to codec->prev */
+static int delta_decode( struct achd_codec *codec, const uint8_t *p, const uint8_t *end ) {
+    uint64_t size;
+    if( get_varint( &p, end, &size ) || size > codec->max_size ) return -1;
+
+    if( size > codec->prev_cap ) {
+        uint8_t *buf = (uint8_t*)malloc( size );
+        memcpy( buf, codec->prev, codec->prev_size );
+        free( codec->prev );
+        codec->prev = buf;
+        codec->prev_cap = size;
+    }
+    if( size > codec->prev_size ) {
+        memset( codec->prev + codec->prev_size, 0, size - codec->prev_size );
+    }
+
+    size_t i = 0;
+    while( i < size ) {
+        uint64_t z, lit;
+        if( get_varint( &p, end, &z ) ||
+            get_varint( &p, end, &lit ) ||
+            z > size - i ||
+            lit > size - i - z ||
+            lit > (uint64_t)(end - p) )
+        {
+            return -1;
+        }
+        i += z;
+        size_t k;
+        for( k = 0; k < lit; k++ ) codec->prev[i+k] ^= p[k];
+        p += lit;
+        i += lit;
+    }
+    if( p != end ) return -1;
+
+    codec->prev_size = size;
+    return 0;
+}
+
+/* Try to compress len bytes of payload to out.  Return the
+ * compressed size, or 0 if it didn't shrink. */
+static size_t lz_encode( struct achd_codec *codec, const uint8_t *payload, size_t len,
+                         uint8_t *out )
+{
+    if( codec->lz_skip ) {
+        codec->lz_skip--;
+        return 0;
+    }
+    size_t h = put_varint( out, len );
+    size_t c = (len > h) ? ach_lz_compress( payload, len, out + h, len - h ) : 0;
+    if( c ) {
+        codec->lz_backoff = 0;
+        return h + c;
+    }
+    /* incompressible, back off */
+    codec->lz_skip = codec->lz_backoff;
+    codec->lz_backoff = codec->lz_backoff ? 2*codec->lz_backoff : 1;
+    if( codec->lz_backoff > LZ_BACKOFF_MAX ) codec->lz_backoff = LZ_BACKOFF_MAX;
+    return 0;
+}
+
+void achd_encode( struct achd_codec *codec, const uint8_t *buf, size_t n,
+                  ach_pipe_frame_t **pframe, size_t *psize )
+{
+    size_t need = achd_codec_bound(n);
+    if( *psize < need ) {
+        free( *pframe );
+        *pframe = ach_pipe_alloc( need );
+        *psize = need;
+    }
+    uint8_t *out = (*pframe)->data;
+    uint8_t flags = 0;
+
+    /* Payload goes straight to out unless we will compress it */
+    const uint8_t *payload = buf;
+    size_t len = n;
+
+    /* Delta if we can and it's smaller, otherwise send a key frame */
+    if( codec->keyframe && codec->prev_valid && codec->since_key + 1 < codec->keyframe ) {
+        uint8_t *dst = codec->lz ? tmp_reserve( codec, n ) : out + CODEC_HEADER;
+        size_t dlen = delta_encode( codec->prev, codec->prev_size, buf, n, dst, n );
+        if( dlen ) {
+            flags |= CODEC_DELTA;
+            payload = dst;
+            len = dlen;
+        }
+    }
+    if( flags & CODEC_DELTA ) {
+        codec->since_key++;
+    } else {
+        codec->since_key = 0;
+    }
+
+    /* Maybe compress */
+    size_t clen = codec->lz ? lz_encode( codec, payload, len, out + CODEC_HEADER ) : 0;
+    if( clen ) {
+        flags |= CODEC_LZ;
+        len = clen;
+    } else if( payload != out + CODEC_HEADER ) {
+        memcpy( out + CODEC_HEADER, payload, len );
+    }
+
+    out[0] = flags;
+    put_u32( out + 1, ++codec->seq );
+    ach_pipe_set_size( *pframe, CODEC_HEADER + len );
+
+    /* Remember for the next delta */
+    if( codec->keyframe ) {
+        prev_reserve( codec, n );
+        memcpy( codec->prev, buf, n );
+        codec->prev_size = n;
+        codec->prev_valid = 1;
+    }
+}
+
+const uint8_t *achd_decode( struct achd_codec *codec, const uint8_t *buf, size_t n,
+                            size_t *out_size )
+{
+    if( n < CODEC_HEADER || (buf[0] & ~(CODEC_DELTA|CODEC_LZ)) ||
+        ((buf[0] & CODEC_DELTA) && !codec->keyframe) )
+    {
+        ACH_LOG( LOG_ERR, "Invalid encoded frame\n" );
+        codec->prev_valid = 0;
+        return NULL;
+    }
+    uint8_t flags = buf[0];
+    uint32_t seq = get_u32( buf + 1 );
+    const uint8_t *p = buf + CODEC_HEADER;
+    const uint8_t *end = buf + n;
+
+    if( (flags & CODEC_DELTA) &&
+        (!codec->prev_valid || seq != (uint32_t)(codec->seq + 1)) )
+    {
+        if( codec->prev_valid ) {
+            ACH_LOG( LOG_NOTICE, "Lost frame before %" PRIu32 ", waiting for key frame\n", seq );
+        }
+        codec->prev_valid = 0;
+        return NULL;
+    }
+
+    /* Decompress the payload */
+    if( flags & CODEC_LZ ) {
+        uint64_t len;
+        size_t size;
+        if( get_varint( &p, end, &len ) || len > codec->max_size ||
+            ach_lz_decompress( p, (size_t)(end - p), tmp_reserve(codec, (size_t)len),
+                               (size_t)len, &size ) ||
+            size != len )
+        {
+            ACH_LOG( LOG_ERR, "Invalid compressed frame %" PRIu32 "\n", seq );
+            codec->prev_valid = 0;
+            return NULL;
+        }
+        p = codec->tmp;
+        end = codec->tmp + size;
+    }
+
+    if( flags & CODEC_DELTA ) {
+        if( delta_decode( codec, p, end ) ) {
+            ACH_LOG( LOG_ERR, "Invalid delta frame %" PRIu32 "\n", seq );
+            codec->prev_valid = 0;
+            return NULL;
+        }
+    } else {
+        size_t size = (size_t)(end - p);
+        if( size > codec->max_size ) {
+            ACH_LOG( LOG_ERR, "Key frame too large: %" PRIuPTR " bytes\n", size );
+            codec->prev_valid = 0;
+            return NULL;
+        }
+        prev_reserve( codec, size );
+        memcpy( codec->prev, p, size );
+        codec->prev_size = size;
+        codec->prev_valid = 1;
+    }
+
+    codec->seq = seq;
+    *out_size = codec->prev_size;
+    return codec->prev;
+}
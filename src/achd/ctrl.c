@@ -0,0 +1,230 @@
+/*
+ * Copyright (c) 2015, Rice University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *     * Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials
+ *       provided with the distribution.
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written
+ *       permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Control messages on the TCP connection of achd links.
+ *
+ * Features where the receiver talks back to the sender, i.e.,
+ * latency pings and reliable UDP, exchange small "achctrl" frames
+ * over the TCP connection.  A pulling receiver reads them
+ * interleaved with data frames.  The sender's main thread blocks in
+ * ach_get(), so it answers from a separate thread, and a lock keeps
+ * the thread's writes from interleaving with the sender's frames.
+ */
+
+#define _GNU_SOURCE
+#include <time.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <poll.h>
+#include <syslog.h>
+
+#include "ach.h"
+#include "achutil.h"
+#include "achd.h"
+
+#define CTRL_SIZE 32
+
+/* how often the control thread checks for a stop */
+#define CTRL_POLL_MS 100
+
+struct achd_ctrl {
+    pthread_mutex_t lock;          ///< serializes writes to conn->out
+    pthread_t thread;
+    int running;
+    volatile sig_atomic_t stop;
+    volatile sig_atomic_t closed;  ///< the control thread saw the connection close
+};
+
+int achd_ctrl_wanted( const struct achd_conn *conn ) {
+    return conn->latency || conn->rudp;
+}
+
+ssize_t achd_ctrl_write( struct achd_conn *conn, enum achd_ctrl_type type,
+                         uint64_t a, uint64_t b, uint64_t c )
+{
+    uint8_t buf[sizeof(ach_pipe_frame_t) - 1 + CTRL_SIZE];
+    memset( buf, 0, sizeof(buf) );
+    ach_pipe_frame_t *frame = (ach_pipe_frame_t*)buf;
+    memcpy( frame->magic, "achctrl", 8 );
+    ach_pipe_set_size( frame, CTRL_SIZE );
+    frame->data[0] = (uint8_t)type;
+    achd_put_u64( frame->data + 8, a );
+    achd_put_u64( frame->data + 16, b );
+    achd_put_u64( frame->data + 24, c );
+
+    achd_ctrl_lock( conn );
+    ssize_t r = achd_write( conn->out, buf, sizeof(buf) );
+    achd_ctrl_unlock( conn );
+    return r;
+}
+
+static void ctrl_parse( const uint8_t *data, struct achd_ctrl_msg *msg ) {
+    msg->type = (enum achd_ctrl_type)data[0];
+    msg->arg[0] = achd_get_u64( data + 8 );
+    msg->arg[1] = achd_get_u64( data + 16 );
+    msg->arg[2] = achd_get_u64( data + 24 );
+}
+
+/*-- Sender --*/
+
+/* Answer the receiver till the connection closes or we are stopped */
+static void *ctrl_thread( void *arg ) {
+    struct achd_conn *conn = (struct achd_conn*)arg;
+    struct achd_ctrl *ctrl = conn->ctrl;
+    struct pollfd pfd = { .fd = conn->in, .events = POLLIN };
+
+    while( !ctrl->stop && !cx.sig_received ) {
+        int r = poll( &pfd, 1, CTRL_POLL_MS );
+        if( r < 0 && EINTR == errno ) continue;
+        if( r < 0 ) break;
+        if( 0 == r ) {
+            achd_rudp_idle( conn );
+            continue;
+        }
+
+        uint8_t buf[sizeof(ach_pipe_frame_t) - 1 + CTRL_SIZE];
+        const ach_pipe_frame_t *frame = (const ach_pipe_frame_t*)buf;
+        if( (ssize_t)sizeof(buf) != achd_read( conn->in, buf, sizeof(buf) ) ) break;
+        uint64_t now = achd_realtime_ns();
+        if( memcmp( "achctrl", frame->magic, 8 ) ||
+            CTRL_SIZE != ach_pipe_get_size( frame ) )
+        {
+            ACH_LOG( LOG_ERR, "Invalid control message\n" );
+            break;
+        }
+
+        struct achd_ctrl_msg msg;
+        ctrl_parse( frame->data, &msg );
+        if( ACHD_CTRL_PING == msg.type && conn->latency ) {
+            if( achd_latency_ping( conn, &msg, now ) < 0 ) break;
+        } else if( ACHD_CTRL_NACK == msg.type && conn->rudp ) {
+            achd_rudp_nack( conn, &msg );
+        } else {
+            ACH_LOG( LOG_ERR, "Unexpected control message %d\n", msg.type );
+            break;
+        }
+    }
+
+    ctrl->closed = 1;
+    return NULL;
+}
+
+void achd_ctrl_start( struct achd_conn *conn ) {
+    if( !achd_ctrl_wanted(conn) || conn->in < 0 ||
+        ACHD_DIRECTION_PUSH != conn->vtab->direction )
+    {
+        return;
+    }
+
+    if( !conn->ctrl ) {
+        conn->ctrl = (struct achd_ctrl*)calloc( 1, sizeof(*conn->ctrl) );
+        pthread_mutex_init( &conn->ctrl->lock, NULL );
+    }
+    struct achd_ctrl *ctrl = conn->ctrl;
+    if( ctrl->running ) return;
+
+    ctrl->stop = 0;
+    ctrl->closed = 0;
+
+    /* leave signals to the main thread */
+    sigset_t all, old;
+    sigfillset( &all );
+    pthread_sigmask( SIG_SETMASK, &all, &old );
+    int r = pthread_create( &ctrl->thread, NULL, ctrl_thread, conn );
+    pthread_sigmask( SIG_SETMASK, &old, NULL );
+
+    if( r ) {
+        cx.error( ACH_FAILED_SYSCALL, "Couldn't create control thread: %s\n", strerror(r) );
+    }
+    ctrl->running = 1;
+}
+
+void achd_ctrl_stop( struct achd_conn *conn ) {
+    struct achd_ctrl *ctrl = conn->ctrl;
+    if( !ctrl || !ctrl->running ) return;
+    ctrl->stop = 1;
+    pthread_join( ctrl->thread, NULL );
+    ctrl->running = 0;
+}
+
+int achd_ctrl_closed( struct achd_conn *conn ) {
+    return conn->ctrl && conn->ctrl->closed;
+}
+
+void achd_ctrl_lock( struct achd_conn *conn ) {
+    if( conn->ctrl ) pthread_mutex_lock( &conn->ctrl->lock );
+}
+
+void achd_ctrl_unlock( struct achd_conn *conn ) {
+    if( conn->ctrl ) pthread_mutex_unlock( &conn->ctrl->lock );
+}
+
+/*-- Receiver --*/
+
+int achd_ctrl_recv( struct achd_conn *conn, const ach_pipe_frame_t *hdr ) {
+    uint8_t data[CTRL_SIZE];
+    if( CTRL_SIZE != ach_pipe_get_size(hdr) ||
+        CTRL_SIZE != achd_read( conn->in, data, CTRL_SIZE ) )
+    {
+        ACH_LOG( LOG_ERR, "Invalid control message\n" );
+        return -1;
+    }
+    uint64_t now = achd_realtime_ns();
+
+    struct achd_ctrl_msg msg;
+    ctrl_parse( data, &msg );
+    if( ACHD_CTRL_PONG == msg.type && conn->latency ) {
+        achd_latency_pong( conn, &msg, now );
+    } else if( (ACHD_CTRL_SKIP == msg.type || ACHD_CTRL_HIGH == msg.type) && conn->rudp ) {
+        achd_rudp_ctrl( conn, &msg );
+    } else {
+        ACH_LOG( LOG_ERR, "Unexpected control message %d\n", msg.type );
+        return -1;
+    }
+    return 0;
+}
+
+int achd_ctrl_read( struct achd_conn *conn ) {
+    uint8_t buf[sizeof(ach_pipe_frame_t) - 1];
+    const ach_pipe_frame_t *hdr = (const ach_pipe_frame_t*)buf;
+    if( (ssize_t)sizeof(buf) != achd_read( conn->in, buf, sizeof(buf) ) ||
+        memcmp( "achctrl", hdr->magic, 8 ) )
+    {
+        return -1;
+    }
+    return achd_ctrl_recv( conn, hdr );
+}
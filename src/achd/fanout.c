@@ -0,0 +1,622 @@
+/*
+ * Copyright (c) 2015, Rice University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *     * Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials
+ *       provided with the distribution.
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written
+ *       permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Fan-out server.
+ *
+ * Under inetd, each pulling peer gets its own achd process that
+ * reads the channel for itself.  In fan-out mode, one process
+ * listens for TCP pulls of a single channel.  A reader thread gets
+ * each frame from the channel once into a reference counted buffer
+ * and queues the buffer to every peer.  The main thread writes the
+ * queues to the peers' sockets without blocking.  When a peer falls
+ * ACHD_FANOUT_QUEUE frames behind, its queue is cut to the latest
+ * frame; peers that asked for the latest frames only hold at most
+ * one frame waiting.  A listener thread accepts peers and starts a
+ * short-lived thread for each to read its request headers, so a slow
+ * peer does not hold up the others.  The latest frame stays cached,
+ * and new peers get it right away instead of waiting for the next
+ * put.
+ *
+ * Relay mode runs a pulling achd client in a child process to copy a
+ * remote channel locally, and fans out the local channel.
+ */
+
+#define _GNU_SOURCE
+#include <time.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <pthread.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <syslog.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "ach.h"
+#include "ach/private_posix.h"
+#include "achutil.h"
+#include "achd.h"
+
+/* how often threads check for a signal */
+#define FANOUT_POLL_MS 100
+
+struct fanout_buf {
+    unsigned refs;
+    size_t size;                   ///< capacity of frame
+    ach_pipe_frame_t *frame;
+    struct fanout_buf *next;       ///< free list
+};
+
+struct fanout_peer {
+    int fd;
+    struct sockaddr_in addr;
+    int last;                      ///< hold only the latest frame
+    struct fanout_buf *q[ACHD_FANOUT_QUEUE];
+    size_t head;
+    size_t cnt;
+    size_t off;                    ///< bytes of the head frame written
+    uint64_t dropped;
+};
+
+/* All below is protected by lock.  The reader thread only touches
+ * queued frames after the head, so the main thread may write the
+ * head without holding the lock. */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct fanout_peer **peers;
+static size_t n_peers;
+static size_t max_peers;
+static struct fanout_buf *free_bufs;
+static size_t n_free_bufs;
+static struct fanout_buf *latest;  ///< cached for new peers
+static size_t n_handshakes;        ///< handshake threads running
+
+static int wake[2] = {-1, -1};     ///< reader wakes the main thread
+
+static pthread_t listener;
+
+static size_t frame_bytes( const struct fanout_buf *b ) {
+    return sizeof(ach_pipe_frame_t) - 1 + ach_pipe_get_size(b->frame);
+}
+
+static struct fanout_buf *buf_get( size_t size ) {
+    pthread_mutex_lock( &lock );
+    struct fanout_buf *b = free_bufs;
+    if( b ) {
+        free_bufs = b->next;
+        n_free_bufs--;
+    }
+    pthread_mutex_unlock( &lock );
+
+    if( !b ) {
+        b = (struct fanout_buf*)calloc( 1, sizeof(*b) );
+    }
+    if( b->size < size ) {
+        free( b->frame );
+        b->frame = ach_pipe_alloc( size );
+        b->size = size;
+    }
+    b->refs = 1;
+    return b;
+}
+
+/* call with lock held */
+static void buf_unref( struct fanout_buf *b ) {
+    if( --b->refs ) return;
+    if( n_free_bufs < 2*ACHD_FANOUT_QUEUE ) {
+        b->next = free_bufs;
+        free_bufs = b;
+        n_free_bufs++;
+    } else {
+        free( b->frame );
+        free( b );
+    }
+}
+
+/* call with lock held */
+static void peer_push( struct fanout_peer *p, struct fanout_buf *b ) {
+    size_t max = p->last ? 2 : ACHD_FANOUT_QUEUE;
+    if( p->cnt >= max ) {
+        /* Too far behind, keep the head since it may be in the
+         * middle of a write. */
+        size_t i;
+        for( i = 1; i < p->cnt; i++ ) {
+            buf_unref( p->q[(p->head + i) % ACHD_FANOUT_QUEUE] );
+        }
+        p->dropped += p->cnt - 1;
+        p->cnt = 1;
+    }
+    p->q[(p->head + p->cnt) % ACHD_FANOUT_QUEUE] = b;
+    p->cnt++;
+    b->refs++;
+}
+
+/*-- Reader --*/
+
+/* Cache the last frame already in the channel, skipping older ones.
+ * Called before the threads start. */
+static void prime( void ) {
+    size_t size = cx.channel.shm->data_size / cx.channel.shm->index_cnt;
+    for(;;) {
+        struct fanout_buf *b = buf_get( size );
+        size_t frame_size = 0;
+        enum ach_status r = ach_get( &cx.channel, b->frame->data, b->size, &frame_size,
+                                     NULL, ACH_O_LAST );
+        if( ACH_OVERFLOW == r ) {
+            size = frame_size;
+            buf_unref( b );
+            continue;
+        }
+        if( ACH_OK == r || ACH_MISSED_FRAME == r ) {
+            ach_pipe_set_size( b->frame, frame_size );
+            latest = b;
+        } else {
+            buf_unref( b );
+        }
+        return;
+    }
+}
+
+static void *reader_thread( void *arg ) {
+    (void)arg;
+    size_t size = cx.channel.shm->data_size / cx.channel.shm->index_cnt;
+
+    while( !cx.sig_received ) {
+        struct fanout_buf *b = buf_get( size );
+        size_t frame_size = 0;
+        enum ach_status r = ach_get( &cx.channel, b->frame->data, b->size, &frame_size,
+                                     NULL, ACH_O_WAIT );
+        switch(r) {
+        case ACH_OK:
+        case ACH_MISSED_FRAME:
+            break;
+        case ACH_OVERFLOW:
+            ACH_LOG( LOG_NOTICE, "buffer too small, resizing to %" PRIuPTR "\n", frame_size );
+            size = frame_size;
+            /* fall through */
+        case ACH_CANCELED:
+            pthread_mutex_lock( &lock );
+            buf_unref( b );
+            pthread_mutex_unlock( &lock );
+            continue;
+        default:
+            cx.error( r, "Couldn't get frame\n" );
+        }
+        ach_pipe_set_size( b->frame, frame_size );
+
+        int idle = 0;
+        size_t i;
+        pthread_mutex_lock( &lock );
+        for( i = 0; i < n_peers; i++ ) {
+            if( 0 == peers[i]->cnt ) idle = 1;
+            peer_push( peers[i], b );
+        }
+        /* our reference moves to the cache */
+        if( latest ) buf_unref( latest );
+        latest = b;
+        pthread_mutex_unlock( &lock );
+
+        if( idle ) {
+            char c = 0;
+            ssize_t wr = write( wake[1], &c, 1 ); /* a full pipe is awake enough */
+            (void)wr;
+        }
+    }
+    return NULL;
+}
+
+/*-- Listener --*/
+
+/* Tell the peer why its request failed.  This only drops that peer. */
+static int reject( int fd, enum ach_status code, const char fmt[], ... ) {
+    char msg[ACHD_LINE_LENGTH];
+    va_list argp;
+    va_start( argp, fmt );
+    vsnprintf( msg, sizeof(msg), fmt, argp );
+    va_end( argp );
+
+    ACH_LOG( LOG_ERR, "%s\n", msg );
+    achd_printf( fd, "status: %d # %s\nmessage: %s\n.\n",
+                 code, ach_result_to_string(code), msg );
+    return -1;
+}
+
+static void free_headers( struct achd_headers *hdr ) {
+    free( (char*)hdr->chan_name );
+    free( (char*)hdr->remote_host );
+    free( (char*)hdr->compression );
+    free( (char*)hdr->transport );
+    free( (char*)hdr->udp_paths );
+    free( (char*)hdr->message );
+    memset( hdr, 0, sizeof(*hdr) );
+}
+
+/* Read the request from fd into hdr, return 0 if it is a pull we can
+ * serve */
+static int handshake( int fd, const struct sockaddr_in *addr, struct achd_headers *hdr ) {
+    struct timeval tv = { .tv_sec = ACHD_FANOUT_HANDSHAKE_SEC, .tv_usec = 0 };
+    if( setsockopt( fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv) ) ) {
+        ACH_LOG( LOG_WARNING, "Couldn't set receive timeout: %s\n", strerror(errno) );
+    }
+
+    enum ach_status r = achd_parse_headers( fd, hdr );
+    if( ACH_OK != r ) {
+        return reject( fd, r, "%s:%d bad headers: %s", inet_ntoa(addr->sin_addr),
+                       ntohs(addr->sin_port), hdr->error[0] ? hdr->error : strerror(errno) );
+    }
+    if( !hdr->chan_name || strcmp( hdr->chan_name, cx.chan_name ) ) {
+        return reject( fd, ACH_ENOENT, "Only channel %s is served here", cx.chan_name );
+    }
+    if( ACHD_DIRECTION_PUSH != hdr->direction ||
+        !hdr->transport || strcasecmp( hdr->transport, "tcp" ) )
+    {
+        return reject( fd, ACH_BAD_HEADER, "Fan-out only serves TCP pulls" );
+    }
+    if( hdr->delta_keyframe || hdr->compression || hdr->timestamps || hdr->period_ns ) {
+        return reject( fd, ACH_BAD_HEADER,
+                       "Fan-out does not support encoding, timestamps, or periods" );
+    }
+
+    r = achd_printf( fd,
+                     "frame-count: %" PRIuPTR "\n"
+                     "frame-size: %" PRIuPTR "\n"
+                     "status: %d # %s\n"
+                     ".\n",
+                     cx.channel.shm->index_cnt,
+                     cx.channel.shm->data_size / cx.channel.shm->index_cnt,
+                     ACH_OK, ach_result_to_string(ACH_OK) );
+    return ACH_OK == r ? 0 : -1;
+}
+
+struct handshake_arg {
+    int fd;
+    struct sockaddr_in addr;
+};
+
+static void *handshake_thread( void *arg ) {
+    struct handshake_arg *h = (struct handshake_arg*)arg;
+    int fd = h->fd;
+    struct sockaddr_in addr = h->addr;
+    free( h );
+
+    struct achd_headers hdr;
+    memset( &hdr, 0, sizeof(hdr) );
+    int bad = handshake( fd, &addr, &hdr );
+    int last = hdr.get_last;
+    free_headers( &hdr );
+
+    if( bad ) {
+        close( fd );
+    } else {
+        struct fanout_peer *p = (struct fanout_peer*)calloc( 1, sizeof(*p) );
+        p->fd = fd;
+        p->addr = addr;
+        p->last = last;
+
+        pthread_mutex_lock( &lock );
+        if( cx.sig_received ) {
+            /* too late, the main thread is closing peers */
+            close( fd );
+            free( p );
+        } else {
+            ACH_LOG( LOG_NOTICE, "serving %s:%d channel %s via fan-out\n",
+                     inet_ntoa(addr.sin_addr), ntohs(addr.sin_port), cx.chan_name );
+            if( n_peers == max_peers ) {
+                max_peers = max_peers ? 2*max_peers : 8;
+                peers = (struct fanout_peer**)realloc( peers, max_peers * sizeof(peers[0]) );
+            }
+            peers[n_peers++] = p;
+            if( latest ) peer_push( p, latest );
+        }
+        pthread_mutex_unlock( &lock );
+
+        char c = 0;
+        ssize_t wr = write( wake[1], &c, 1 );
+        (void)wr;
+    }
+
+    pthread_mutex_lock( &lock );
+    n_handshakes--;
+    pthread_mutex_unlock( &lock );
+    return NULL;
+}
+
+static void *listener_thread( void *arg ) {
+    int sock = *(int*)arg;
+    pthread_attr_t attr;
+    pthread_attr_init( &attr );
+    pthread_attr_setdetachstate( &attr, PTHREAD_CREATE_DETACHED );
+    while( !cx.sig_received ) {
+        struct pollfd pfd = { .fd = sock, .events = POLLIN, .revents = 0 };
+        if( poll( &pfd, 1, FANOUT_POLL_MS ) <= 0 ) continue;
+
+        struct sockaddr_in addr;
+        socklen_t len = sizeof(addr);
+        int fd = accept( sock, (struct sockaddr*)&addr, &len );
+        if( fd < 0 ) {
+            if( EINTR != errno && EAGAIN != errno && EWOULDBLOCK != errno ) {
+                ACH_LOG( LOG_ERR, "Couldn't accept: %s\n", strerror(errno) );
+            }
+            continue;
+        }
+
+        achd_nodelay( fd );
+
+        pthread_mutex_lock( &lock );
+        int busy = n_handshakes >= ACHD_FANOUT_HANDSHAKE_MAX;
+        if( !busy ) n_handshakes++;
+        pthread_mutex_unlock( &lock );
+        if( busy ) {
+            ACH_LOG( LOG_WARNING, "Too many pending handshakes, dropping %s:%d\n",
+                     inet_ntoa(addr.sin_addr), ntohs(addr.sin_port) );
+            close( fd );
+            continue;
+        }
+
+        struct handshake_arg *h = (struct handshake_arg*)malloc( sizeof(*h) );
+        h->fd = fd;
+        h->addr = addr;
+        pthread_t thread;
+        if( pthread_create( &thread, &attr, handshake_thread, h ) ) {
+            ACH_LOG( LOG_ERR, "Couldn't create handshake thread\n" );
+            free( h );
+            close( fd );
+            pthread_mutex_lock( &lock );
+            n_handshakes--;
+            pthread_mutex_unlock( &lock );
+        }
+    }
+    pthread_attr_destroy( &attr );
+    return NULL;
+}
+
+static int listen_sock( void ) {
+    int sock = socket( AF_INET, SOCK_STREAM, 0 );
+    if( sock < 0 ) {
+        cx.error( ACH_FAILED_SYSCALL, "Couldn't create socket: %s\n", strerror(errno) );
+    }
+    int one = 1;
+    if( setsockopt( sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one) ) ) {
+        ACH_LOG( LOG_WARNING, "Couldn't set SO_REUSEADDR: %s\n", strerror(errno) );
+    }
+    struct sockaddr_in addr;
+    memset( &addr, 0, sizeof(addr) );
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl( INADDR_ANY );
+    addr.sin_port = htons( (uint16_t)cx.port );
+    if( bind( sock, (struct sockaddr*)&addr, sizeof(addr) ) ) {
+        cx.error( ACH_FAILED_SYSCALL, "Couldn't bind to port %d: %s\n", cx.port, strerror(errno) );
+    }
+    if( listen( sock, SOMAXCONN ) ) {
+        cx.error( ACH_FAILED_SYSCALL, "Couldn't listen: %s\n", strerror(errno) );
+    }
+    return sock;
+}
+
+/*-- Writer --*/
+
+/* Write queued frames till the socket is full, return nonzero if
+ * the peer is gone */
+static int peer_write( struct fanout_peer *p ) {
+    for(;;) {
+        pthread_mutex_lock( &lock );
+        struct fanout_buf *b = p->cnt ? p->q[p->head] : NULL;
+        pthread_mutex_unlock( &lock );
+        if( !b ) return 0;
+
+        size_t size = frame_bytes( b );
+        ssize_t r = send( p->fd, (uint8_t*)b->frame + p->off, size - p->off,
+                          MSG_DONTWAIT | MSG_NOSIGNAL );
+        if( r < 0 ) {
+            if( EINTR == errno ) continue;
+            if( EAGAIN == errno || EWOULDBLOCK == errno ) return 0;
+            return -1;
+        }
+        p->off += (size_t)r;
+        if( p->off < size ) return 0;
+
+        p->off = 0;
+        pthread_mutex_lock( &lock );
+        p->head = (p->head + 1) % ACHD_FANOUT_QUEUE;
+        p->cnt--;
+        buf_unref( b );
+        pthread_mutex_unlock( &lock );
+    }
+}
+
+/* The pulling peer only writes to us when it closes */
+static int peer_read( struct fanout_peer *p ) {
+    uint8_t buf[64];
+    ssize_t r = recv( p->fd, buf, sizeof(buf), MSG_DONTWAIT );
+    if( 0 == r ) return -1;
+    if( r < 0 && EINTR != errno && EAGAIN != errno && EWOULDBLOCK != errno ) return -1;
+    return 0;
+}
+
+/* call with lock held */
+static void peer_close( size_t i ) {
+    struct fanout_peer *p = peers[i];
+    ACH_LOG( LOG_INFO, "Finished serving %s:%d, dropped %" PRIu64 " frames\n",
+             inet_ntoa(p->addr.sin_addr), ntohs(p->addr.sin_port), p->dropped );
+    while( p->cnt ) {
+        buf_unref( p->q[p->head] );
+        p->head = (p->head + 1) % ACHD_FANOUT_QUEUE;
+        p->cnt--;
+    }
+    close( p->fd );
+    free( p );
+    peers[i] = peers[--n_peers];
+}
+
+void achd_fanout( const char *chan_name ) {
+    openlog("achd-fanout", LOG_PID, LOG_DAEMON);
+
+    cx.chan_name = chan_name;
+    if( !cx.chan_name ) {
+        cx.error( ACH_BAD_HEADER, "No channel name given\n" );
+    }
+    enum ach_status r = ach_open( &cx.channel, cx.chan_name, NULL );
+    if( ACH_OK != r ) {
+        cx.error( r, "Couldn't open channel %s\n", cx.chan_name );
+    }
+    prime();
+
+    sighandler_install();
+    int sock = listen_sock();
+    if( pipe(wake) ||
+        fcntl( wake[0], F_SETFL, O_NONBLOCK ) ||
+        fcntl( wake[1], F_SETFL, O_NONBLOCK ) )
+    {
+        cx.error( ACH_FAILED_SYSCALL, "Couldn't create pipe: %s\n", strerror(errno) );
+    }
+
+    pthread_t reader;
+    if( pthread_create( &listener, NULL, listener_thread, &sock ) ||
+        pthread_create( &reader, NULL, reader_thread, NULL ) )
+    {
+        cx.error( ACH_FAILED_SYSCALL, "Couldn't create thread\n" );
+    }
+
+    ACH_LOG( LOG_NOTICE, "Fanning out channel %s on port %d\n", cx.chan_name, cx.port );
+    ach_notify(ACH_SIG_OK);
+
+    struct pollfd *pfd = NULL;
+    struct fanout_peer **pp = NULL;
+    size_t max_pfd = 0;
+    while( !cx.sig_received ) {
+        /* peers are only removed from this thread, so the pointers
+         * stay good without the lock */
+        pthread_mutex_lock( &lock );
+        size_t n = n_peers;
+        if( n + 1 > max_pfd ) {
+            max_pfd = max_peers + 1;
+            pfd = (struct pollfd*)realloc( pfd, max_pfd * sizeof(pfd[0]) );
+            pp = (struct fanout_peer**)realloc( pp, max_pfd * sizeof(pp[0]) );
+        }
+        pfd[0].fd = wake[0];
+        pfd[0].events = POLLIN;
+        size_t i;
+        for( i = 0; i < n; i++ ) {
+            pp[i] = peers[i];
+            pfd[i+1].fd = peers[i]->fd;
+            pfd[i+1].events = (short)(POLLIN | (peers[i]->cnt ? POLLOUT : 0));
+        }
+        pthread_mutex_unlock( &lock );
+
+        int k = poll( pfd, n + 1, FANOUT_POLL_MS );
+        if( k < 0 && EINTR != errno ) {
+            cx.error( ACH_FAILED_SYSCALL, "Couldn't poll: %s\n", strerror(errno) );
+        }
+        if( k <= 0 ) continue;
+
+        if( pfd[0].revents ) {
+            char buf[64];
+            while( read( wake[0], buf, sizeof(buf) ) > 0 );
+        }
+        for( i = 0; i < n; i++ ) {
+            short ev = pfd[i+1].revents;
+            if( ( (ev & (POLLIN | POLLERR | POLLHUP)) && peer_read( pp[i] ) ) ||
+                ( (ev & POLLOUT) && peer_write( pp[i] ) ) )
+            {
+                pthread_mutex_lock( &lock );
+                size_t j;
+                for( j = 0; j < n_peers && peers[j] != pp[i]; j++ );
+                peer_close( j );
+                pthread_mutex_unlock( &lock );
+            }
+        }
+    }
+
+    pthread_join( reader, NULL );
+    pthread_join( listener, NULL );
+    pthread_mutex_lock( &lock );
+    while( n_peers ) peer_close( n_peers - 1 );
+    if( latest ) buf_unref( latest );
+    latest = NULL;
+    pthread_mutex_unlock( &lock );
+    close( sock );
+    free( pfd );
+    free( pp );
+}
+
+void achd_relay( void ) {
+    const char *chan_name = opt_posarg[1];
+    if( !opt_posarg[0] || !chan_name ) {
+        cx.error( ACH_BAD_HEADER, "Relay needs a host and a channel name\n" );
+    }
+
+    /* copy the remote channel here */
+    cx.reconnect = 1;
+    pid_t pid = fork();
+    if( pid < 0 ) {
+        cx.error( ACH_FAILED_SYSCALL, "Couldn't fork: %s\n", strerror(errno) );
+    } else if( 0 == pid ) {
+        achd_client();
+        exit(EXIT_SUCCESS);
+    }
+
+    /* the client creates the channel once it hears from upstream */
+    sighandler_install();
+    while( !cx.sig_received ) {
+        ach_channel_t chan;
+        enum ach_status r = ach_open( &chan, chan_name, NULL );
+        if( ACH_OK == r ) {
+            r = ach_close( &chan );
+            if( ACH_OK != r ) {
+                ACH_LOG( LOG_ERR, "Couldn't close channel: %s\n", ach_result_to_string(r) );
+            }
+            break;
+        } else if( ACH_ENOENT != r ) {
+            kill( pid, SIGTERM );
+            cx.error( r, "Couldn't open channel %s\n", chan_name );
+        } else if( waitpid( pid, NULL, WNOHANG ) ) {
+            cx.error( ACH_FAILED_SYSCALL, "Relay client exited\n" );
+        }
+        usleep( 1000 * FANOUT_POLL_MS );
+    }
+
+    if( !cx.sig_received ) {
+        cx.port = cx.listen_port ? cx.listen_port : ACHD_PORT;
+        achd_fanout( chan_name );
+    }
+    kill( pid, SIGTERM );
+    waitpid( pid, NULL, 0 );
+}
@@ -59,7 +59,9 @@
 #include <errno.h>
 #include <syslog.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 
 #include "ach.h"
@@ -91,6 +93,45 @@ ssize_t achd_write(int fd, const void *buf, size_t cnt ) {
     return (ssize_t)cnt;
 }
 
+ssize_t achd_writev(int fd, struct iovec *iov, int iovcnt ) {
+    size_t cnt = 0;
+    int i;
+    for( i = 0; i < iovcnt; i++ ) cnt += iov[i].iov_len;
+
+    size_t n = 0;
+    while( !cx.sig_received && n < cnt ) {
+        ssize_t r = writev( fd, iov, iovcnt );
+        if( r > 0 ) {
+            n += (size_t)r;
+            /* skip what was written */
+            while( iovcnt > 0 && (size_t)r >= iov->iov_len ) {
+                r -= (ssize_t)iov->iov_len;
+                iov++;
+                iovcnt--;
+            }
+            if( iovcnt > 0 ) {
+                iov->iov_base = (uint8_t*)iov->iov_base + r;
+                iov->iov_len -= (size_t)r;
+            }
+        }
+        else if (EINTR == errno && !cx.sig_received) continue;
+        else return r;
+    }
+    return (ssize_t)cnt;
+}
+
+void achd_put_u64( uint8_t *p, uint64_t x ) {
+    int i;
+    for( i = 0; i < 8; i++ ) p[i] = (uint8_t)(x >> (8*i));
+}
+
+uint64_t achd_get_u64( const uint8_t *p ) {
+    uint64_t x = 0;
+    int i;
+    for( i = 0; i < 8; i++ ) x |= (uint64_t)p[i] << (8*i);
+    return x;
+}
+
 int achd_getc(int fd) {
     char c;
     ssize_t r = achd_read(fd, &c, 1);
@@ -121,6 +162,113 @@ enum ach_status achd_readline(int fd, char *buf, size_t cnt ) {
     return ACH_OVERFLOW;
 }
 
+void achd_nodelay( int fd ) {
+    int yes = 1;
+    if( setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes) ) ) {
+        ACH_LOG( LOG_DEBUG, "Couldn't set TCP_NODELAY: %s\n", strerror(errno) );
+    }
+}
+
+/* Is buf[0..n) a "." line, ignoring blanks? */
+static int is_dot_line( const char *buf, size_t n ) {
+    size_t i;
+    int dot = 0;
+    for( i = 0; i < n; i++ ) {
+        if( '.' == buf[i] && !dot ) dot = 1;
+        else if( ! isblank(buf[i]) && '\r' != buf[i] ) return 0;
+    }
+    return dot;
+}
+
+/* Offset just past the "." line ending a header block, or 0 */
+static size_t header_end( const char *buf, size_t n ) {
+    size_t start = 0;
+    const char *nl;
+    while( start < n && NULL != (nl = (const char*)memchr(buf+start, '\n', n-start)) ) {
+        size_t end = (size_t)(nl - buf);
+        if( is_dot_line( buf+start, end-start ) ) return end + 1;
+        start = end + 1;
+    }
+    return 0;
+}
+
+/* Non-sockets, e.g., the pipes of an ssh tunnel, cannot be peeked,
+ * so read them a line at a time */
+static enum ach_status read_headers_lines( int fd, char *buf, size_t cnt, size_t *len ) {
+    size_t n = 0;
+    for(;;) {
+        enum ach_status r = achd_readline( fd, buf+n, cnt-n );
+        if( ACH_OK != r ) return r;
+        size_t k = strlen(buf+n);
+        if( n + k + 1 >= cnt ) return ACH_OVERFLOW;
+        buf[n+k] = '\n';
+        n += k + 1;
+        if( is_dot_line(buf+n-k-1, k) ) {
+            buf[n] = '\0';
+            *len = n;
+            return ACH_OK;
+        }
+    }
+}
+
+enum ach_status achd_read_headers( int fd, char *buf, size_t cnt, size_t *len ) {
+    size_t have = 0;
+    while( !cx.sig_received ) {
+        ssize_t r;
+        if( 0 == have ) {
+            /* wait for anything */
+            r = recv( fd, buf, cnt-1, MSG_PEEK );
+        } else {
+            /* wait for more than we have, then take all of it */
+            r = recv( fd, buf, have+1, MSG_PEEK | MSG_WAITALL );
+            if( r > (ssize_t)have ) r = recv( fd, buf, cnt-1, MSG_PEEK | MSG_DONTWAIT );
+        }
+        if( r < 0 && ENOTSOCK == errno ) {
+            return read_headers_lines( fd, buf, cnt, len );
+        } else if( r < 0 && EINTR == errno ) {
+            continue;
+        } else if( r <= 0 ) {
+            return ACH_FAILED_SYSCALL;
+        }
+
+        size_t end = header_end( buf, (size_t)r );
+        if( end ) {
+            /* consume only the header block */
+            if( (ssize_t)end != achd_read( fd, buf, end ) ) return ACH_FAILED_SYSCALL;
+            buf[end] = '\0';
+            *len = end;
+            return ACH_OK;
+        } else if( (size_t)r >= cnt-1 ) {
+            return ACH_OVERFLOW;
+        }
+        have = (size_t)r;
+    }
+    return ACH_FAILED_SYSCALL;
+}
+
+/* Output of achd_printf() held for one write(), see achd_hdr_begin() */
+static __thread struct {
+    int fd;
+    size_t len;
+    char buf[ACHD_HEADER_LENGTH];
+} hdr_out = { .fd = -1, .len = 0 };
+
+void achd_hdr_begin( int fd ) {
+    hdr_out.fd = fd;
+    hdr_out.len = 0;
+}
+
+enum ach_status achd_hdr_end( int fd ) {
+    assert( fd == hdr_out.fd );
+    size_t n = hdr_out.len;
+    hdr_out.fd = -1;
+    hdr_out.len = 0;
+    if( 0 == n || (ssize_t)n == achd_write( fd, hdr_out.buf, n ) ) {
+        return ACH_OK;
+    }
+    return ACH_FAILED_SYSCALL;
+}
+
 enum ach_status achd_printf(int fd, const char fmt[], ...) {
     int n = ACHD_LINE_LENGTH-1;
     do {
@@ -133,6 +281,19 @@ enum ach_status achd_printf(int fd, const char fmt[], ...) {
             ACH_LOG( LOG_CRIT, "Error in printf\n");
             return ACH_BUG;
         } else if( (size_t)n < sizeof(buf) ) {
+            if( fd == hdr_out.fd ) {
+                /* hold for achd_hdr_end(), sending what is held if full */
+                if( hdr_out.len + (size_t)n > sizeof(hdr_out.buf) ) {
+                    enum ach_status r = achd_hdr_end( fd );
+                    achd_hdr_begin( fd );
+                    if( ACH_OK != r ) return r;
+                }
+                if( (size_t)n <= sizeof(hdr_out.buf) ) {
+                    memcpy( hdr_out.buf + hdr_out.len, buf, (size_t)n );
+                    hdr_out.len += (size_t)n;
+                    return ACH_OK;
+                }
+            }
             if ( (ssize_t)n == achd_write( fd, buf, (size_t)n ) ) {
                 return ACH_OK;
             } else {
@@ -0,0 +1,190 @@
+/*
+ * Copyright (c) 2015, Rice University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *     * Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials
+ *       provided with the distribution.
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written
+ *       permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Latency measurement for achd links.
+ *
+ * With timestamps on, the sender appends a trailer to each frame
+ * with the CLOCK_REALTIME times that ach_get() returned the frame and
+ * that the frame was sent.  The receiver adds its own times for the
+ * arrival and the finished ach_put(), and reports percentiles of
+ * each step.
+ *
+ * The clocks of the two hosts need not agree.  The receiver
+ * periodically sends a ping control message over the TCP connection,
+ * and the sender answers from its control thread.  From the four
+ * times of each exchange, the receiver estimates the clock offset
+ * and round trip time as in NTP, trusting the exchange with the
+ * lowest round trip time out of the last few.
+ */
+
+#define _GNU_SOURCE
+#include <time.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+
+#include "ach.h"
+#include "achutil.h"
+#include "achd.h"
+
+/* pings to filter for the lowest round trip time */
+#define PING_FILTER 8
+
+/* sample ring size per report */
+#define STATS_MAX 4096
+
+enum stat_leg {
+    LEG_HOLD,   ///< sender, ach_get() to send
+    LEG_NET,    ///< send to arrival
+    LEG_PUT,    ///< arrival to finished ach_put()
+    LEG_TOTAL,  ///< ach_get() to finished ach_put()
+    LEG_CNT
+};
+
+static const char *leg_name[LEG_CNT] = {"hold", "net", "put", "total"};
+
+struct achd_latency {
+    uint64_t ping_ns;
+    uint64_t report_ns;
+    size_t ping_cnt;
+    int64_t ping_offset[PING_FILTER];
+    int64_t ping_rtt[PING_FILTER];
+    int64_t offset_ns;             ///< sender clock minus receiver clock
+    int64_t rtt_ns;
+    size_t n;                      ///< samples since the last report
+    int64_t samples[LEG_CNT][STATS_MAX];
+};
+
+uint64_t achd_realtime_ns( void ) {
+    struct timespec ts;
+    clock_gettime( CLOCK_REALTIME, &ts );
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+struct achd_latency *achd_latency_create( const struct achd_headers *hdr ) {
+    if( !hdr->timestamps ) return NULL;
+    struct achd_latency *lat = (struct achd_latency*)calloc( 1, sizeof(*lat) );
+    lat->report_ns = achd_realtime_ns();
+    return lat;
+}
+
+void achd_stamp( uint8_t *stamp, uint64_t get_ns, uint64_t send_ns ) {
+    achd_put_u64( stamp, get_ns );
+    achd_put_u64( stamp + 8, send_ns );
+}
+
+/*-- Sender --*/
+
+int achd_latency_ping( struct achd_conn *conn, const struct achd_ctrl_msg *msg, uint64_t recv_ns ) {
+    ssize_t r = achd_ctrl_write( conn, ACHD_CTRL_PONG, msg->arg[0], recv_ns,
+                                 achd_realtime_ns() );
+    return r < 0 ? -1 : 0;
+}
+
+/*-- Receiver --*/
+
+void achd_latency_pong( struct achd_conn *conn, const struct achd_ctrl_msg *msg, uint64_t t4 ) {
+    struct achd_latency *lat = conn->latency;
+    int64_t t1 = (int64_t)msg->arg[0];
+    int64_t t2 = (int64_t)msg->arg[1];
+    int64_t t3 = (int64_t)msg->arg[2];
+
+    size_t i = lat->ping_cnt++ % PING_FILTER;
+    lat->ping_offset[i] = ((t2 - t1) + (t3 - (int64_t)t4)) / 2;
+    lat->ping_rtt[i] = ((int64_t)t4 - t1) - (t3 - t2);
+
+    /* trust the fastest recent exchange */
+    size_t j, k = 0, m = lat->ping_cnt < PING_FILTER ? lat->ping_cnt : PING_FILTER;
+    for( j = 1; j < m; j++ ) {
+        if( lat->ping_rtt[j] < lat->ping_rtt[k] ) k = j;
+    }
+    lat->offset_ns = lat->ping_offset[k];
+    lat->rtt_ns = lat->ping_rtt[k];
+}
+
+static int cmp_i64( const void *a, const void *b ) {
+    int64_t x = *(const int64_t*)a, y = *(const int64_t*)b;
+    return (x > y) - (x < y);
+}
+
+static void report( struct achd_latency *lat, uint64_t now ) {
+    size_t n = lat->n < STATS_MAX ? lat->n : STATS_MAX;
+    char buf[512];
+    int len = snprintf( buf, sizeof(buf), "latency, %" PRIuPTR " frames, offset %.3f ms, rtt %.3f ms%s",
+                        lat->n, (double)lat->offset_ns / 1e6, (double)lat->rtt_ns / 1e6,
+                        lat->ping_cnt ? "" : " (no pings)" );
+    int leg;
+    for( leg = 0; leg < LEG_CNT && len > 0 && (size_t)len < sizeof(buf); leg++ ) {
+        int64_t *s = lat->samples[leg];
+        qsort( s, n, sizeof(s[0]), cmp_i64 );
+        len += snprintf( buf + len, sizeof(buf) - (size_t)len,
+                         "; %s p50/p90/p99/max %.3f/%.3f/%.3f/%.3f ms",
+                         leg_name[leg],
+                         (double)s[n/2] / 1e6,
+                         (double)s[(n*9)/10] / 1e6,
+                         (double)s[(n*99)/100] / 1e6,
+                         (double)s[n-1] / 1e6 );
+    }
+    ACH_LOG( LOG_NOTICE, "%s\n", buf );
+    lat->n = 0;
+    lat->report_ns = now;
+}
+
+void achd_latency_frame( struct achd_conn *conn, const uint8_t *stamp,
+                         uint64_t recv_ns, uint64_t put_ns )
+{
+    struct achd_latency *lat = conn->latency;
+    int64_t get_ns = (int64_t)achd_get_u64( stamp ) - lat->offset_ns;
+    int64_t send_ns = (int64_t)achd_get_u64( stamp + 8 ) - lat->offset_ns;
+
+    size_t i = lat->n++ % STATS_MAX;
+    lat->samples[LEG_HOLD][i] = send_ns - get_ns;
+    lat->samples[LEG_NET][i] = (int64_t)recv_ns - send_ns;
+    lat->samples[LEG_PUT][i] = (int64_t)put_ns - (int64_t)recv_ns;
+    lat->samples[LEG_TOTAL][i] = (int64_t)put_ns - get_ns;
+
+    /* maybe ping and report */
+    if( conn->out >= 0 && put_ns - lat->ping_ns >= ACHD_PING_NS ) {
+        lat->ping_ns = put_ns;
+        if( achd_ctrl_write( conn, ACHD_CTRL_PING, put_ns, 0, 0 ) < 0 ) {
+            ACH_LOG( LOG_DEBUG, "Couldn't send ping\n" );
+        }
+    }
+    if( put_ns - lat->report_ns >= ACHD_STATS_NS ) {
+        report( lat, put_ns );
+    }
+}
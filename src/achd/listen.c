@@ -0,0 +1,233 @@
+/*
+ * Copyright (c) 2015, Rice University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *     * Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials
+ *       provided with the distribution.
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written
+ *       permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Standalone server.
+ *
+ * Without inetd, "achd listen" accepts connections itself.  It runs
+ * COUNT worker processes, each pinned to one CPU and listening on its
+ * own SO_REUSEPORT socket bound to the same port, so the kernel
+ * spreads incoming connections across the workers' accept queues
+ * instead of funneling them through one.  Each accepted connection is
+ * served by a child of its worker, just as inetd would run "achd
+ * serve".  Workers open no channels; each child opens only the
+ * channel its peer asks for.  The parent restarts workers that die.
+ */
+
+#define _GNU_SOURCE
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <syslog.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "ach.h"
+#include "ach/private_posix.h"
+#include "achutil.h"
+#include "achd.h"
+
+/* how often processes check for a signal */
+#define LISTEN_POLL_MS 100
+
+static int listen_sock( int reuseport ) {
+    int sock = socket( AF_INET, SOCK_STREAM, 0 );
+    if( sock < 0 ) {
+        cx.error( ACH_FAILED_SYSCALL, "Couldn't create socket: %s\n", strerror(errno) );
+    }
+    int one = 1;
+    if( setsockopt( sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one) ) ) {
+        ACH_LOG( LOG_WARNING, "Couldn't set SO_REUSEADDR: %s\n", strerror(errno) );
+    }
+#ifdef SO_REUSEPORT
+    if( reuseport && setsockopt( sock, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one) ) ) {
+        cx.error( ACH_FAILED_SYSCALL, "Couldn't set SO_REUSEPORT: %s\n", strerror(errno) );
+    }
+#else
+    (void)reuseport;
+#endif
+    struct sockaddr_in addr;
+    memset( &addr, 0, sizeof(addr) );
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl( INADDR_ANY );
+    addr.sin_port = htons( (uint16_t)cx.port );
+    if( bind( sock, (struct sockaddr*)&addr, sizeof(addr) ) ) {
+        cx.error( ACH_FAILED_SYSCALL, "Couldn't bind to port %d: %s\n", cx.port, strerror(errno) );
+    }
+    if( listen( sock, SOMAXCONN ) ) {
+        cx.error( ACH_FAILED_SYSCALL, "Couldn't listen: %s\n", strerror(errno) );
+    }
+    return sock;
+}
+
+/* Pin the calling process to the i-th CPU it may run on */
+static void pin( int i ) {
+    cpu_set_t set;
+    if( sched_getaffinity( 0, sizeof(set), &set ) ) {
+        ACH_LOG( LOG_WARNING, "Couldn't get CPU affinity: %s\n", strerror(errno) );
+        return;
+    }
+    int n = CPU_COUNT( &set );
+    int k = i % n;
+    int cpu;
+    for( cpu = 0; cpu < CPU_SETSIZE; cpu++ ) {
+        if( CPU_ISSET( cpu, &set ) && 0 == k-- ) break;
+    }
+    CPU_ZERO( &set );
+    CPU_SET( cpu, &set );
+    if( sched_setaffinity( 0, sizeof(set), &set ) ) {
+        ACH_LOG( LOG_WARNING, "Couldn't pin worker %d to CPU %d: %s\n", i, cpu, strerror(errno) );
+    } else {
+        ACH_LOG( LOG_DEBUG, "Worker %d on CPU %d\n", i, cpu );
+    }
+}
+
+/* Serve the peer on fd in this child, as under inetd */
+static void serve_child( int sock, int fd ) {
+    close( sock );
+    if( SIG_ERR == signal( SIGCHLD, SIG_DFL ) ||
+        dup2( fd, STDIN_FILENO ) < 0 ||
+        dup2( fd, STDOUT_FILENO ) < 0 )
+    {
+        ACH_LOG( LOG_ERR, "Couldn't set up server: %s\n", strerror(errno) );
+        exit(EXIT_FAILURE);
+    }
+    close( fd );
+    cx.mode = ACHD_MODE_SERVE;
+    cx.error = achd_error_header;
+    achd_serve();
+    exit(EXIT_SUCCESS);
+}
+
+static void worker( int i ) {
+    if( cx.workers > 1 ) pin( i );
+    int sock = listen_sock( cx.workers > 1 );
+
+    /* children are served on their own */
+    if( SIG_ERR == signal( SIGCHLD, SIG_IGN ) ) {
+        cx.error( ACH_FAILED_SYSCALL, "Couldn't ignore SIGCHLD: %s\n", strerror(errno) );
+    }
+
+    while( !cx.sig_received ) {
+        struct pollfd pfd = { .fd = sock, .events = POLLIN, .revents = 0 };
+        if( poll( &pfd, 1, LISTEN_POLL_MS ) <= 0 ) continue;
+
+        struct sockaddr_in addr;
+        socklen_t len = sizeof(addr);
+        int fd = accept( sock, (struct sockaddr*)&addr, &len );
+        if( fd < 0 ) {
+            if( EINTR != errno && EAGAIN != errno && EWOULDBLOCK != errno &&
+                ECONNABORTED != errno )
+            {
+                ACH_LOG( LOG_ERR, "Couldn't accept: %s\n", strerror(errno) );
+            }
+            continue;
+        }
+        ACH_LOG( LOG_DEBUG, "Worker %d accepted %s:%d\n",
+                 i, inet_ntoa(addr.sin_addr), ntohs(addr.sin_port) );
+
+        pid_t pid = fork();
+        if( 0 == pid ) {
+            serve_child( sock, fd );
+        } else if( pid < 0 ) {
+            ACH_LOG( LOG_ERR, "Couldn't fork: %s\n", strerror(errno) );
+        }
+        close( fd );
+    }
+    close( sock );
+}
+
+static pid_t spawn( int i ) {
+    pid_t pid = fork();
+    if( 0 == pid ) {
+        worker( i );
+        exit(EXIT_SUCCESS);
+    } else if( pid < 0 ) {
+        cx.error( ACH_FAILED_SYSCALL, "Couldn't fork: %s\n", strerror(errno) );
+    }
+    return pid;
+}
+
+void achd_listen( void ) {
+    openlog("achd-listen", LOG_PID, LOG_DAEMON);
+    sighandler_install();
+
+    if( cx.workers <= 0 ) {
+        cpu_set_t set;
+        cx.workers = sched_getaffinity( 0, sizeof(set), &set ) ? 1 : CPU_COUNT( &set );
+    }
+#ifndef SO_REUSEPORT
+    if( cx.workers > 1 ) {
+        ACH_LOG( LOG_WARNING, "SO_REUSEPORT is unavailable, using one worker\n" );
+        cx.workers = 1;
+    }
+#endif
+
+    /* Check the port now, so a bad one fails here and not in each
+     * worker */
+    close( listen_sock( cx.workers > 1 ) );
+
+    pid_t *pids = (pid_t*)calloc( (size_t)cx.workers, sizeof(pids[0]) );
+    int i;
+    for( i = 0; i < cx.workers; i++ ) pids[i] = spawn( i );
+
+    ACH_LOG( LOG_NOTICE, "Listening on port %d with %d workers\n", cx.port, cx.workers );
+    ach_notify(ACH_SIG_OK);
+
+    while( !cx.sig_received ) {
+        int status;
+        pid_t pid = waitpid( -1, &status, WNOHANG );
+        if( pid <= 0 ) {
+            usleep( 1000 * LISTEN_POLL_MS );
+            continue;
+        }
+        for( i = 0; i < cx.workers && pids[i] != pid; i++ );
+        if( i < cx.workers && !cx.sig_received ) {
+            ACH_LOG( LOG_ERR, "Worker %d exited, restarting\n", i );
+            pids[i] = spawn( i );
+        }
+    }
+
+    for( i = 0; i < cx.workers; i++ ) kill( pids[i], SIGTERM );
+    for( i = 0; i < cx.workers; i++ ) waitpid( pids[i], NULL, 0 );
+    free( pids );
+}
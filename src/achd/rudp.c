@@ -0,0 +1,411 @@
+/*
+ * Copyright (c) 2015, Rice University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *     * Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials
+ *       provided with the distribution.
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written
+ *       permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Reliable UDP for achd links.
+ *
+ * Each datagram starts with the sequence number of the frame in the
+ * sender's channel.  The receiver delivers frames in order, holding
+ * up to ACHD_RUDP_WINDOW frames that arrive ahead of a gap, and
+ * NACKs missing frames over the TCP connection.  The sender's
+ * control thread answers NACKs by looking the frames up in the
+ * channel with ach_get_seq(), or with a SKIP if they were already
+ * overwritten or are too large for a datagram.  When the sender goes
+ * idle, it announces its last sequence number so that the receiver
+ * can also recover lost trailing frames.  The receiver gives up on a frame after
+ * ACHD_RUDP_GIVEUP_NS or when the window overflows.
+ */
+
+#define _GNU_SOURCE
+#include <time.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "ach.h"
+#include "ach/private_posix.h"
+#include "ach/experimental.h"
+#include "achutil.h"
+#include "achd.h"
+
+enum slot_state {
+    SLOT_MISSING,
+    SLOT_FULL,
+    SLOT_LOST
+};
+
+struct rudp_slot {
+    uint64_t seq;
+    enum slot_state state;
+    uint8_t *buf;
+    size_t size;
+    size_t cnt;
+    uint64_t recv_ns;
+    uint64_t seen_ns;   ///< when the gap was noticed
+    uint64_t nack_ns;   ///< when we last NACKed
+};
+
+struct achd_rudp {
+    /* sender, used from the control thread */
+    ach_channel_t chan;            ///< separate handle for retransmits
+    struct achd_codec *codec;
+    uint8_t *buf;
+    size_t buf_size;
+    ach_pipe_frame_t *enc;
+    size_t enc_size;
+    pthread_mutex_t lock;          ///< protects peer and high
+    struct sockaddr_in peer;
+    uint64_t high;                 ///< last seq sent
+    uint64_t high_told;            ///< last seq announced
+
+    /* receiver */
+    int started;
+    uint64_t next;                 ///< next seq to deliver
+    uint64_t high_seen;            ///< highest seq known to be sent
+    struct rudp_slot slot[ACHD_RUDP_WINDOW];
+};
+
+void achd_rudp_setup( struct achd_conn *conn ) {
+    if( conn->rudp ) return;
+
+    struct achd_rudp *ru = (struct achd_rudp*)calloc( 1, sizeof(*ru) );
+    pthread_mutex_init( &ru->lock, NULL );
+
+    if( ACHD_DIRECTION_PUSH == conn->vtab->direction ) {
+        uint64_t seq;
+        if( ACH_OK != ach_channel_seq( &cx.channel, &seq ) ) {
+            cx.error( ACH_ENOTSUP, "Reliable UDP needs a user-space channel\n" );
+        }
+        enum ach_status r = ach_open( &ru->chan, cx.chan_name, NULL );
+        if( ACH_OK != r ) {
+            cx.error( r, "Couldn't open channel %s for retransmits\n", cx.chan_name );
+        }
+        /* the control thread encodes on its own */
+        if( conn->codec ) {
+            const struct achd_headers *hdr =
+                conn->recv_hdr.compression ? &conn->recv_hdr : &conn->send_hdr;
+            ru->codec = achd_codec_create( hdr, cx.channel.shm->data_size );
+        }
+    }
+
+    conn->rudp = ru;
+}
+
+/*-- Sender --*/
+
+void achd_rudp_peer( struct achd_conn *conn, const struct sockaddr_in *addr ) {
+    struct achd_rudp *ru = conn->rudp;
+    pthread_mutex_lock( &ru->lock );
+    ru->peer = *addr;
+    pthread_mutex_unlock( &ru->lock );
+}
+
+void achd_rudp_sent( struct achd_conn *conn, uint64_t seq ) {
+    struct achd_rudp *ru = conn->rudp;
+    pthread_mutex_lock( &ru->lock );
+    ru->high = seq;
+    pthread_mutex_unlock( &ru->lock );
+}
+
+void achd_rudp_idle( struct achd_conn *conn ) {
+    struct achd_rudp *ru = conn->rudp;
+    if( !ru ) return;
+    pthread_mutex_lock( &ru->lock );
+    uint64_t high = ru->high;
+    pthread_mutex_unlock( &ru->lock );
+    if( high != ru->high_told &&
+        achd_ctrl_write( conn, ACHD_CTRL_HIGH, high, 0, 0 ) >= 0 )
+    {
+        ru->high_told = high;
+    }
+}
+
+/* Resend one frame, return nonzero if it is gone */
+static int resend( struct achd_conn *conn, uint64_t seq ) {
+    struct achd_rudp *ru = conn->rudp;
+    size_t frame_size;
+    enum ach_status r;
+    while( ACH_OVERFLOW ==
+           (r = ach_get_seq( &ru->chan, seq, ru->buf, ru->buf_size, &frame_size )) )
+    {
+        free( ru->buf );
+        ru->buf_size = frame_size;
+        ru->buf = (uint8_t*)malloc( ru->buf_size );
+    }
+    if( ACH_MISSED_FRAME == r ) return 1;
+    if( ACH_OK != r ) {
+        ACH_LOG( LOG_DEBUG, "Couldn't get frame %" PRIu64 ": %s\n", seq, ach_result_to_string(r) );
+        return 0;
+    }
+
+    uint8_t seqbuf[ACHD_RUDP_SEQ_SIZE];
+    uint8_t stamp[ACHD_STAMP_SIZE];
+    struct iovec iov[3] = {{ .iov_base = seqbuf, .iov_len = sizeof(seqbuf) },
+                           { .iov_base = ru->buf, .iov_len = frame_size },
+                           { .iov_base = stamp, .iov_len = 0 }};
+    achd_put_u64( seqbuf, seq );
+    if( ru->codec ) {
+        achd_encode( ru->codec, ru->buf, frame_size, &ru->enc, &ru->enc_size );
+        iov[1].iov_base = ru->enc->data;
+        iov[1].iov_len = ach_pipe_get_size( ru->enc );
+    }
+    if( conn->latency ) {
+        uint64_t now = achd_realtime_ns();
+        achd_stamp( stamp, now, now );
+        iov[2].iov_len = sizeof(stamp);
+    }
+
+    struct msghdr msg;
+    memset( &msg, 0, sizeof(msg) );
+    pthread_mutex_lock( &ru->lock );
+    struct sockaddr_in peer = ru->peer;
+    pthread_mutex_unlock( &ru->lock );
+    msg.msg_name = &peer;
+    msg.msg_namelen = sizeof(peer);
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 3;
+    /* if the socket is full, the receiver will NACK again */
+    if( sendmsg( conn->aux, &msg, MSG_DONTWAIT ) < 0 && EAGAIN != errno && EWOULDBLOCK != errno ) {
+        ACH_LOG( LOG_DEBUG, "Couldn't resend frame %" PRIu64 ": %s\n", seq, strerror(errno) );
+        /* too large for a datagram, so it was never sent either */
+        if( EMSGSIZE == errno ) return 1;
+    }
+    return 0;
+}
+
+void achd_rudp_nack( struct achd_conn *conn, const struct achd_ctrl_msg *msg ) {
+    uint64_t first = msg->arg[0];
+    uint64_t cnt = msg->arg[1] < ACHD_RUDP_WINDOW ? msg->arg[1] : ACHD_RUDP_WINDOW;
+    uint64_t gone_first = 0, gone = 0;
+    uint64_t i;
+    ACH_LOG( LOG_DEBUG, "NACK %" PRIu64 " + %" PRIu64 "\n", first, cnt );
+    /* SKIP each run of frames that can't be resent */
+    for( i = 0; i < cnt && !cx.sig_received; i++ ) {
+        if( resend( conn, first + i ) ) {
+            if( 0 == gone ) gone_first = first + i;
+            gone++;
+        } else if( gone ) {
+            achd_ctrl_write( conn, ACHD_CTRL_SKIP, gone_first, gone, 0 );
+            gone = 0;
+        }
+    }
+    if( gone ) achd_ctrl_write( conn, ACHD_CTRL_SKIP, gone_first, gone, 0 );
+}
+
+/*-- Receiver --*/
+
+static struct rudp_slot *slot_of( struct achd_rudp *ru, uint64_t seq ) {
+    return &ru->slot[seq % ACHD_RUDP_WINDOW];
+}
+
+/* Deliver frames from the front of the window */
+static void flush( struct achd_conn *conn ) {
+    struct achd_rudp *ru = conn->rudp;
+    for(;;) {
+        struct rudp_slot *s = slot_of( ru, ru->next );
+        if( s->seq != ru->next ) break;
+        if( SLOT_FULL == s->state ) {
+            achd_recv_frame( conn, s->buf, s->cnt, s->recv_ns );
+        } else if( SLOT_LOST == s->state ) {
+            ACH_LOG( LOG_NOTICE, "Lost frame %" PRIu64 "\n", s->seq );
+        } else {
+            break;
+        }
+        s->state = SLOT_MISSING;
+        s->seq = 0;
+        ru->next++;
+    }
+}
+
+/* Give up on the front of the window */
+static void skip( struct achd_conn *conn ) {
+    struct achd_rudp *ru = conn->rudp;
+    struct rudp_slot *s = slot_of( ru, ru->next );
+    if( s->seq != ru->next || SLOT_FULL != s->state ) {
+        s->seq = ru->next;
+        s->state = SLOT_LOST;
+    }
+    flush( conn );
+}
+
+/* Give up on frames before seq */
+static void skip_to( struct achd_conn *conn, uint64_t seq ) {
+    struct achd_rudp *ru = conn->rudp;
+    while( ru->next < seq && ru->next <= ru->high_seen ) skip( conn );
+    if( ru->next < seq ) {
+        ACH_LOG( LOG_NOTICE, "Lost frames %" PRIu64 " to %" PRIu64 "\n", ru->next, seq - 1 );
+        ru->next = seq;
+    }
+}
+
+/* Note that frames through seq were sent */
+static void note_sent( struct achd_rudp *ru, uint64_t seq, uint64_t now ) {
+    uint64_t i;
+    for( i = ru->next; i <= seq; i++ ) {
+        struct rudp_slot *s = slot_of( ru, i );
+        if( s->seq != i ) {
+            s->seq = i;
+            s->state = SLOT_MISSING;
+            s->seen_ns = now;
+            s->nack_ns = 0;
+        }
+    }
+    if( seq > ru->high_seen ) ru->high_seen = seq;
+}
+
+void achd_rudp_recv( struct achd_conn *conn, const uint8_t *buf, size_t cnt, uint64_t recv_ns ) {
+    struct achd_rudp *ru = conn->rudp;
+    if( cnt < ACHD_RUDP_SEQ_SIZE ) {
+        ACH_LOG( LOG_ERR, "Datagram missing sequence number\n" );
+        return;
+    }
+    uint64_t seq = achd_get_u64( buf );
+    buf += ACHD_RUDP_SEQ_SIZE;
+    cnt -= ACHD_RUDP_SEQ_SIZE;
+
+    /* start, or restart if the sender's channel was recreated */
+    if( !ru->started || seq + ACHD_RUDP_WINDOW < ru->next ) {
+        if( ru->started ) ACH_LOG( LOG_NOTICE, "Sequence restarted at %" PRIu64 "\n", seq );
+        size_t i;
+        for( i = 0; i < ACHD_RUDP_WINDOW; i++ ) {
+            ru->slot[i].seq = 0;
+            ru->slot[i].state = SLOT_MISSING;
+        }
+        ru->started = 1;
+        ru->next = seq;
+        ru->high_seen = seq;
+    }
+
+    if( seq < ru->next ) return; /* duplicate */
+
+    /* make room */
+    if( seq >= ru->next + ACHD_RUDP_WINDOW ) skip_to( conn, seq - ACHD_RUDP_WINDOW + 1 );
+
+    if( seq == ru->next ) {
+        achd_recv_frame( conn, buf, cnt, recv_ns );
+        struct rudp_slot *s = slot_of( ru, seq );
+        s->seq = 0;
+        s->state = SLOT_MISSING;
+        ru->next++;
+        if( seq > ru->high_seen ) ru->high_seen = seq;
+        flush( conn );
+        return;
+    }
+
+    /* hold till the gap fills */
+    struct rudp_slot *s = slot_of( ru, seq );
+    if( s->seq == seq && SLOT_FULL == s->state ) return; /* duplicate */
+    note_sent( ru, seq, recv_ns );
+    if( s->size < cnt ) {
+        free( s->buf );
+        s->buf = (uint8_t*)malloc( cnt );
+        s->size = cnt;
+    }
+    memcpy( s->buf, buf, cnt );
+    s->cnt = cnt;
+    s->recv_ns = recv_ns;
+    s->seq = seq;
+    s->state = SLOT_FULL;
+    achd_rudp_check( conn );
+}
+
+void achd_rudp_ctrl( struct achd_conn *conn, const struct achd_ctrl_msg *msg ) {
+    struct achd_rudp *ru = conn->rudp;
+    if( !ru->started ) return;
+    uint64_t now = achd_realtime_ns();
+    if( ACHD_CTRL_HIGH == msg->type ) {
+        /* frames after next may have been lost */
+        uint64_t high = msg->arg[0];
+        if( high >= ru->next + ACHD_RUDP_WINDOW ) skip_to( conn, high - ACHD_RUDP_WINDOW + 1 );
+        if( high >= ru->next ) note_sent( ru, high, now );
+        achd_rudp_check( conn );
+    } else if( ACHD_CTRL_SKIP == msg->type ) {
+        uint64_t i;
+        for( i = 0; i < msg->arg[1]; i++ ) {
+            uint64_t seq = msg->arg[0] + i;
+            if( seq < ru->next || seq >= ru->next + ACHD_RUDP_WINDOW ) continue;
+            struct rudp_slot *s = slot_of( ru, seq );
+            if( s->seq != seq || SLOT_FULL != s->state ) {
+                s->seq = seq;
+                s->state = SLOT_LOST;
+            }
+        }
+        flush( conn );
+    }
+}
+
+void achd_rudp_check( struct achd_conn *conn ) {
+    struct achd_rudp *ru = conn->rudp;
+    if( !ru->started ) return;
+    uint64_t now = achd_realtime_ns();
+
+    /* give up on old gaps */
+    for(;;) {
+        struct rudp_slot *s = slot_of( ru, ru->next );
+        if( ru->next > ru->high_seen || s->seq != ru->next ||
+            SLOT_MISSING != s->state || now - s->seen_ns < ACHD_RUDP_GIVEUP_NS )
+        {
+            break;
+        }
+        skip( conn );
+    }
+
+    /* NACK runs of missing frames */
+    uint64_t seq, first = 0, cnt = 0;
+    for( seq = ru->next; seq <= ru->high_seen && seq < ru->next + ACHD_RUDP_WINDOW; seq++ ) {
+        struct rudp_slot *s = slot_of( ru, seq );
+        int want = ( s->seq == seq && SLOT_MISSING == s->state &&
+                     now - s->nack_ns >= ACHD_RUDP_NACK_NS );
+        if( want ) {
+            s->nack_ns = now;
+            if( 0 == cnt ) first = seq;
+            cnt++;
+        }
+        if( cnt && (!want || seq == ru->high_seen) ) {
+            achd_ctrl_write( conn, ACHD_CTRL_NACK, first, cnt, 0 );
+            cnt = 0;
+        }
+    }
+    if( cnt ) achd_ctrl_write( conn, ACHD_CTRL_NACK, first, cnt, 0 );
+}
+
+int achd_rudp_timeout( struct achd_conn *conn ) {
+    struct achd_rudp *ru = conn->rudp;
+    if( !ru || !ru->started || ru->next > ru->high_seen ) return -1;
+    return (int)(ACHD_RUDP_NACK_NS / 1000000);
+}
@@ -41,7 +41,7 @@
  */
 
 
-
+#define _GNU_SOURCE
 #include <unistd.h>
 #include <stdint.h>
 #include <inttypes.h>
@@ -58,14 +58,17 @@
 #include <stdarg.h>
 #include <errno.h>
 #include <syslog.h>
+#include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <poll.h>
+#include <fcntl.h>
 
 #include "ach.h"
 #include "ach/private_posix.h"
+#include "ach/experimental.h"
 #include "achutil.h"
 #include "achd.h"
 
@@ -73,6 +76,25 @@
 
 struct udp_cx {
     struct sockaddr_in addr;
+    struct timespec ts_check;                    ///< last check of the TCP control connection
+    ach_pipe_frame_t *frame[ACHD_UDP_BATCH];     ///< datagram buffers
+    size_t frame_size[ACHD_UDP_BATCH];           ///< capacity of datagram buffers
+    ach_pipe_frame_t *enc[ACHD_UDP_BATCH];       ///< encoded frames to send
+    size_t enc_size[ACHD_UDP_BATCH];
+    uint64_t get_ns[ACHD_UDP_BATCH];             ///< when frames to send were read
+    uint8_t stamp[ACHD_UDP_BATCH][ACHD_STAMP_SIZE];
+    uint8_t seq[ACHD_UDP_BATCH][ACHD_RUDP_SEQ_SIZE];
+    struct iovec iov[ACHD_UDP_BATCH][3];
+    struct mmsghdr msg[ACHD_UDP_BATCH*ACHD_UDP_PATHS]; ///< frame-major, one per path
+    struct sockaddr_in msg_addr[ACHD_UDP_BATCH]; ///< source addresses of received datagrams
+    struct achd_uring *uring;                    ///< NULL to use poll()
+    struct sockaddr_in path[ACHD_UDP_PATHS];     ///< peer addresses, the first is the TCP peer
+    size_t n_path;
+    int multipath;                               ///< send every frame over each path
+    uint64_t mp_seq;                             ///< multipath: last seq sent or put
+    uint64_t mp_seen;                            ///< multipath: bit i set if mp_seq-i was put
+    uint64_t mp_dup;                             ///< multipath: duplicates dropped
+    uint64_t mp_late;                            ///< multipath: frames older than one put
 };
 
 static void get_frame( struct achd_conn *conn );
@@ -85,6 +107,32 @@ static void put_frame( struct achd_conn *conn );
 #define MTU_ETH 1500
 
 
+/* Get a frame from the channel into *pframe, enlarging the buffer as
+ * needed.  Missed frames are reported as ACH_OK. */
+static ach_status_t get_buf( ach_pipe_frame_t **pframe, size_t *psize, int options ) {
+    for(;;) {
+        size_t frame_size = 0;
+        ach_status_t r  = ach_get( &cx.channel, (*pframe)->data, *psize, &frame_size, NULL, options );
+        /* check return code */
+        switch(r) {
+        case ACH_OVERFLOW:
+            ACH_LOG( LOG_NOTICE, "buffer too small, resizing to %" PRIuPTR "\n", frame_size);
+            /* enlarge buffer and retry on overflow */
+            assert(frame_size > *psize );
+            *psize = frame_size;
+            free(*pframe);
+            *pframe = ach_pipe_alloc( *psize );
+            break;
+        case ACH_OK:
+        case ACH_MISSED_FRAME:
+            ach_pipe_set_size( *pframe, frame_size );
+            return ACH_OK;
+        default:
+            return r;
+        }
+    }
+}
+
 static void get_frame( struct achd_conn *conn ) {
     int done = 0;
     unsigned long period_ns = conn->send_hdr.period_ns ? conn->send_hdr.period_ns : conn->recv_hdr.period_ns;
@@ -98,24 +146,13 @@ static void get_frame( struct achd_conn *conn ) {
     }
 
     do {
-        size_t frame_size = 0;
-        ach_status_t r  = ach_get( &cx.channel, conn->pipeframe->data, conn->pipeframe_size, &frame_size,  NULL,
-                                   ACH_O_WAIT | (last ? ACH_O_LAST : 0) );
-        /* check return code */
+        ach_status_t r = get_buf( &conn->pipeframe, &conn->pipeframe_size,
+                                  ACH_O_WAIT | (last ? ACH_O_LAST : 0) );
         switch(r) {
-        case ACH_OVERFLOW:
-            ACH_LOG( LOG_NOTICE, "buffer too small, resizing to %" PRIuPTR "\n", frame_size);
-            /* enlarge buffer and retry on overflow */
-            assert(frame_size > conn->pipeframe_size );
-            conn->pipeframe_size = frame_size;
-            free(conn->pipeframe);
-            conn->pipeframe = ach_pipe_alloc( conn->pipeframe_size );
-            break;
         case ACH_OK:
-        case ACH_MISSED_FRAME:
-            ach_pipe_set_size( conn->pipeframe, frame_size );
             done = 1;
             clock_gettime( ACH_DEFAULT_CLOCK, &conn->ts_last );
+            /* fall through */
         case ACH_CANCELED:
             break;
         default:
@@ -127,14 +164,150 @@ static void get_frame( struct achd_conn *conn ) {
     } while( !cx.sig_received && !done );
 }
 
-static void put_frame( struct achd_conn *conn ) {
-    size_t cnt =  ach_pipe_get_size(conn->pipeframe);
+static void put_buf( const void *buf, size_t cnt ) {
     if( !cx.sig_received ) {
-        ach_status_t r = ach_put( &cx.channel, conn->pipeframe->data, cnt );
+        ach_status_t r = ach_put( &cx.channel, buf, cnt );
         if( ACH_OK != r ) {
-            cx.error( r, "Couldn't put frame, size %d\n", cnt );
+            cx.error( r, "Couldn't put frame, size %" PRIuPTR "\n", cnt );
+        }
+    }
+}
+
+static void put_frame( struct achd_conn *conn ) {
+    put_buf( conn->pipeframe->data, ach_pipe_get_size(conn->pipeframe) );
+}
+
+void achd_recv_frame( struct achd_conn *conn, const uint8_t *buf, size_t cnt, uint64_t recv_ns ) {
+    const uint8_t *stamp = NULL;
+    if( conn->latency ) {
+        if( cnt < ACHD_STAMP_SIZE ) {
+            ACH_LOG( LOG_ERR, "Frame missing timestamps\n" );
+            return;
+        }
+        cnt -= ACHD_STAMP_SIZE;
+        stamp = buf + cnt;
+    }
+    if( conn->resume ) {
+        if( cnt < ACHD_SEQ_SIZE ) {
+            ACH_LOG( LOG_ERR, "Frame missing sequence number\n" );
+            return;
+        }
+        cnt -= ACHD_SEQ_SIZE;
+        conn->resume_seq = achd_get_u64( buf + cnt );
+    }
+    if( conn->codec ) {
+        buf = achd_decode( conn->codec, buf, cnt, &cnt );
+        if( !buf ) return;
+    }
+    put_buf( buf, cnt );
+    if( stamp ) achd_latency_frame( conn, stamp, recv_ns, achd_realtime_ns() );
+}
+
+/* Receiving straight into the channel.  ach_put_transfer() calls
+ * direct_recv() with the channel locked, so the datagram or frame
+ * must already be waiting in the socket.  The destination may hold
+ * the oldest frames, which stay in the channel if the transfer
+ * fails, so direct_recv() only reads once it knows the whole frame is
+ * there: the caller peeks at a datagram's size and source, and
+ * direct_recv() checks a stream's buffered bytes.  A short read of a
+ * stream then means the connection failed. */
+struct direct_cx {
+    int fd;
+    size_t len;
+    int stream;                   ///< TCP: check the bytes buffered first
+};
+
+static enum ach_status direct_recv( void *cx_, void *dst, const void *obj ) {
+    (void)obj;
+    struct direct_cx *d = (struct direct_cx*)cx_;
+    ssize_t r;
+    if( d->stream ) {
+        int avail = 0;
+        if( ioctl( d->fd, FIONREAD, &avail ) || (size_t)avail < d->len ) return ACH_EAGAIN;
+    }
+    do {
+        r = recv( d->fd, dst, d->len, MSG_DONTWAIT );
+    } while( r < 0 && EINTR == errno );
+    if( (size_t)r == d->len ) return ACH_OK;
+    if( r < 0 && !d->stream ) return ACH_EAGAIN;
+    if( r >= 0 ) errno = ECONNRESET;
+    return ACH_FAILED_SYSCALL;
+}
+
+/* Put a raw frame of cnt bytes from the TCP connection straight into
+ * the channel, without copying through conn->pipeframe.  SO_RCVLOWAT
+ * lets poll() wait till the whole frame is buffered.
+ *
+ * Return 0 if the frame was put, -1 if the connection failed, or 1 to
+ * read the frame as usual. */
+static int tcp_put_direct( struct achd_conn *conn, size_t cnt ) {
+    size_t len = cnt - (conn->resume ? ACHD_SEQ_SIZE : 0);
+    if( conn->direct_off || conn->codec || conn->latency ||
+        cnt < ACHD_DIRECT_MIN || len < ACHD_DIRECT_MIN )
+    {
+        return 1;
+    }
+
+    int avail = 0;
+    if( ioctl( conn->in, FIONREAD, &avail ) ) {
+        conn->direct_off = 1;
+        return 1;
+    }
+    if( (size_t)avail < len ) {
+        if( conn->rcvlowat != len ) {
+            int lowat = (int)len;
+            if( setsockopt( conn->in, SOL_SOCKET, SO_RCVLOWAT, &lowat, sizeof(lowat) ) ) {
+                ACH_LOG( LOG_DEBUG, "Couldn't set SO_RCVLOWAT: %s\n", strerror(errno) );
+                conn->direct_off = 1;
+                return 1;
+            }
+            conn->rcvlowat = len;
         }
+        struct pollfd pfd = { .fd = conn->in, .events = POLLIN };
+        if( poll( &pfd, 1, ACHD_DIRECT_WAIT_MS ) < 0 ||
+            ioctl( conn->in, FIONREAD, &avail ) || (size_t)avail < len )
+        {
+            /* e.g., a slow sender or a small socket buffer */
+            conn->rcvlowat = 0;
+            return 1;
+        }
+    }
+
+    struct direct_cx d = { .fd = conn->in, .len = len, .stream = 1 };
+    enum ach_status r = cx.sig_received ? ACH_CANCELED :
+        ach_put_transfer( &cx.channel, direct_recv, &d, NULL, len );
+    switch( r ) {
+    case ACH_OK:
+        break;
+    case ACH_FAILED_SYSCALL:
+        ACH_LOG( LOG_ERR, "Incomplete frame data: %s\n", strerror(errno) );
+        return -1;
+    case ACH_ENOTSUP:
+        ACH_LOG( LOG_DEBUG, "Channel does not take direct puts\n" );
+        conn->direct_off = 1;
+        /* fall through */
+    case ACH_EAGAIN:
+    case ACH_CANCELED:
+        return 1;
+    default:
+        cx.error( r, "Couldn't put frame, size %" PRIuPTR "\n", len );
+    }
+
+    if( conn->resume ) {
+        uint8_t seq[ACHD_SEQ_SIZE];
+        if( ACHD_SEQ_SIZE != achd_read( conn->in, seq, ACHD_SEQ_SIZE ) ) {
+            ACH_LOG( LOG_ERR, "Incomplete frame data\n" );
+            return -1;
+        }
+        conn->resume_seq = achd_get_u64( seq );
     }
+    return 0;
+}
+
+static void reconnect( struct achd_conn *conn ) {
+    achd_ctrl_stop( conn );
+    achd_reconnect( conn );
+    achd_ctrl_start( conn );
 }
 
 int achd_connect_nop( struct achd_conn *conn ) {
@@ -143,6 +316,33 @@ int achd_connect_nop( struct achd_conn *conn ) {
 }
 
 
+/* Non-blocking, so we only need to poll when the socket is full or
+ * empty */
+static void udp_nonblock( int fd ) {
+    int flags = fcntl( fd, F_GETFL );
+    if( flags < 0 || fcntl( fd, F_SETFL, flags | O_NONBLOCK ) ) {
+        cx.error(ACH_FAILED_SYSCALL, "Couldn't make UDP socket non-blocking: %s\n", strerror(errno) );
+    }
+}
+
+/* The io_uring for UDP I/O, or NULL to use poll() */
+static struct achd_uring *udp_uring( struct udp_cx *ucx ) {
+    if( cx.io_uring && NULL == ucx->uring ) {
+        ucx->uring = achd_uring_create( 2*ACHD_UDP_BATCH*ACHD_UDP_PATHS );
+        if( NULL == ucx->uring ) {
+            ACH_LOG( LOG_NOTICE, "io_uring is unavailable, using poll()\n" );
+            cx.io_uring = 0;
+        }
+    }
+    return ucx->uring;
+}
+
+/* io_uring waits on the socket itself, but fails with EAGAIN instead
+ * if the socket is non-blocking */
+static void udp_sock_mode( struct udp_cx *ucx, int fd ) {
+    if( NULL == udp_uring(ucx) ) udp_nonblock( fd );
+}
+
 int achd_udp_sock( struct achd_conn *conn ) {
     struct udp_cx *ucx;
     if( conn->cx ) {
@@ -157,6 +357,8 @@ int achd_udp_sock( struct achd_conn *conn ) {
         cx.error(ACH_FAILED_SYSCALL, "Couldn't create UDP socket: %s\n", strerror(errno) );
     }
 
+    udp_sock_mode( ucx, conn->aux );
+
     /* Bind */
     struct sockaddr_in addr;
     memset(&addr, 0, sizeof(addr));
@@ -184,6 +386,97 @@ int achd_udp_sock( struct achd_conn *conn ) {
     return 0;
 }
 
+/* Write conn->pipeframe, return 0 on success */
+static int tcp_write_frame( struct achd_conn *conn, ach_pipe_frame_t **pencframe, size_t *pencsize,
+                            uint64_t seq, uint64_t get_ns )
+{
+    /* maybe encode, again after reconnecting */
+    ach_pipe_frame_t *frame = conn->pipeframe;
+    if( conn->codec ) {
+        achd_encode( conn->codec, conn->pipeframe->data, ach_pipe_get_size(conn->pipeframe),
+                     pencframe, pencsize );
+        frame = *pencframe;
+    }
+    size_t cnt = ach_pipe_get_size(frame);
+    size_t size = sizeof(ach_pipe_frame_t) - 1 + cnt;
+    uint8_t seqbuf[ACHD_SEQ_SIZE];
+    uint8_t stamp[ACHD_STAMP_SIZE];
+    /* frame [seq] [timestamps] */
+    struct iovec iov[3] = {{ .iov_base = frame, .iov_len = size },
+                           { .iov_base = seqbuf, .iov_len = 0 },
+                           { .iov_base = stamp, .iov_len = 0 }};
+    if( conn->resume ) {
+        achd_put_u64( seqbuf, seq );
+        iov[1].iov_len = ACHD_SEQ_SIZE;
+    }
+    if( conn->latency ) iov[2].iov_len = ACHD_STAMP_SIZE;
+    size_t trailer = iov[1].iov_len + iov[2].iov_len;
+    ach_pipe_set_size( frame, cnt + trailer );
+    size += trailer;
+
+    ACH_LOG( LOG_DEBUG, "Writing frame, %" PRIuPTR " bytes total\n", size);
+    achd_ctrl_lock( conn );
+    if( conn->latency ) achd_stamp( stamp, get_ns, achd_realtime_ns() );
+    ssize_t r = achd_writev( conn->out, iov, 3 );
+    achd_ctrl_unlock( conn );
+    ach_pipe_set_size( frame, cnt );
+    if( r < 0 || (size_t)r != size ) {
+        ACH_LOG( LOG_ERR, "Couldn't write frame\n");
+        return -1;
+    }
+    return 0;
+}
+
+/* Send frames after the receiver's resume-seq that are still in the
+ * channel, return 0 on success */
+static int tcp_replay( struct achd_conn *conn, ach_pipe_frame_t **pencframe, size_t *pencsize ) {
+    uint64_t last;
+    if( ACH_OK != ach_channel_seq( &cx.channel, &last ) ) return 0;
+    uint64_t seq = conn->recv_hdr.resume_seq + 1;
+    if( seq > last + 1 ) {
+        ACH_LOG( LOG_NOTICE, "Can't resume after frame %" PRIu64 ", channel is at %" PRIu64 "\n",
+                 seq - 1, last );
+        return 0;
+    }
+    /* older frames are surely overwritten */
+    uint64_t lost = 0;
+    if( last + 1 - seq > cx.channel.shm->index_cnt ) {
+        uint64_t first = last + 1 - cx.channel.shm->index_cnt;
+        lost = first - seq;
+        seq = first;
+    }
+
+    uint64_t replayed = 0;
+    for( ; seq <= last && !cx.sig_received; seq++ ) {
+        size_t frame_size;
+        enum ach_status r;
+        while( ACH_OVERFLOW == (r = ach_get_seq( &cx.channel, seq, conn->pipeframe->data,
+                                                 conn->pipeframe_size, &frame_size )) )
+        {
+            conn->pipeframe_size = frame_size;
+            free( conn->pipeframe );
+            conn->pipeframe = ach_pipe_alloc( conn->pipeframe_size );
+        }
+        if( ACH_MISSED_FRAME == r ) {
+            lost++;
+            continue;
+        } else if( ACH_OK != r ) {
+            ACH_LOG( LOG_ERR, "Couldn't get frame %" PRIu64 ": %s\n", seq, ach_result_to_string(r) );
+            break;
+        }
+        ach_pipe_set_size( conn->pipeframe, frame_size );
+        if( tcp_write_frame( conn, pencframe, pencsize, seq,
+                             conn->latency ? achd_realtime_ns() : 0 ) )
+        {
+            return -1;
+        }
+        replayed++;
+    }
+    ACH_LOG( LOG_INFO, "Resumed after frame %" PRIu64 ", replayed %" PRIu64 ", lost %" PRIu64 "\n",
+             conn->recv_hdr.resume_seq, replayed, lost );
+    return 0;
+}
+
 void achd_push_tcp( struct achd_conn *conn ) {
     /* Subscribe and Write */
 
@@ -197,6 +490,22 @@ void achd_push_tcp( struct achd_conn *conn ) {
     /* } */
 
 
+    ach_pipe_frame_t *encframe = NULL;
+    size_t encframe_size = 0;
+    uint64_t get_ns = 0;
+    uint64_t seq = 0;
+
+    achd_ctrl_start( conn );
+
+    /* catch the receiver up */
+    if( conn->resume && conn->recv_hdr.resume_seq &&
+        tcp_replay( conn, &encframe, &encframe_size ) )
+    {
+        achd_ctrl_stop( conn );
+        free(encframe);
+        return;
+    }
+
     /* read loop */
     while( !cx.sig_received ) {
         /* char cmd[4] = {0}; */
@@ -211,19 +520,18 @@ void achd_push_tcp( struct achd_conn *conn ) {
         get_frame(conn);
 
         if( cx.sig_received ) break;
+        if( conn->latency ) get_ns = achd_realtime_ns();
+        if( conn->resume && ACH_OK != ach_channel_seq( &cx.channel, &seq ) ) seq = 0;
 
         /* stream send */
         int sent_frame = 0;
         do {
-            size_t size = sizeof(ach_pipe_frame_t) - 1 + ach_pipe_get_size(conn->pipeframe);
-            ACH_LOG( LOG_DEBUG, "Writing frame, %" PRIuPTR " bytes total\n", size);
-            ssize_t r = achd_write( conn->out, conn->pipeframe, size );
-            if( r < 0 || (size_t)r != size ) {
-                ACH_LOG( LOG_ERR, "Couldn't write frame\n");
-                if( cx.reconnect ) achd_reconnect(conn);
-                else return;
+            if( tcp_write_frame( conn, &encframe, &encframe_size, seq, get_ns ) ) {
+                if( cx.reconnect ) reconnect(conn);
+                else break;
             } else sent_frame = 1;
         } while( !sent_frame && !cx.sig_received && cx.reconnect );
+        if( !sent_frame ) break;
         /* TODO: ACH_O_LAST handling */
 
         /* if( opt_sync ) { */
@@ -237,25 +545,34 @@ void achd_push_tcp( struct achd_conn *conn ) {
         /*     _relsleep(period); */
         /* } */
     }
+    achd_ctrl_stop( conn );
+    free(encframe);
 }
 
 void achd_pull_tcp( struct achd_conn *conn ) {
     /* Read and Publish Loop */
     while( !cx.sig_received ) {
         int got_frame = 0;
+        int put = 0;
+        int got_ctrl;
         uint64_t cnt = 0;
         do {
+            got_ctrl = 0;
             /* get size */
             ssize_t s = achd_read(conn->in, conn->pipeframe, 16 );
             if( s <= 0 ) {
                 ACH_LOG(LOG_DEBUG, "Empty read: %s (%d)\n", strerror(errno), errno);
-                if( cx.reconnect ) achd_reconnect(conn);
+                if( cx.reconnect ) reconnect(conn);
             } else if( 16 != (ssize_t)s ) {
                 ACH_LOG(LOG_ERR, "Incomplete frame header\n");
-                if( cx.reconnect ) achd_reconnect(conn);
+                if( cx.reconnect ) reconnect(conn);
+            } else if( achd_ctrl_wanted(conn) && 0 == memcmp("achctrl", conn->pipeframe->magic, 8) ) {
+                /* answer to our ping */
+                if( 0 == achd_ctrl_recv( conn, conn->pipeframe ) ) got_ctrl = 1;
+                else if( cx.reconnect ) reconnect(conn);
             } else if( memcmp("achpipe", conn->pipeframe->magic, 8) ) {
                 ACH_LOG(LOG_ERR, "Invalid frame header\n");
-                if( cx.reconnect ) achd_reconnect(conn);
+                if( cx.reconnect ) reconnect(conn);
             } else {
                 cnt = ach_pipe_get_size( conn->pipeframe );
                 /* TODO: sanity check that cnt is not something outrageous */
@@ -266,19 +583,31 @@ void achd_pull_tcp( struct achd_conn *conn ) {
                     conn->pipeframe = ach_pipe_alloc( conn->pipeframe_size );
                     ach_pipe_set_size( conn->pipeframe, cnt );
                 }
-                /* get data */
-                s = achd_read( conn->in, conn->pipeframe->data, (size_t)cnt );
-                if( (ssize_t)cnt != s ) {
-                    ACH_LOG(LOG_ERR, "Incomplete frame data\n");
-                    if( cx.reconnect ) achd_reconnect(conn);
+                /* get data, straight into the channel if we can */
+                int d = tcp_put_direct( conn, (size_t)cnt );
+                if( d < 0 ) {
+                    if( cx.reconnect ) reconnect(conn);
+                } else if( 0 == d ) {
+                    got_frame = put = 1;
                 } else {
-                    got_frame = 1;
+                    s = achd_read( conn->in, conn->pipeframe->data, (size_t)cnt );
+                    if( (ssize_t)cnt != s ) {
+                        ACH_LOG(LOG_ERR, "Incomplete frame data\n");
+                        if( cx.reconnect ) reconnect(conn);
+                    } else {
+                        got_frame = 1;
+                    }
                 }
             }
-        } while( !got_frame && !cx.sig_received && cx.reconnect );
+        } while( !got_frame && !cx.sig_received && (cx.reconnect || got_ctrl) );
         if( !got_frame ) return;
+        if( put ) continue;
         /* put data */
-        put_frame(conn);
+        if( conn->codec || conn->latency || conn->resume ) {
+            achd_recv_frame( conn, conn->pipeframe->data, (size_t)cnt, achd_realtime_ns() );
+        } else {
+            put_frame(conn);
+        }
     }
 }
 
@@ -304,12 +633,140 @@ static void udp_peer( struct achd_conn *conn, struct sockaddr_in *addr_peer ) {
     }
 }
 
+/* Add addr to the peer's paths, unless it is already there */
+static void udp_path_add( struct udp_cx *ucx, struct in_addr addr ) {
+    size_t p;
+    for( p = 0; p < ucx->n_path; p++ ) {
+        if( addr.s_addr == ucx->path[p].sin_addr.s_addr ) return;
+    }
+    if( ucx->n_path >= ACHD_UDP_PATHS ) {
+        ACH_LOG( LOG_WARNING, "Ignoring path %s, at most %d paths\n",
+                 inet_ntoa(addr), ACHD_UDP_PATHS );
+        return;
+    }
+    ucx->path[ucx->n_path] = ucx->path[0];
+    ucx->path[ucx->n_path].sin_addr = addr;
+    ACH_LOG( LOG_DEBUG, "UDP path %s:%d\n", inet_ntoa(addr), ntohs(ucx->path[0].sin_port) );
+    ucx->n_path++;
+}
+
+static int udp_resolve( const char *host, struct in_addr *addr ) {
+    struct addrinfo hints;
+    memset( &hints, 0, sizeof(hints) );
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+    struct addrinfo *ai;
+    int r = getaddrinfo( host, NULL, &hints, &ai );
+    if( r ) {
+        ACH_LOG( LOG_ERR, "Path '%s' not found: %s\n", host, gai_strerror(r) );
+        return -1;
+    }
+    *addr = ((struct sockaddr_in*)ai->ai_addr)->sin_addr;
+    freeaddrinfo( ai );
+    return 0;
+}
+
+/* Find the peer's UDP addresses in ucx->path.  The first is the TCP
+ * peer.  Multipath links add the server's other addresses given on
+ * the client's command line, or on the server, the client's
+ * addresses from its udp-paths header. */
+static void udp_peers( struct achd_conn *conn ) {
+    struct udp_cx *ucx = (struct udp_cx*)conn->cx;
+    udp_peer( conn, &ucx->path[0] );
+    ucx->path[0].sin_family = AF_INET;
+    ucx->n_path = 1;
+    if( ! ucx->multipath ) return;
+
+    struct in_addr addr;
+    if( ACHD_MODE_SERVE == conn->mode ) {
+        if( ! conn->recv_hdr.udp_paths ) return;
+        char *paths = strdup( conn->recv_hdr.udp_paths );
+        char *save = NULL;
+        char *tok;
+        for( tok = strtok_r( paths, ", ", &save ); tok; tok = strtok_r( NULL, ", ", &save ) ) {
+            if( inet_aton( tok, &addr ) ) udp_path_add( ucx, addr );
+            else ACH_LOG( LOG_WARNING, "Invalid path address '%s'\n", tok );
+        }
+        free( paths );
+    } else {
+        int i;
+        for( i = 0; i < cx.n_paths; i++ ) {
+            if( 0 == udp_resolve( cx.paths[i], &addr ) ) udp_path_add( ucx, addr );
+        }
+    }
+}
+
+/* Is addr one of the peer's paths? */
+static int udp_from_peer( const struct udp_cx *ucx, const struct sockaddr_in *addr ) {
+    size_t p;
+    for( p = 0; p < ucx->n_path; p++ ) {
+        if( addr->sin_addr.s_addr == ucx->path[p].sin_addr.s_addr &&
+            addr->sin_port == ucx->path[p].sin_port )
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Multipath: put the first copy of each frame.  Later copies, and
+ * frames older than one already put, are dropped. */
+static void udp_mp_recv( struct achd_conn *conn, struct udp_cx *ucx,
+                         const uint8_t *buf, size_t cnt, uint64_t recv_ns )
+{
+    if( cnt < ACHD_RUDP_SEQ_SIZE ) {
+        ACH_LOG( LOG_ERR, "Dropping short datagram\n" );
+        return;
+    }
+    uint64_t seq = achd_get_u64( buf );
+    if( seq > ucx->mp_seq ) {
+        uint64_t shift = seq - ucx->mp_seq;
+        ucx->mp_seen = ( shift < 64 ? ucx->mp_seen << shift : 0 ) | 1;
+        ucx->mp_seq = seq;
+        achd_recv_frame( conn, buf + ACHD_RUDP_SEQ_SIZE, cnt - ACHD_RUDP_SEQ_SIZE, recv_ns );
+    } else if( ucx->mp_seq - seq < 64 && (ucx->mp_seen >> (ucx->mp_seq - seq)) & 1 ) {
+        ucx->mp_dup++;
+    } else {
+        ucx->mp_late++;
+    }
+}
+
+/* Multipath: start a new connection's sequence */
+static void udp_mp_reset( struct udp_cx *ucx ) {
+    if( ucx->multipath && ucx->mp_seq ) {
+        ACH_LOG( LOG_INFO, "multipath: dropped %" PRIu64 " duplicate and %" PRIu64 " late frames\n",
+                 ucx->mp_dup, ucx->mp_late );
+    }
+    ucx->mp_seq = 0;
+    ucx->mp_seen = 0;
+    ucx->mp_dup = 0;
+    ucx->mp_late = 0;
+}
+
+/* Input on the TCP connection is either a control message or
+ * means that it closed */
+static int udp_tcp_input( struct achd_conn *conn ) {
+    if( achd_ctrl_wanted(conn) && ACHD_DIRECTION_PULL == conn->vtab->direction &&
+        0 == achd_ctrl_read( conn ) )
+    {
+        return 0;
+    }
+    ACH_LOG(LOG_DEBUG, "TCP closed\n");
+    return -1;
+}
+
+/* The sender's control thread reads TCP input when there is one */
+static int udp_tcp_fd( struct achd_conn *conn ) {
+    return ( achd_ctrl_wanted(conn) && ACHD_DIRECTION_PUSH == conn->vtab->direction ) ?
+        -1 : conn->in;
+}
+
 /* Check if TCP control channel is still open */
-static int udp_poll( struct pollfd pfd[2] ) {
+static int udp_poll( struct achd_conn *conn, struct pollfd pfd[2], int timeout ) {
     int r;
     do {
         errno = 0;
-        r = poll( pfd, 2, -1 );
+        r = poll( pfd, 2, timeout );
     } while ( r < 0 && ( EAGAIN == errno ||
                          (EINTR == errno && !cx.sig_received) ) );
     if( cx.sig_received ) {
@@ -324,151 +781,712 @@ static int udp_poll( struct pollfd pfd[2] ) {
         ACH_LOG(LOG_DEBUG, "TCP closed\n");
         return -1;
     }  else if ( (pfd[1].revents & POLLIN) ) {
-        /* TODO: perhaps should recv() instead of assuming this means a closed socket */
-        /* but, since we don't expect data here anyway, maybe best to
-         * return */
-        ACH_LOG(LOG_DEBUG, "TCP closed\n");
-        return -1;
+        return udp_tcp_input( conn );
     }
     return 0;
 }
 
-void achd_push_udp( struct achd_conn *conn ) {
-    /* struct udp_cx *ucx = (struct udp_cx*)conn->cx; */
-    /* assert(ucx); */
+/* Check the TCP control connection, at most once per
+ * ACHD_UDP_CHECK_NS so busy links don't pay a syscall per batch.
+ * A receiver expecting control messages checks every batch so that
+ * they are handled promptly. */
+static int udp_check( struct achd_conn *conn, struct udp_cx *ucx ) {
+    struct timespec now;
+    clock_gettime( ACH_DEFAULT_CLOCK, &now );
+    int64_t dt = (int64_t)(now.tv_sec - ucx->ts_check.tv_sec) * 1000000000
+        + (now.tv_nsec - ucx->ts_check.tv_nsec);
+    if( dt < ACHD_UDP_CHECK_NS &&
+        !(achd_ctrl_wanted(conn) && ACHD_DIRECTION_PULL == conn->vtab->direction) )
+    {
+        return 0;
+    }
+    ucx->ts_check = now;
 
-    int warned_mtu_eth = 0;
-    int warned_mtu_udp = 0;
+    if( udp_tcp_fd(conn) < 0 ) {
+        return achd_ctrl_closed( conn ) ? -1 : 0;
+    }
 
-    /* Find remote address */
-    struct sockaddr_in addr_udp;
-    udp_peer( conn, &addr_udp );
+    struct pollfd pfd = { .fd = conn->in, .events = POLLIN };
+    int r;
+    do {
+        r = poll( &pfd, 1, 0 );
+    } while( r < 0 && EINTR == errno && !cx.sig_received );
+    if( r < 0 && !cx.sig_received ) {
+        cx.error(ACH_FAILED_SYSCALL, "Couldn't poll : %s\n", strerror(errno) );
+    } else if( r > 0 ) {
+        return udp_tcp_input( conn );
+    }
+    return 0;
+}
 
-    ACH_LOG( LOG_INFO, "sending UDP to %s:%d\n",
-              inet_ntoa(addr_udp.sin_addr), ntohs(addr_udp.sin_port) );
+/* Make sure every batch slot holds at least size bytes */
+static void udp_batch_alloc( struct udp_cx *ucx, size_t size ) {
+    size_t i;
+    for( i = 0; i < ACHD_UDP_BATCH; i ++ ) {
+        if( ucx->frame_size[i] < size || NULL == ucx->frame[i] ) {
+            free( ucx->frame[i] );
+            ucx->frame[i] = ach_pipe_alloc( size );
+            ucx->frame_size[i] = size;
+        }
+    }
+}
 
+/* Send the n queued datagrams, polling only when the socket would
+ * block.  Returns -1 if the TCP control connection closed. */
+static int udp_send( struct achd_conn *conn, struct udp_cx *ucx, size_t n ) {
     struct pollfd pfd[] = {{ .fd = conn->aux,
                              .events = POLLOUT},
-                           { .fd = conn->in,
+                           { .fd = udp_tcp_fd(conn),
                              .events = POLLIN } };
+    size_t sent = 0;
+    while( sent < n && !cx.sig_received ) {
+        if( conn->latency ) {
+            uint64_t now = achd_realtime_ns();
+            size_t k;
+            for( k = sent; k < n; k++ ) {
+                size_t f = k / ucx->n_path;
+                achd_stamp( ucx->stamp[f], ucx->get_ns[f], now );
+            }
+        }
+        int r = sendmmsg( conn->aux, ucx->msg + sent, (unsigned)(n - sent), 0 );
+        if( r > 0 ) {
+            sent += (size_t)r;
+        } else if( r < 0 && (EAGAIN == errno || EWOULDBLOCK == errno || ENOBUFS == errno) ) {
+            if( udp_poll( conn, pfd, -1 ) < 0 ) return -1;
+        } else if( r < 0 && EINTR == errno ) {
+            continue;
+        } else {
+            struct sockaddr_in *addr = (struct sockaddr_in*)ucx->msg[sent].msg_hdr.msg_name;
+            cx.error( ACH_FAILED_SYSCALL, "Couldn't send UDP message to %s:%d, %s (%d)\n",
+                      inet_ntoa(addr->sin_addr), ntohs(addr->sin_port), strerror(errno), errno );
+        }
+    }
+    ACH_LOG( LOG_DEBUG, "Sent %" PRIuPTR " UDP datagrams\n", sent );
+    return udp_check( conn, ucx );
+}
+
+/* Send the n queued datagrams as one chain of linked sendmsg
+ * requests and wait for all of them.  A failure cancels the rest of
+ * the chain, so resume from the first datagram that failed. */
+static int udp_send_uring( struct achd_conn *conn, struct udp_cx *ucx, size_t n ) {
+    struct pollfd pfd[] = {{ .fd = conn->aux,
+                             .events = POLLOUT},
+                           { .fd = udp_tcp_fd(conn),
+                             .events = POLLIN } };
+    size_t sent = 0;
+    while( sent < n && !cx.sig_received ) {
+        size_t k;
+        uint64_t now = conn->latency ? achd_realtime_ns() : 0;
+        for( k = sent; k < n; k++ ) {
+            size_t f = k / ucx->n_path;
+            if( conn->latency ) achd_stamp( ucx->stamp[f], ucx->get_ns[f], now );
+            if( achd_uring_sendmsg( ucx->uring, conn->aux, &ucx->msg[k].msg_hdr, k, k+1 < n ) ) {
+                cx.error( ACH_BUG, "io_uring submission queue full\n" );
+            }
+        }
+        if( achd_uring_submit( ucx->uring, (unsigned)(n - sent), -1 ) ) {
+            cx.error( ACH_FAILED_SYSCALL, "Couldn't submit UDP messages: %s\n", strerror(errno) );
+        }
+
+        size_t failed = n;
+        int err = 0;
+        while( achd_uring_inflight(ucx->uring) > 0 ) {
+            uint64_t data;
+            int32_t res;
+            if( ! achd_uring_reap( ucx->uring, &data, &res ) ) {
+                if( achd_uring_submit( ucx->uring, 1, -1 ) ) {
+                    cx.error( ACH_FAILED_SYSCALL, "Couldn't wait for UDP messages: %s\n", strerror(errno) );
+                }
+            } else if( res < 0 && data < failed ) {
+                failed = (size_t)data;
+                err = -res;
+            }
+        }
+        sent = failed;
+
+        if( sent == n || EINTR == err || ECANCELED == err ) {
+            continue;
+        } else if( EAGAIN == err || EWOULDBLOCK == err || ENOBUFS == err ) {
+            if( udp_poll( conn, pfd, -1 ) < 0 ) return -1;
+        } else {
+            struct sockaddr_in *addr = (struct sockaddr_in*)ucx->msg[sent].msg_hdr.msg_name;
+            cx.error( ACH_FAILED_SYSCALL, "Couldn't send UDP message to %s:%d, %s (%d)\n",
+                      inet_ntoa(addr->sin_addr), ntohs(addr->sin_port), strerror(err), err );
+        }
+    }
+    ACH_LOG( LOG_DEBUG, "Sent %" PRIuPTR " UDP datagrams\n", sent );
+    return udp_check( conn, ucx );
+}
+
+/* Send frames to each of the ucx->n_path addresses at addr_udp.
+ * When there is a TCP control connection and it closes, maybe
+ * reconnect and look up the peer again. */
+static void udp_push( struct achd_conn *conn, struct sockaddr_in *addr_udp ) {
+    struct udp_cx *ucx = (struct udp_cx*)conn->cx;
+    assert(ucx);
+    assert( ucx->n_path > 0 );
+
+    int warned_mtu_eth = 0;
+    int warned_mtu_udp = 0;
+
+    /* Only batch when every frame is wanted, not just the latest */
+    int batch = !( conn->send_hdr.get_last || conn->recv_hdr.get_last ||
+                   conn->send_hdr.period_ns || conn->recv_hdr.period_ns );
+
+    size_t p;
+    for( p = 0; p < ucx->n_path; p++ ) {
+        ACH_LOG( LOG_INFO, "sending UDP to %s:%d\n",
+                 inet_ntoa(addr_udp[p].sin_addr), ntohs(addr_udp[p].sin_port) );
+    }
+
+    udp_batch_alloc( ucx, conn->pipeframe_size );
+    if( conn->rudp ) achd_rudp_peer( conn, addr_udp );
+    achd_ctrl_start( conn );
+
     while( !cx.sig_received ) {
-        /* read the data */
+        /* wait for the first frame */
         get_frame(conn);
 
         if( cx.sig_received ) break;
 
-        /* Check size */
-        size_t cnt = ach_pipe_get_size( conn->pipeframe );
-        if( cnt > MTU_UDP ) {
-            if( ! warned_mtu_udp ) {
-                ACH_LOG( LOG_ERR, "Cannot send %" PRIuPTR " bytes via UDP\n", cnt );
-                warned_mtu_udp = 1;
+        /* then take any others already queued in the channel */
+        size_t n = 0;
+        size_t m = 0;
+        size_t i;
+        uint64_t seq = 0;
+        for( i = 0; i < ACHD_UDP_BATCH && !cx.sig_received; i++ ) {
+            ach_pipe_frame_t *frame;
+            if( 0 == i ) {
+                frame = conn->pipeframe;
+            } else if( batch && ACH_OK == get_buf( &ucx->frame[i], &ucx->frame_size[i], 0 ) ) {
+                frame = ucx->frame[i];
+            } else break;
+            if( conn->latency ) ucx->get_ns[n] = achd_realtime_ns();
+            if( conn->rudp && ACH_OK != ach_channel_seq( &cx.channel, &seq ) ) {
+                cx.error( ACH_BUG, "Couldn't get sequence number\n" );
             }
-            continue;
-        } else if ( cnt + HEADER_BYTES_UDP + HEADER_BYTES_IPV4 > MTU_ETH &&
-                    ! warned_mtu_eth ) {
-            ACH_LOG( LOG_WARNING, "Size %" PRIuPTR " exceeds typical ethernet MTU\n",
-                     cnt + HEADER_BYTES_UDP + HEADER_BYTES_IPV4 );
-            warned_mtu_eth = 1;
-        }
-
-        /* Poll fds */
-        /* TODO: does O_NONBLOCK make sense? */
-        pfd[0].revents = 0;
-        while( ! (pfd[0].revents & POLLOUT) ) {
-            int r = udp_poll( pfd );
-            if( r < 0 ) {
-                if( cx.reconnect ) {
-                    achd_reconnect(conn);
-                    udp_peer( conn, &addr_udp );
-                } else return;
-            } else if( cx.sig_received ) {
+
+            /* maybe encode */
+            if( conn->codec ) {
+                achd_encode( conn->codec, frame->data, ach_pipe_get_size(frame),
+                             &ucx->enc[n], &ucx->enc_size[n] );
+                frame = ucx->enc[n];
+            }
+
+            /* Check size */
+            size_t cnt = ach_pipe_get_size( frame );
+            size_t seq_size = (conn->rudp || ucx->multipath) ? ACHD_RUDP_SEQ_SIZE : 0;
+            size_t stamp_size = conn->latency ? ACHD_STAMP_SIZE : 0;
+            size_t extra = seq_size + stamp_size;
+            if( cnt + extra > MTU_UDP ) {
+                if( ! warned_mtu_udp ) {
+                    ACH_LOG( LOG_ERR, "Cannot send %" PRIuPTR " bytes via UDP\n", cnt );
+                    warned_mtu_udp = 1;
+                }
+                /* the channel sequence has a hole; don't let the
+                 * receiver NACK it */
+                if( conn->rudp ) achd_ctrl_write( conn, ACHD_CTRL_SKIP, seq, 1, 0 );
+                continue;
+            } else if ( cnt + extra + HEADER_BYTES_UDP + HEADER_BYTES_IPV4 > MTU_ETH &&
+                        ! warned_mtu_eth ) {
+                ACH_LOG( LOG_WARNING, "Size %" PRIuPTR " exceeds typical ethernet MTU\n",
+                         cnt + extra + HEADER_BYTES_UDP + HEADER_BYTES_IPV4 );
+                warned_mtu_eth = 1;
+            }
+
+            /* number only the frames actually sent */
+            if( ucx->multipath ) seq = ++ucx->mp_seq;
+
+            /* [seq] data [timestamps] */
+            if( seq_size ) achd_put_u64( ucx->seq[n], seq );
+            ucx->iov[n][0].iov_base = ucx->seq[n];
+            ucx->iov[n][0].iov_len = seq_size;
+            ucx->iov[n][1].iov_base = frame->data;
+            ucx->iov[n][1].iov_len = cnt;
+            ucx->iov[n][2].iov_base = ucx->stamp[n];
+            ucx->iov[n][2].iov_len = stamp_size;
+            for( p = 0; p < ucx->n_path; p++, m++ ) {
+                memset( &ucx->msg[m], 0, sizeof(ucx->msg[m]) );
+                ucx->msg[m].msg_hdr.msg_name = &addr_udp[p];
+                ucx->msg[m].msg_hdr.msg_namelen = sizeof(addr_udp[p]);
+                ucx->msg[m].msg_hdr.msg_iov = ucx->iov[n];
+                ucx->msg[m].msg_hdr.msg_iovlen = 3;
+            }
+            n++;
+        }
+
+        /* UDP Send */
+        while( m > 0 && !cx.sig_received &&
+               (ucx->uring ? udp_send_uring( conn, ucx, m ) : udp_send( conn, ucx, m )) < 0 ) {
+            if( cx.reconnect ) {
+                reconnect(conn);
+                udp_peers( conn );
+                if( conn->rudp ) achd_rudp_peer( conn, addr_udp );
+            } else {
+                achd_ctrl_stop( conn );
                 return;
-            } else if ( ! (pfd[0].revents & POLLOUT) ) {
-                ACH_LOG(LOG_ERR, "No output possible after poll\n");
             }
         }
+        if( conn->rudp && n > 0 ) achd_rudp_sent( conn, seq );
+    }
+    achd_ctrl_stop( conn );
+}
 
+/* user_data of io_uring requests that are not batch slots */
+#define UDP_URING_TCP    ((uint64_t)ACHD_UDP_BATCH)
+#define UDP_URING_CANCEL ((uint64_t)ACHD_UDP_BATCH + 1)
 
-        /* UDP Send */
-        ssize_t r = -1;
-        ACH_LOG( LOG_DEBUG, "Sending %"PRIuPTR" UDP bytes\n", cnt );
-        do {
-            r = sendto( conn->aux, conn->pipeframe->data, cnt, 0,
-                        (struct sockaddr*) &addr_udp, sizeof(addr_udp) );
-        } while( r < 0 && !cx.sig_received && EINTR == errno );
+/* Post a receive into batch slot i */
+static void udp_uring_post( struct achd_conn *conn, struct udp_cx *ucx, size_t i,
+                            size_t len, int fixed )
+{
+    int r;
+    if( fixed ) {
+        r = achd_uring_read_fixed( ucx->uring, conn->aux, ucx->frame[i]->data, len,
+                                   (unsigned)i, i );
+    } else {
+        ucx->iov[i][0].iov_base = ucx->frame[i]->data;
+        ucx->iov[i][0].iov_len = len;
+        memset( &ucx->msg[i], 0, sizeof(ucx->msg[i]) );
+        ucx->msg[i].msg_hdr.msg_name = &ucx->msg_addr[i];
+        ucx->msg[i].msg_hdr.msg_namelen = sizeof(ucx->msg_addr[i]);
+        ucx->msg[i].msg_hdr.msg_iov = ucx->iov[i];
+        ucx->msg[i].msg_hdr.msg_iovlen = 1;
+        r = achd_uring_recvmsg( ucx->uring, conn->aux, &ucx->msg[i].msg_hdr, i );
+    }
+    if( r ) cx.error( ACH_BUG, "io_uring submission queue full\n" );
+}
 
-        if( r < 0 || (size_t)r != cnt ) {
-            cx.error( ACH_FAILED_SYSCALL, "Couldn't send UDP message to %s:%d, %s (%d)\n",
-                      inet_ntoa(addr_udp.sin_addr), ntohs(addr_udp.sin_port), strerror(errno), errno );
+/* Receive with io_uring.  Every batch slot stays posted, along with a
+ * poll of the TCP connection, so one io_uring_enter() both submits
+ * the reposted slots and waits for the next datagrams.  With a known
+ * peer, the socket is connected so the kernel filters strays and
+ * datagrams are read straight into registered buffers.  Slots hold
+ * one byte more than max to detect truncation.
+ *
+ * Return -1 if the TCP control connection closed. */
+static int udp_pull_uring( struct achd_conn *conn, struct udp_cx *ucx,
+                           int from_peer, size_t max )
+{
+    struct achd_uring *ring = ucx->uring;
+    size_t i;
+    int fixed = 0;
+    if( from_peer && 1 == ucx->n_path ) {
+        if( connect( conn->aux, (struct sockaddr*)&ucx->path[0], sizeof(ucx->path[0]) ) ) {
+            cx.error( ACH_FAILED_SYSCALL, "Couldn't connect UDP socket: %s\n", strerror(errno) );
+        }
+        struct iovec iov[ACHD_UDP_BATCH];
+        for( i = 0; i < ACHD_UDP_BATCH; i++ ) {
+            iov[i].iov_base = ucx->frame[i]->data;
+            iov[i].iov_len = ucx->frame_size[i];
+        }
+        fixed = ( 0 == achd_uring_register( ring, iov, ACHD_UDP_BATCH ) );
+        if( !fixed ) {
+            ACH_LOG( LOG_DEBUG, "Couldn't register UDP buffers: %s\n", strerror(errno) );
         }
     }
+
+    for( i = 0; i < ACHD_UDP_BATCH; i++ ) udp_uring_post( conn, ucx, i, max + 1, fixed );
+    int tcp_fd = udp_tcp_fd(conn);
+    if( tcp_fd >= 0 && achd_uring_poll( ring, tcp_fd, UDP_URING_TCP ) ) {
+        cx.error( ACH_BUG, "io_uring submission queue full\n" );
+    }
+
+    int closed = 0;
+    while( !cx.sig_received && !closed ) {
+        if( achd_uring_submit( ring, 1, conn->rudp ? achd_rudp_timeout(conn) : -1 ) ) {
+            cx.error( ACH_FAILED_SYSCALL, "Couldn't wait for UDP messages: %s\n", strerror(errno) );
+        }
+        uint64_t recv_ns = (conn->latency || conn->rudp) ? achd_realtime_ns() : 0;
+        uint64_t data;
+        int32_t res;
+        while( achd_uring_reap( ring, &data, &res ) ) {
+            if( UDP_URING_TCP == data ) {
+                if( res < 0 ) {
+                    cx.error( ACH_FAILED_SYSCALL, "Couldn't poll : %s\n", strerror(-res) );
+                }
+                closed = udp_tcp_input( conn ) < 0;
+                if( !closed && achd_uring_poll( ring, tcp_fd, UDP_URING_TCP ) ) {
+                    cx.error( ACH_BUG, "io_uring submission queue full\n" );
+                }
+                continue;
+            } else if( data >= ACHD_UDP_BATCH ) {
+                continue;
+            }
+
+            i = (size_t)data;
+            size_t cnt = (size_t)res;
+            if( res < 0 ) {
+                /* A connected socket reports ICMP errors, e.g., while
+                 * the peer reconnects; the TCP poll sees real closes */
+                if( EINTR != -res && EAGAIN != -res && ECONNREFUSED != -res ) {
+                    cx.error( ACH_FAILED_SYSCALL, "Couldn't receive UDP messages: %s (%d)\n",
+                              strerror(-res), -res );
+                }
+            } else if( cnt > max || (!fixed && (ucx->msg[i].msg_hdr.msg_flags & MSG_TRUNC)) ) {
+                ACH_LOG( LOG_ERR, "Dropping datagram larger than channel\n" );
+            } else if( from_peer && !fixed && !udp_from_peer( ucx, &ucx->msg_addr[i] ) ) {
+                ACH_LOG( LOG_WARNING, "Stray packet from %s:%d\n",
+                         inet_ntoa(ucx->msg_addr[i].sin_addr), ntohs(ucx->msg_addr[i].sin_port) );
+            } else if( ucx->multipath ) {
+                udp_mp_recv( conn, ucx, ucx->frame[i]->data, cnt, recv_ns );
+            } else if( conn->rudp ) {
+                achd_rudp_recv( conn, ucx->frame[i]->data, cnt, recv_ns );
+            } else if( cnt > 0 ) {
+                achd_recv_frame( conn, ucx->frame[i]->data, cnt, recv_ns );
+            }
+            udp_uring_post( conn, ucx, i, max + 1, fixed );
+        }
+        if( conn->rudp && !closed ) achd_rudp_check( conn );
+    }
+
+    /* Nothing may be pending when the socket closes */
+    for( i = 0; i <= ACHD_UDP_BATCH; i++ ) {
+        if( achd_uring_cancel( ring, i, UDP_URING_CANCEL ) ) {
+            cx.error( ACH_BUG, "io_uring submission queue full\n" );
+        }
+    }
+    while( achd_uring_inflight(ring) > 0 ) {
+        uint64_t data;
+        int32_t res;
+        if( ! achd_uring_reap( ring, &data, &res ) && achd_uring_submit( ring, 1, -1 ) ) {
+            cx.error( ACH_FAILED_SYSCALL, "Couldn't cancel UDP receives: %s\n", strerror(errno) );
+        }
+    }
+    if( fixed ) achd_uring_unregister( ring );
+
+    return closed ? -1 : 0;
 }
 
-void achd_pull_udp( struct achd_conn *conn ) {
-    /* struct udp_cx *ucx = (struct udp_cx*)conn->cx; */
-    /* assert(ucx); */
+/* Receive one raw datagram straight into the channel, finding its
+ * size and source first with MSG_PEEK.  For large frames, this saves
+ * more than the system calls that recvmmsg() batching saves.
+ *
+ * Return 1 if the channel can't be read into directly, -1 if the TCP
+ * control connection closed, and 0 otherwise. */
+static int udp_recv_direct( struct achd_conn *conn, struct udp_cx *ucx, int from_peer,
+                            size_t max, struct pollfd pfd[2] )
+{
+    struct sockaddr_in from;
+    socklen_t from_len = sizeof(from);
+    ssize_t n = recvfrom( conn->aux, NULL, 0, MSG_PEEK | MSG_TRUNC,
+                          (struct sockaddr*)&from, &from_len );
+    if( n < 0 ) {
+        if( EAGAIN == errno || EWOULDBLOCK == errno ) {
+            pfd[0].revents = 0;
+            pfd[1].fd = udp_tcp_fd(conn);
+            return udp_poll( conn, pfd, -1 ) < 0 ? -1 : 0;
+        } else if( EINTR != errno ) {
+            cx.error( ACH_FAILED_SYSCALL, "Couldn't receive UDP messages: %s (%d)\n",
+                      strerror(errno), errno );
+        }
+        return 0;
+    }
 
-    /* Find peer address */
-    struct sockaddr_in addr_peer;
-    memset( &addr_peer, 0, sizeof(addr_peer) );
-    udp_peer( conn, &addr_peer );
+    int stray = from_peer && !udp_from_peer( ucx, &from );
+    if( 0 == n || (size_t)n > max || stray ) {
+        if( stray ) {
+            ACH_LOG( LOG_WARNING, "Stray packet from %s:%d, wanted %s:%d\n",
+                     inet_ntoa(from.sin_addr), ntohs(from.sin_port),
+                     inet_ntoa(ucx->path[0].sin_addr), ntohs(ucx->path[0].sin_port) );
+        } else if( n ) {
+            ACH_LOG( LOG_ERR, "Dropping datagram larger than channel\n" );
+        }
+        if( recv( conn->aux, NULL, 0, 0 ) < 0 ) {
+            ACH_LOG( LOG_ERR, "Couldn't drop datagram: %s\n", strerror(errno) );
+        }
+    } else {
+        struct direct_cx d = { .fd = conn->aux, .len = (size_t)n };
+        enum ach_status r = ach_put_transfer( &cx.channel, direct_recv, &d, NULL, (size_t)n );
+        switch( r ) {
+        case ACH_OK:
+            break;
+        case ACH_ENOTSUP:
+            ACH_LOG( LOG_DEBUG, "Channel does not take direct puts\n" );
+            conn->direct_off = 1;
+            return 1;
+        case ACH_EAGAIN:
+            ACH_LOG( LOG_ERR, "Couldn't receive datagram\n" );
+            break;
+        default:
+            cx.error( r, "Couldn't put frame, size %" PRIuPTR "\n", (size_t)n );
+        }
+    }
+    return udp_check( conn, ucx ) < 0 ? -1 : 0;
+}
+
+/* Receive frames, only from the peer's paths if from_peer */
+static void udp_pull( struct achd_conn *conn, int from_peer ) {
+    struct udp_cx *ucx = (struct udp_cx*)conn->cx;
+    assert(ucx);
+
+    /* Anything larger than the channel could never be put */
+    size_t max = MTU_UDP;
+    if( cx.channel.shm && cx.channel.shm->data_size < max ) {
+        max = cx.channel.shm->data_size;
+        if( conn->codec ) max = achd_codec_bound(max);
+        if( conn->latency ) max += ACHD_STAMP_SIZE;
+        if( conn->rudp || ucx->multipath ) max += ACHD_RUDP_SEQ_SIZE;
+    }
+
+    udp_mp_reset( ucx );
+    if( ucx->uring ) {
+        udp_batch_alloc( ucx, max + 1 );
+        while( !cx.sig_received && udp_pull_uring( conn, ucx, from_peer, max ) < 0 ) {
+            if( cx.reconnect && from_peer ) {
+                reconnect(conn);
+                udp_peers( conn );
+                udp_mp_reset( ucx );
+            } else break;
+        }
+        udp_mp_reset( ucx );
+        return;
+    }
+
+    udp_batch_alloc( ucx, max );
 
     /* setup for poll */
     struct pollfd pfd[] = {{ .fd = conn->aux,
                              .events = POLLIN},
-                           { .fd = conn->in,
+                           { .fd = udp_tcp_fd(conn),
                              .events = POLLIN } };
 
+    /* Large raw frames go straight into the channel */
+    int direct = !conn->direct_off && !conn->rudp && !ucx->multipath &&
+        !conn->codec && !conn->latency && cx.channel.shm &&
+        cx.channel.shm->data_size / cx.channel.shm->index_cnt >= ACHD_DIRECT_MIN;
+
     /* Get the packets */
     while( !cx.sig_received ) {
-        /* Poll FDs */
-        pfd[0].revents = 0;
-        while( ! (pfd[0].revents & POLLIN) ) {
-            int r = udp_poll( pfd );
-            if( cx.sig_received ) {
-                ACH_LOG(LOG_DEBUG, "Poll got EINTR");
-                return;;
-            } else if( r < 0 ) {
-                if( cx.reconnect ) {
-                    achd_reconnect(conn);
-                    udp_peer( conn, &addr_peer );
-                } else return;
-            } else if ( ! (pfd[0].revents & POLLIN) ) {
-                ACH_LOG(LOG_ERR, "No input avaiable after poll\n");
+        int closed = 0;
+        size_t i;
+        int d = direct ? udp_recv_direct( conn, ucx, from_peer, max, pfd ) : 1;
+        if( d <= 0 ) {
+            closed = d < 0;
+        } else {
+            direct = 0;
+            for( i = 0; i < ACHD_UDP_BATCH; i++ ) {
+                ucx->iov[i][0].iov_base = ucx->frame[i]->data;
+                ucx->iov[i][0].iov_len = ucx->frame_size[i];
+                memset( &ucx->msg[i], 0, sizeof(ucx->msg[i]) );
+                ucx->msg[i].msg_hdr.msg_name = &ucx->msg_addr[i];
+                ucx->msg[i].msg_hdr.msg_namelen = sizeof(ucx->msg_addr[i]);
+                ucx->msg[i].msg_hdr.msg_iov = ucx->iov[i];
+                ucx->msg[i].msg_hdr.msg_iovlen = 1;
+            }
+
+            /* Read packets */
+            int r = recvmmsg( conn->aux, ucx->msg, ACHD_UDP_BATCH, 0, NULL );
+            if( r < 0 ) {
+                if( EAGAIN == errno || EWOULDBLOCK == errno ) {
+                    /* Nothing queued, sleep till something arrives or a
+                     * missing frame needs a NACK */
+                    pfd[0].revents = 0;
+                    pfd[1].fd = udp_tcp_fd(conn);
+                    closed = udp_poll( conn, pfd, conn->rudp ? achd_rudp_timeout(conn) : -1 ) < 0;
+                    if( conn->rudp && !closed ) achd_rudp_check( conn );
+                } else if( EINTR != errno ) {
+                    cx.error( ACH_FAILED_SYSCALL, "Couldn't receive UDP messages: %s (%d)\n",
+                              strerror(errno), errno );
+                }
+            } else {
+                ACH_LOG( LOG_DEBUG, "Received %d UDP datagrams\n", r );
+                uint64_t recv_ns = (conn->latency || conn->rudp) ? achd_realtime_ns() : 0;
+                for( i = 0; i < (size_t)r && !cx.sig_received; i++ ) {
+                    struct sockaddr_in *addr_udp = &ucx->msg_addr[i];
+                    size_t cnt = ucx->msg[i].msg_len;
+                    /* Check that peer matches */
+                    if( from_peer && !udp_from_peer( ucx, addr_udp ) ) {
+                        ACH_LOG( LOG_WARNING, "Stray packet from %s:%d, wanted %s:%d\n",
+                                 inet_ntoa(addr_udp->sin_addr), ntohs(addr_udp->sin_port),
+                                 inet_ntoa(ucx->path[0].sin_addr), ntohs(ucx->path[0].sin_port) );
+                    } else if( ucx->msg[i].msg_hdr.msg_flags & MSG_TRUNC ) {
+                        ACH_LOG( LOG_ERR, "Dropping datagram larger than channel\n" );
+                    } else if( ucx->multipath ) {
+                        udp_mp_recv( conn, ucx, ucx->frame[i]->data, cnt, recv_ns );
+                    } else if( conn->rudp ) {
+                        achd_rudp_recv( conn, ucx->frame[i]->data, cnt, recv_ns );
+                    } else if( cnt > 0 ) {
+                        /* Put the frame */
+                        achd_recv_frame( conn, ucx->frame[i]->data, cnt, recv_ns );
+                    }
+                }
+                closed = udp_check( conn, ucx ) < 0;
+                if( conn->rudp && !closed ) achd_rudp_check( conn );
             }
         }
 
-        /* Read packet */
-        struct sockaddr_in addr_udp;
-        memset( &addr_udp, 0, sizeof(addr_udp) );
-        socklen_t len = sizeof(addr_udp);
-        ssize_t r = -1;
-        do {
-            /* TODO: handle too small buffers */
-            r = recvfrom( conn->aux, conn->pipeframe->data, conn->pipeframe_size,
-                          0, (struct sockaddr*) &addr_udp, &len );
-        } while( r < 0 && EINTR == errno && !cx.sig_received );
+        if( closed ) {
+            if( cx.reconnect && from_peer ) {
+                reconnect(conn);
+                udp_peers( conn );
+                udp_mp_reset( ucx );
+            } else break;
+        }
+    }
+    udp_mp_reset( ucx );
+}
 
-        if( cx.sig_received ) break;
+void achd_push_udp( struct achd_conn *conn ) {
+    struct udp_cx *ucx = (struct udp_cx*)conn->cx;
+    /* Find remote address */
+    udp_peers( conn );
+    udp_push( conn, ucx->path );
+}
+
+void achd_pull_udp( struct achd_conn *conn ) {
+    /* Find peer address */
+    udp_peers( conn );
+    udp_pull( conn, 1 );
+}
+
+/* Reliable UDP sends every frame in order, so it cannot skip to the
+ * latest frame or depend on the previous one */
+int achd_rudp_sock( struct achd_conn *conn ) {
+    if( conn->send_hdr.get_last || conn->recv_hdr.get_last ||
+        conn->send_hdr.period_ns || conn->recv_hdr.period_ns )
+    {
+        cx.error( ACH_BAD_HEADER, "Reliable UDP cannot send only the latest frames\n" );
+    }
+    if( conn->send_hdr.delta_keyframe || conn->recv_hdr.delta_keyframe ) {
+        cx.error( ACH_BAD_HEADER, "Reliable UDP does not support delta encoding\n" );
+    }
+    return achd_udp_sock( conn );
+}
+
+void achd_push_rudp( struct achd_conn *conn ) {
+    achd_rudp_setup( conn );
+    achd_push_udp( conn );
+}
 
-        /* Check that peer matches */
-        if( 0 != memcmp( &(addr_udp.sin_addr), &(addr_peer.sin_addr),
-                         sizeof(addr_udp.sin_addr) ) ||
-            addr_udp.sin_port != addr_peer.sin_port )
+void achd_pull_rudp( struct achd_conn *conn ) {
+    achd_rudp_setup( conn );
+    achd_pull_udp( conn );
+}
+
+/* Multipath UDP sends every frame over each of the server's paths
+ * given with -a, as well as the TCP peer's address, and the receiver
+ * puts whichever copy arrives first.  The client tells the server its
+ * own address on each path in the udp-paths header. */
+
+int achd_mpudp_sock( struct achd_conn *conn ) {
+    achd_udp_sock( conn );
+    struct udp_cx *ucx = (struct udp_cx*)conn->cx;
+    ucx->multipath = 1;
+    if( ACHD_MODE_SERVE == conn->mode || 0 == cx.n_paths ) return 0;
+
+    /* Find the local address the kernel routes each path from */
+    char paths[ACHD_UDP_PATHS * INET_ADDRSTRLEN] = {0};
+    int i;
+    for( i = 0; i < cx.n_paths; i++ ) {
+        struct sockaddr_in addr;
+        memset( &addr, 0, sizeof(addr) );
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons((in_port_t)cx.port);
+        if( udp_resolve( cx.paths[i], &addr.sin_addr ) ) continue;
+        int fd = socket( PF_INET, SOCK_DGRAM, IPPROTO_UDP );
+        socklen_t len = sizeof(addr);
+        if( fd < 0 ||
+            connect( fd, (struct sockaddr*)&addr, sizeof(addr) ) ||
+            getsockname( fd, (struct sockaddr*)&addr, &len ) )
         {
-            ACH_LOG( LOG_WARNING, "Stray packet from %s:%d, wanted %s:%d\n",
-                     inet_ntoa(addr_udp.sin_addr), ntohs(addr_udp.sin_port),
-                     inet_ntoa(addr_peer.sin_addr), ntohs(addr_peer.sin_port) );
-            continue;
+            ACH_LOG( LOG_ERR, "Couldn't find local address for path %s: %s\n",
+                     cx.paths[i], strerror(errno) );
+        } else {
+            if( paths[0] ) strcat( paths, "," );
+            strcat( paths, inet_ntoa(addr.sin_addr) );
+        }
+        if( fd >= 0 ) close(fd);
+    }
+
+    if( paths[0] && ACH_OK != achd_printf( conn->out, "udp-paths: %s\n", paths ) ) {
+        cx.error(ACH_FAILED_SYSCALL, "Couldn't write udp-paths: %s\n", strerror(errno) );
+    }
+    return 0;
+}
+
+/* Multicast has no TCP control connection: conn->in is -1, which
+ * poll() ignores, so the UDP loops simply run until signalled. */
+
+int achd_mcast_sock( struct achd_conn *conn ) {
+    struct udp_cx *ucx;
+    if( conn->cx ) {
+        ucx = (struct udp_cx*)conn->cx;
+    } else {
+        conn->cx = ucx = (struct udp_cx*)calloc(1, sizeof(struct udp_cx));
+    }
+
+    /* Find group */
+    {
+        char port_buf[32];
+        sprintf(port_buf, "%d", cx.port );
+        struct addrinfo hints;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_DGRAM;
+        hints.ai_protocol = IPPROTO_UDP;
+        struct addrinfo *addr;
+        int r = getaddrinfo( cx.cl_opts.remote_host, port_buf, &hints, &addr );
+        if( r ) {
+            cx.error( ACH_BAD_HEADER, "Group '%s' not found: %s\n",
+                      cx.cl_opts.remote_host, gai_strerror(r) );
         }
+        memcpy( &ucx->addr, addr->ai_addr, sizeof(ucx->addr) );
+        freeaddrinfo(addr);
+    }
+    if( ! IN_MULTICAST( ntohl(ucx->addr.sin_addr.s_addr) ) ) {
+        cx.error( ACH_BAD_HEADER, "Not a multicast group: %s\n", inet_ntoa(ucx->addr.sin_addr) );
+    }
 
-        ACH_LOG( LOG_DEBUG, "Received %" PRIdPTR " UDP bytes from %s:%d\n",
-                 r, inet_ntoa(addr_udp.sin_addr), ntohs(addr_udp.sin_port) );
+    /* Create socket */
+    conn->aux = socket( PF_INET, SOCK_DGRAM, IPPROTO_UDP );
+    if( conn->aux < 0 ) {
+        cx.error(ACH_FAILED_SYSCALL, "Couldn't create UDP socket: %s\n", strerror(errno) );
+    }
+    udp_sock_mode( ucx, conn->aux );
 
-        /* Put the frame */
-        ach_pipe_set_size( conn->pipeframe, (size_t)r );
-        put_frame(conn);
+    if( ACHD_DIRECTION_PUSH == conn->vtab->direction ) {
+        /* Senders loop back, so local pullers see the group too */
+        unsigned char ttl = ACHD_MCAST_TTL;
+        unsigned char loop = 1;
+        if( setsockopt( conn->aux, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl) ) ||
+            setsockopt( conn->aux, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop) ) )
+        {
+            cx.error( ACH_FAILED_SYSCALL, "Couldn't set multicast options: %s\n", strerror(errno) );
+        }
+    } else {
+        /* Many pullers may share the group on one host */
+        int yes = 1;
+        if( setsockopt( conn->aux, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes) ) ) {
+            cx.error( ACH_FAILED_SYSCALL, "Couldn't set SO_REUSEADDR: %s\n", strerror(errno) );
+        }
+        /* Binding the group address filters other groups on this port */
+        if( bind( conn->aux, (struct sockaddr*)&ucx->addr, sizeof(ucx->addr) ) ) {
+            cx.error( ACH_FAILED_SYSCALL, "Could not bind multicast socket: %s\n", strerror(errno) );
+        }
+        struct ip_mreq mreq;
+        memset( &mreq, 0, sizeof(mreq) );
+        mreq.imr_multiaddr = ucx->addr.sin_addr;
+        mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+        if( setsockopt( conn->aux, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq) ) ) {
+            cx.error( ACH_FAILED_SYSCALL, "Couldn't join group %s: %s\n",
+                      inet_ntoa(ucx->addr.sin_addr), strerror(errno) );
+        }
+        ACH_LOG( LOG_INFO, "joined group %s:%d\n",
+                 inet_ntoa(ucx->addr.sin_addr), ntohs(ucx->addr.sin_port) );
     }
 
+    return 0;
+}
+
+void achd_push_mcast( struct achd_conn *conn ) {
+    struct udp_cx *ucx = (struct udp_cx*)conn->cx;
+    assert(ucx);
+    ucx->path[0] = ucx->addr;
+    ucx->n_path = 1;
+    udp_push( conn, ucx->path );
+}
+
+void achd_pull_mcast( struct achd_conn *conn ) {
+    udp_pull( conn, 0 );
 }
@@ -0,0 +1,333 @@
+/*
+ * Copyright (c) 2015, Rice University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *     * Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials
+ *       provided with the distribution.
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written
+ *       permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* A minimal io_uring wrapper for achd's UDP transports.
+ *
+ * This talks to the kernel with the raw system calls, so it needs no
+ * liburing.  When io_uring is missing, e.g., on old kernels or when
+ * it is disabled by sysctl, achd_uring_create() returns NULL and the
+ * caller keeps using poll().
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#define _GNU_SOURCE
+#include <time.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <syslog.h>
+
+#include "ach.h"
+#include "achutil.h"
+#include "achd.h"
+
+#ifdef HAVE_IO_URING
+
+#include <linux/io_uring.h>
+
+struct achd_uring {
+    int fd;
+    unsigned inflight;         ///< submitted or queued, not yet reaped
+    unsigned to_submit;
+
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_entries;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+};
+
+struct achd_uring *achd_uring_create( unsigned entries ) {
+    struct io_uring_params p;
+    memset( &p, 0, sizeof(p) );
+    int fd = (int)syscall( __NR_io_uring_setup, entries, &p );
+    if( fd < 0 ) {
+        ACH_LOG( LOG_DEBUG, "io_uring_setup failed: %s\n", strerror(errno) );
+        return NULL;
+    }
+    if( !(p.features & IORING_FEAT_EXT_ARG) ) {
+        ACH_LOG( LOG_DEBUG, "io_uring lacks IORING_FEAT_EXT_ARG\n" );
+        close( fd );
+        return NULL;
+    }
+
+    struct achd_uring *ring = (struct achd_uring*)calloc( 1, sizeof(*ring) );
+    ring->fd = fd;
+    ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    int single = p.features & IORING_FEAT_SINGLE_MMAP;
+    if( single && ring->cq_ring_size > ring->sq_ring_size ) {
+        ring->sq_ring_size = ring->cq_ring_size;
+    }
+    ring->sq_ring = mmap( NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING );
+    if( MAP_FAILED == ring->sq_ring ) goto fail;
+    if( single ) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap( NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                              MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING );
+        if( MAP_FAILED == ring->cq_ring ) goto fail;
+    }
+    ring->sqes = (struct io_uring_sqe*)mmap( NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                                             MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES );
+    if( MAP_FAILED == ring->sqes ) goto fail;
+
+    uint8_t *sq = (uint8_t*)ring->sq_ring;
+    ring->sq_head = (unsigned*)(sq + p.sq_off.head);
+    ring->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    ring->sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+    ring->sq_entries = (unsigned*)(sq + p.sq_off.ring_entries);
+    ring->sq_array = (unsigned*)(sq + p.sq_off.array);
+
+    uint8_t *cq = (uint8_t*)ring->cq_ring;
+    ring->cq_head = (unsigned*)(cq + p.cq_off.head);
+    ring->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    ring->cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+
+    return ring;
+
+fail:
+    ACH_LOG( LOG_ERR, "Couldn't map io_uring: %s\n", strerror(errno) );
+    achd_uring_destroy( ring );
+    return NULL;
+}
+
+void achd_uring_destroy( struct achd_uring *ring ) {
+    if( !ring ) return;
+    if( ring->sqes && MAP_FAILED != (void*)ring->sqes ) munmap( ring->sqes, ring->sqes_size );
+    if( ring->cq_ring && MAP_FAILED != ring->cq_ring && ring->cq_ring != ring->sq_ring ) {
+        munmap( ring->cq_ring, ring->cq_ring_size );
+    }
+    if( ring->sq_ring && MAP_FAILED != ring->sq_ring ) munmap( ring->sq_ring, ring->sq_ring_size );
+    close( ring->fd );
+    free( ring );
+}
+
+int achd_uring_register( struct achd_uring *ring, const struct iovec *iov, unsigned n ) {
+    return (int)syscall( __NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, iov, n );
+}
+
+int achd_uring_unregister( struct achd_uring *ring ) {
+    return (int)syscall( __NR_io_uring_register, ring->fd, IORING_UNREGISTER_BUFFERS, NULL, 0 );
+}
+
+/* Get a zeroed submission entry, or NULL if the queue is full */
+static struct io_uring_sqe *get_sqe( struct achd_uring *ring ) {
+    unsigned head = __atomic_load_n( ring->sq_head, __ATOMIC_ACQUIRE );
+    unsigned tail = *ring->sq_tail;
+    if( tail - head >= *ring->sq_entries ) return NULL;
+    unsigned i = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[i];
+    memset( sqe, 0, sizeof(*sqe) );
+    ring->sq_array[i] = i;
+    return sqe;
+}
+
+static int put_sqe( struct achd_uring *ring, struct io_uring_sqe *sqe, uint64_t data ) {
+    sqe->user_data = data;
+    __atomic_store_n( ring->sq_tail, *ring->sq_tail + 1, __ATOMIC_RELEASE );
+    ring->to_submit++;
+    ring->inflight++;
+    return 0;
+}
+
+int achd_uring_recvmsg( struct achd_uring *ring, int fd, struct msghdr *msg, uint64_t data ) {
+    struct io_uring_sqe *sqe = get_sqe( ring );
+    if( !sqe ) return -1;
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)msg;
+    sqe->len = 1;
+    return put_sqe( ring, sqe, data );
+}
+
+int achd_uring_sendmsg( struct achd_uring *ring, int fd, const struct msghdr *msg,
+                        uint64_t data, int link )
+{
+    struct io_uring_sqe *sqe = get_sqe( ring );
+    if( !sqe ) return -1;
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)msg;
+    sqe->len = 1;
+    if( link ) sqe->flags = IOSQE_IO_LINK;
+    return put_sqe( ring, sqe, data );
+}
+
+int achd_uring_read_fixed( struct achd_uring *ring, int fd, void *buf, size_t n,
+                           unsigned buf_index, uint64_t data )
+{
+    struct io_uring_sqe *sqe = get_sqe( ring );
+    if( !sqe ) return -1;
+    sqe->opcode = IORING_OP_READ_FIXED;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = (uint32_t)n;
+    sqe->buf_index = (uint16_t)buf_index;
+    return put_sqe( ring, sqe, data );
+}
+
+int achd_uring_poll( struct achd_uring *ring, int fd, uint64_t data ) {
+    struct io_uring_sqe *sqe = get_sqe( ring );
+    if( !sqe ) return -1;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLIN;
+    return put_sqe( ring, sqe, data );
+}
+
+int achd_uring_cancel( struct achd_uring *ring, uint64_t target, uint64_t data ) {
+    struct io_uring_sqe *sqe = get_sqe( ring );
+    if( !sqe ) return -1;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = target;
+    return put_sqe( ring, sqe, data );
+}
+
+int achd_uring_submit( struct achd_uring *ring, unsigned wait_nr, int timeout_ms ) {
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    unsigned flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+    void *argp = NULL;
+    size_t argsz = 0;
+    if( wait_nr && timeout_ms >= 0 ) {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+        memset( &arg, 0, sizeof(arg) );
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+        flags |= IORING_ENTER_EXT_ARG;
+        argp = &arg;
+        argsz = sizeof(arg);
+    }
+    int r = (int)syscall( __NR_io_uring_enter, ring->fd, ring->to_submit, wait_nr,
+                          flags, argp, argsz );
+    if( r >= 0 ) {
+        ring->to_submit -= (unsigned)r;
+        return 0;
+    } else if( ETIME == errno || EINTR == errno || EAGAIN == errno || EBUSY == errno ) {
+        return 0;
+    }
+    return -1;
+}
+
+int achd_uring_reap( struct achd_uring *ring, uint64_t *data, int32_t *res ) {
+    unsigned head = *ring->cq_head;
+    if( head == __atomic_load_n( ring->cq_tail, __ATOMIC_ACQUIRE ) ) return 0;
+    struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+    *data = cqe->user_data;
+    *res = cqe->res;
+    __atomic_store_n( ring->cq_head, head + 1, __ATOMIC_RELEASE );
+    ring->inflight--;
+    return 1;
+}
+
+unsigned achd_uring_inflight( const struct achd_uring *ring ) {
+    return ring->inflight;
+}
+
+#else /* HAVE_IO_URING */
+
+struct achd_uring *achd_uring_create( unsigned entries ) {
+    (void)entries;
+    ACH_LOG( LOG_DEBUG, "achd was built without io_uring\n" );
+    return NULL;
+}
+
+/* Without a ring, nothing below can be called */
+
+void achd_uring_destroy( struct achd_uring *ring ) { (void)ring; }
+int achd_uring_register( struct achd_uring *ring, const struct iovec *iov, unsigned n ) {
+    (void)ring; (void)iov; (void)n;
+    return -1;
+}
+int achd_uring_unregister( struct achd_uring *ring ) { (void)ring; return -1; }
+int achd_uring_recvmsg( struct achd_uring *ring, int fd, struct msghdr *msg, uint64_t data ) {
+    (void)ring; (void)fd; (void)msg; (void)data;
+    return -1;
+}
+int achd_uring_sendmsg( struct achd_uring *ring, int fd, const struct msghdr *msg,
+                        uint64_t data, int link ) {
+    (void)ring; (void)fd; (void)msg; (void)data; (void)link;
+    return -1;
+}
+int achd_uring_read_fixed( struct achd_uring *ring, int fd, void *buf, size_t n,
+                           unsigned buf_index, uint64_t data ) {
+    (void)ring; (void)fd; (void)buf; (void)n; (void)buf_index; (void)data;
+    return -1;
+}
+int achd_uring_poll( struct achd_uring *ring, int fd, uint64_t data ) {
+    (void)ring; (void)fd; (void)data;
+    return -1;
+}
+int achd_uring_cancel( struct achd_uring *ring, uint64_t target, uint64_t data ) {
+    (void)ring; (void)target; (void)data;
+    return -1;
+}
+int achd_uring_submit( struct achd_uring *ring, unsigned wait_nr, int timeout_ms ) {
+    (void)ring; (void)wait_nr; (void)timeout_ms;
+    return -1;
+}
+int achd_uring_reap( struct achd_uring *ring, uint64_t *data, int32_t *res ) {
+    (void)ring; (void)data; (void)res;
+    return 0;
+}
+unsigned achd_uring_inflight( const struct achd_uring *ring ) { (void)ring; return 0; }
+
+#endif /* HAVE_IO_URING */
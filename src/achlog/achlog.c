@@ -0,0 +1,802 @@
+/* -*- mode: C; c-basic-offset: 4 -*- */
+/* ex: set shiftwidth=4 tabstop=4 expandtab: */
+/*
+ * Copyright (c) 2008-2013, Georgia Tech Research Corporation
+ * All rights reserved.
+ *
+ * Author(s): Neil T. Dantam <ntd@rice.edu>
+ * Georgia Tech Humanoid Robotics Lab
+ * Under Direction of Prof. Mike Stilman <mstilman@cc.gatech.edu>
+ *
+ *
+ * This file is provided under the following "BSD-style" License:
+ *
+ *
+ *   Redistribution and use in source and binary forms, with or
+ *   without modification, are permitted provided that the following
+ *   conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ *   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ *   CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *   INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ *   MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ *   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ *   USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ *   AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *   LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ *   ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *   POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#define _GNU_SOURCE
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <unistd.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <limits.h>
+#include <pwd.h>
+#include <fcntl.h>
+#include "ach.h"
+#include "ach/experimental.h"
+#include "ach/private_posix.h"
+#include "achutil.h"
+#include "achlog.h"
+
+static struct achlog_desc *log_desc = NULL;
+static size_t n_log = 0;
+/* static double opt_freq = 0; */
+static int opt_last = 0;
+static int opt_gzip = 0;
+static long opt_threads = -1;
+static long opt_ev_threads = 0;
+size_t opt_buf_size = ACHLOG_BUF_SIZE;
+int opt_direct = 0;
+double opt_sync = -1;
+int opt_rotate = 0;
+uint64_t opt_rotate_size = 0;
+static double opt_rotate_time = 0;
+int opt_lz = 0;
+int opt_level = 3;
+uint64_t opt_idx_frames = 1024;
+double opt_idx_time = 1.0;
+
+/* Incremented for each SIGHUP */
+static volatile sig_atomic_t rotate_gen = 0;
+
+static struct timespec now_ach, now_real;
+const char *now_real_str = "\n";
+
+/* SUSv2 guarantees that "Host names are limited to 255 bytes".
+ * POSIX.1-2001 guarantees that "Host names (not including the
+ * terminating null byte) are limited to HOST_NAME_MAX bytes".  On
+ * Linux, HOST_NAME_MAX is defined with the value 64, which has been
+ * the limit since Linux 1.0 (earlier kernels imposed a limit of 8
+ * bytes). */
+static char host[HOST_NAME_MAX+1] = {0};
+const struct passwd *passwd;
+
+static FILE *filter( const char *program, const char *channel, const char *suffix );
+
+static uint64_t now_ns( void ) {
+    struct timespec t;
+    clock_gettime( ACH_DEFAULT_CLOCK, &t );
+    return (uint64_t)t.tv_sec * 1000000000 + (uint64_t)t.tv_nsec;
+}
+
+int achlog_write_rec( struct achlog_desc *desc, const ach_log_rec_t *rec, size_t size ) {
+    uint64_t time;
+    ach_log_rec_get( rec, NULL, &time, NULL );
+    if( achlog_write( desc, rec, size, time ) ) return -1;
+    desc->offset += size;
+    return 0;
+}
+
+/* Index every opt_idx_frames frames or opt_idx_time seconds,
+ * whichever comes first. */
+void achlog_write_idx( struct achlog_desc *desc, uint64_t time, uint64_t seq,
+                       uint64_t offset, uint64_t frames )
+{
+    if( NULL == desc->file->fidx ) return;
+    if( !desc->indexed || desc->idx_frames >= opt_idx_frames ||
+        time - desc->idx_time >= (uint64_t)(opt_idx_time * 1e9) )
+    {
+        ach_log_idx_t ent;
+        ach_log_idx_set( &ent, time, seq, offset );
+        if( 1 != fwrite( &ent, sizeof(ent), 1, desc->file->fidx ) ) {
+            ACH_LOG( LOG_ERR, "Could not write index for %s, no longer indexing: %s\n",
+                     desc->name, strerror(errno) );
+            fclose( desc->file->fidx );
+            desc->file->fidx = NULL;
+        }
+        desc->indexed = 1;
+        desc->idx_frames = 0;
+        desc->idx_time = time;
+    }
+    desc->idx_frames += frames;
+}
+
+static int log_header( struct achlog_desc *desc ) {
+    char buf[2048];
+    int n = snprintf( buf, sizeof(buf),
+                      "ACHLOG\n"
+                      "channel-name: %s\n"
+                      "log-version: %d\n"
+                      "log-time-ach: %lu.%09lu\n"
+                      "log-time-real: %lu.%09lu # %s"
+                      "local-host: %s\n",
+                      desc->name, ACH_LOG_VERSION,
+                      now_ach.tv_sec, now_ach.tv_nsec,
+                      now_real.tv_sec, now_real.tv_nsec, now_real_str,
+                      host );
+    if( passwd ) {
+        n += snprintf( buf + n, sizeof(buf) - (size_t)n,
+                       "user: %s # %s\n",
+                       passwd->pw_name, passwd->pw_gecos );
+    }
+    if( opt_lz ) {
+        n += snprintf( buf + n, sizeof(buf) - (size_t)n, "log-compression: lz\n" );
+    }
+    if( opt_rotate ) {
+        n += snprintf( buf + n, sizeof(buf) - (size_t)n, "log-segment: %u\n",
+                       desc->segment );
+    }
+    n += snprintf( buf + n, sizeof(buf) - (size_t)n, ".\n" );
+    if( n >= (int)sizeof(buf) ) {
+        ACH_LOG( LOG_ERR, "Header too long for %s\n", desc->name );
+        return -1;
+    }
+
+    desc->offset = (uint64_t)n;
+    desc->seg_time = now_ns();
+    desc->indexed = 0;
+    desc->idx_frames = 0;
+    if( desc->file->fidx ) {
+        fwrite( ACH_LOG_IDX_MAGIC "\0\0", 8, 1, desc->file->fidx );
+    }
+    if( achlog_write( desc, buf, (size_t)n, now_ns() ) ) return -1;
+    return achlog_flush( desc );
+}
+
+/* Log a frame record of the given total size, preceded by gap if it
+ * is not NULL */
+static int log_frame( struct achlog_desc *desc, const ach_log_rec_t *gap,
+                      const ach_log_rec_t *rec, size_t size )
+{
+    uint64_t seq, time;
+    ach_log_rec_get( rec, &seq, &time, NULL );
+    if( opt_lz ) {
+        struct achlog_block *b = achlog_block_cur( desc );
+        if( 0 == b->frames ) {
+            b->seq = seq;
+            b->time = time;
+        }
+        if( gap ) achlog_block_append( b, gap, sizeof(*gap) );
+        achlog_block_append( b, rec, size );
+        b->frames++;
+        return ( b->raw_len >= ACHLOG_BLOCK_SIZE ) ? achlog_block_submit( desc ) : 0;
+    } else {
+        /* point the index at the gap, if any, preceding this frame */
+        uint64_t offset = desc->offset;
+        if( gap && achlog_write_rec( desc, gap, sizeof(*gap) ) ) return -1;
+        if( achlog_write_rec( desc, rec, size ) ) return -1;
+        achlog_write_idx( desc, time, seq, offset, 1 );
+        return 0;
+    }
+}
+
+/* Start a new segment if one is due, between frames.  The next
+ * segment is already open, so this only waits for the compression of
+ * blocks still in flight. */
+static int log_rotate( struct achlog_desc *desc, uint64_t now ) {
+    if( !opt_rotate ) return 0;
+    int gen = rotate_gen;
+    if( desc->rotate_gen == gen &&
+        !(opt_rotate_size && desc->offset >= opt_rotate_size) &&
+        !(opt_rotate_time > 0 && now - desc->seg_time >= (uint64_t)(opt_rotate_time * 1e9)) )
+    {
+        return 0;
+    }
+    desc->rotate_gen = gen;
+    if( opt_lz && ( achlog_block_submit( desc ) ||
+                    achlog_block_write( desc, ACHLOG_BLOCK_RING ) ) )
+    {
+        return -1;
+    }
+    if( achlog_writer_rotate( desc ) ) return -1;
+    return log_header( desc );
+}
+
+/* Log the frame that ach_get() returned r for into rec+1 */
+static int log_got( struct achlog_desc *desc, enum ach_status r,
+                    ach_log_rec_t *rec, size_t frame_size, uint64_t time )
+{
+    uint64_t seq;
+    ach_log_rec_t gap;
+    const ach_log_rec_t *pgap = NULL;
+    if( ACH_OK != ach_channel_seq( &desc->chan, &seq ) ) {
+        /* No sequence numbers, so we only know that
+         * something was missed */
+        seq = 0;
+        if( ACH_MISSED_FRAME == r ) {
+            ach_log_rec_set( &gap, ACH_LOG_REC_GAP, 0, time, 0 );
+            pgap = &gap;
+        }
+    } else if( seq > desc->last_seq + 1 ) {
+        ach_log_rec_set( &gap, ACH_LOG_REC_GAP, desc->last_seq + 1, time,
+                         seq - desc->last_seq - 1 );
+        pgap = &gap;
+    }
+    desc->last_seq = seq;
+    ach_log_rec_set( rec, ACH_LOG_REC_FRAME, seq, time, frame_size );
+    if( log_frame( desc, pgap, rec, sizeof(*rec) + frame_size ) ) return -1;
+    return log_rotate( desc, time );
+}
+
+/* When log_tick() next has work to do, or 0 for never */
+static uint64_t log_deadline( struct achlog_desc *desc ) {
+    uint64_t t = 0;
+    if( opt_lz ) {
+        /* write out compressed blocks and close partial blocks on
+         * idle channels */
+        if( desc->n_flight ) {
+            t = now_ns() + ACHLOG_BLOCK_FLUSH_NS / 100;
+        } else if( achlog_block_cur(desc)->frames ) {
+            t = achlog_block_cur(desc)->time + ACHLOG_BLOCK_FLUSH_NS;
+        }
+    }
+    if( desc->buf ) {
+        uint64_t b = desc->buf->time + ACHLOG_BUF_FLUSH_NS;
+        if( 0 == t || b < t ) t = b;
+    }
+    if( opt_rotate ) {
+        /* notice SIGHUP and due rotations on idle channels */
+        uint64_t r = now_ns() + ACHLOG_ROTATE_POLL_NS;
+        if( 0 == t || r < t ) t = r;
+    }
+    return t;
+}
+
+/* Write out data that has waited long enough */
+static int log_tick( struct achlog_desc *desc, uint64_t now ) {
+    if( log_rotate( desc, now ) ) return -1;
+    if( opt_lz ) {
+        struct achlog_block *b = achlog_block_cur( desc );
+        if( b->frames && now - b->time >= ACHLOG_BLOCK_FLUSH_NS &&
+            achlog_block_submit( desc ) )
+        {
+            return -1;
+        }
+        if( achlog_block_write( desc, 0 ) ) return -1;
+    }
+    if( desc->buf && now - desc->buf->time >= ACHLOG_BUF_FLUSH_NS ) {
+        return achlog_flush( desc );
+    }
+    return 0;
+}
+
+/* Write out everything */
+static void log_finish( struct achlog_desc *desc ) {
+    if( opt_lz && 0 == achlog_block_submit( desc ) ) {
+        achlog_block_write( desc, ACHLOG_BLOCK_RING );
+    }
+    achlog_flush( desc );
+    achlog_block_free( desc );
+}
+
+/* Log one channel in its own thread */
+static void *worker( void *arg ) {
+    struct achlog_desc *desc = (struct achlog_desc*)arg;
+
+    /* Each frame is written as a record header followed by its data */
+    size_t max = 512;
+    ach_log_rec_t *rec = (ach_log_rec_t*)malloc( sizeof(*rec) + max );
+
+    /* get frames */
+    int canceled = log_header( desc );
+    while( ! canceled ) {
+        struct timespec deadline, *abstime = NULL;
+        uint64_t t = log_deadline( desc );
+        if( t ) {
+            deadline.tv_sec = (time_t)(t / 1000000000);
+            deadline.tv_nsec = (long)(t % 1000000000);
+            abstime = &deadline;
+        }
+
+        /* push the data */
+        size_t frame_size;
+        ach_status_t r = ach_get( &desc->chan, rec+1, max, &frame_size, abstime,
+                                  ACH_O_WAIT | ((opt_last ) ? ACH_O_LAST : 0) );
+        uint64_t time = now_ns();
+        switch(r) {
+        case ACH_OVERFLOW:
+            /* enlarge buffer and retry on overflow */
+            assert(frame_size > max );
+            max = frame_size;
+            free(rec);
+            rec = (ach_log_rec_t*)malloc( sizeof(*rec) + max );
+            continue;
+        case ACH_TIMEOUT:
+            canceled = log_tick( desc, time );
+            break;
+        case ACH_MISSED_FRAME:
+        case ACH_OK:
+            canceled = log_got( desc, r, rec, frame_size, time );
+            break;
+        case ACH_CANCELED:
+            canceled = 1;
+            break;
+        default:
+            ACH_LOG( LOG_ERR, "Could not get frame from %s: %s\n",
+                     desc->name, strerror(errno) );
+            canceled = 1;
+            break;
+        }
+    }
+
+    log_finish( desc );
+    free(rec);
+    return arg;
+}
+
+/* Log many channels in one thread, polling them from ach_evhandle() */
+struct ev_thread;
+
+struct ev_chan {
+    struct ev_thread *thread;
+    struct achlog_desc *desc;
+    int failed;
+};
+
+struct ev_thread {
+    size_t n;
+    struct ev_chan *chans;
+    struct ach_evhandler *handlers;
+    ach_log_rec_t *rec;     /* frame buffer shared by the channels */
+    size_t max;
+};
+
+static volatile sig_atomic_t ev_stop = 0;
+
+/* Drain all new frames from a channel */
+static enum ach_status ev_handler( void *context, struct ach_channel *channel ) {
+    struct ev_chan *c = (struct ev_chan*)context;
+    struct ev_thread *t = c->thread;
+    enum ach_status result = ACH_STALE_FRAMES;
+    if( c->failed ) return result;
+    for(;;) {
+        size_t frame_size;
+        enum ach_status r = ach_get( channel, t->rec+1, t->max, &frame_size, NULL,
+                                     opt_last ? ACH_O_LAST : 0 );
+        switch(r) {
+        case ACH_OVERFLOW:
+            free( t->rec );
+            t->max = frame_size;
+            t->rec = (ach_log_rec_t*)malloc( sizeof(*t->rec) + t->max );
+            continue;
+        case ACH_MISSED_FRAME:
+        case ACH_OK:
+            result = ACH_OK;
+            if( log_got( c->desc, r, t->rec, frame_size, now_ns() ) ) {
+                c->failed = 1;
+                return result;
+            }
+            if( opt_last ) return result;
+            break;
+        case ACH_STALE_FRAMES:
+            return result;
+        default:
+            ACH_LOG( LOG_ERR, "Could not get frame from %s: %s\n",
+                     c->desc->name, ach_result_to_string(r) );
+            c->failed = 1;
+            return result;
+        }
+    }
+}
+
+static enum ach_status ev_periodic( void *context ) {
+    struct ev_thread *t = (struct ev_thread*)context;
+    if( ev_stop ) return ACH_CANCELED;
+    uint64_t now = now_ns();
+    size_t i;
+    for( i = 0; i < t->n; i ++ ) {
+        if( !t->chans[i].failed && log_tick( t->chans[i].desc, now ) ) {
+            t->chans[i].failed = 1;
+        }
+    }
+    return ACH_OK;
+}
+
+static void *ev_worker( void *arg ) {
+    struct ev_thread *t = (struct ev_thread*)arg;
+    size_t i;
+    for( i = 0; i < t->n; i ++ ) {
+        t->chans[i].failed = log_header( t->chans[i].desc );
+    }
+
+    struct timespec period = { .tv_sec = 0, .tv_nsec = ACHLOG_EV_PERIOD_NS };
+    enum ach_status r = ach_evhandle( t->handlers, t->n, &period,
+                                      ev_periodic, t, ACH_EV_O_PERIODIC_TIMEOUT );
+    if( ACH_CANCELED != r ) {
+        ACH_LOG( LOG_ERR, "Event loop failed: %s\n", ach_result_to_string(r) );
+    }
+
+    for( i = 0; i < t->n; i ++ ) {
+        log_finish( t->chans[i].desc );
+    }
+    return arg;
+}
+
+struct achlog_file *achlog_segment_open( struct achlog_desc *desc, unsigned segment ) {
+    struct achlog_file *f = (struct achlog_file*)calloc( 1, sizeof(*f) );
+    size_t n = strlen(desc->name) + 16;
+    f->desc = desc;
+    f->tail_fd = -1;
+    f->path = (char*)malloc( n );
+    if( opt_rotate ) snprintf( f->path, n, "%s.%04u", desc->name, segment );
+    else strcpy( f->path, desc->name );
+
+    if( opt_gzip ) {
+        f->fout = filter( "gzip -c", f->path, ".gz" );
+        f->pipe = 1;
+    } else if( opt_direct ) {
+        int fd = open( f->path, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0666 );
+        /* for the partial block at the end of each write */
+        f->tail_fd = (fd < 0) ? -1 : open( f->path, O_WRONLY );
+        if( f->tail_fd >= 0 ) {
+            f->fout = fdopen( fd, "w" );
+        } else if( fd >= 0 ) {
+            int e = errno;
+            close( fd );
+            errno = e;
+        }
+    } else {
+        f->fout = fopen( f->path, "w" );
+    }
+    if( NULL == f->fout ) {
+        ACH_LOG( LOG_ERR, "Could not open log file %s: %s\n",
+                 f->path, strerror(errno) );
+        if( f->tail_fd >= 0 ) close( f->tail_fd );
+        free( f->path );
+        free( f );
+        return NULL;
+    }
+    f->fd = fileno( f->fout );
+
+    /* Index uncompressed logs, since offsets into a gzip stream are
+     * no help for seeking */
+    if( ! opt_gzip ) {
+        char buf[n + sizeof(".idx")];
+        strcpy(buf, f->path);
+        strcat(buf, ".idx");
+        f->fidx = fopen(buf, "w");
+        if( NULL == f->fidx ) {
+            ACH_LOG( LOG_ERR, "Could not open index file %s: %s\n",
+                     buf, strerror(errno) );
+            fclose( f->fout );
+            if( f->tail_fd >= 0 ) close( f->tail_fd );
+            free( f->path );
+            free( f );
+            return NULL;
+        }
+    }
+    achlog_writer_open( f );
+    return f;
+}
+
+/* Parse a byte count with an optional k, M, or G suffix */
+static uint64_t parse_size( const char *arg ) {
+    char *end;
+    uint64_t n = strtoull( arg, &end, 10 );
+    switch( *end ) {
+    case 'G': case 'g': n *= 1024;  /* fall through */
+    case 'M': case 'm': n *= 1024;  /* fall through */
+    case 'K': case 'k': n *= 1024;
+    }
+    return n;
+}
+
+static void posarg( char *arg ) {
+    log_desc = (struct achlog_desc*)realloc( log_desc, (1+n_log)*sizeof(log_desc[0]) );
+    memset( log_desc + n_log, 0, sizeof(log_desc[0]) );
+    log_desc[n_log++].name = arg;
+}
+
+int main( int argc, char **argv ) {
+    /* Check if we're running under achcop */
+    if( getenv("ACHCOP") ) {
+        ach_pid_notify = getppid();
+    }
+
+    int c;
+    while( (c = getopt( argc, argv, "zgL:j:e:b:DS:r:R:sli:t:nh?V")) != -1 ) {
+        switch(c) {
+        case 'v':
+            ach_verbosity ++;
+            break;
+        case 'l':
+            opt_last = 1;
+            break;
+        case 'n':
+            opt_last = 0;
+            break;
+        case 'z':
+            opt_lz = 1;
+            break;
+        case 'g':
+            opt_gzip = 1;
+            break;
+        case 'L':
+            opt_level = atoi(optarg);
+            break;
+        case 'j':
+            opt_threads = atol(optarg);
+            break;
+        case 'e':
+            opt_ev_threads = atol(optarg);
+            break;
+        case 'b':
+            /* whole blocks, for O_DIRECT */
+            opt_buf_size = (size_t)parse_size(optarg);
+            opt_buf_size = (opt_buf_size + ACHLOG_ALIGN - 1) & ~(size_t)(ACHLOG_ALIGN - 1);
+            if( 0 == opt_buf_size ) opt_buf_size = ACHLOG_ALIGN;
+            break;
+        case 'D':
+            opt_direct = 1;
+            break;
+        case 'S':
+            opt_sync = atof(optarg);
+            break;
+        case 'r':
+            opt_rotate = 1;
+            opt_rotate_size = parse_size(optarg);
+            break;
+        case 'R':
+            opt_rotate = 1;
+            opt_rotate_time = atof(optarg);
+            break;
+        case 's':
+            opt_rotate = 1;
+            break;
+        case 'i':
+            opt_idx_frames = strtoull(optarg, NULL, 10);
+            break;
+        case 't':
+            opt_idx_time = atof(optarg);
+            break;
+        /* case 'f': */
+        /*     opt_freq = atof(optarg); */
+        /*     break; */
+        case 'V':   /* version     */
+            ach_print_version("achpipe.bin");
+            exit(EXIT_SUCCESS);
+        case '?':
+        case 'h':
+        case 'H':
+            puts( "Usage: achlog [OPTIONS] channels...\n"
+                  "Log ach channels to files"
+                  "\n"
+                  "Options:\n"
+                  "  -?,                  Show help\n"
+                  "  -z,                  Compress output in blocks\n"
+                  "  -L LEVEL,            Compression level, 1 (fastest) to 9 (default 3)\n"
+                  "  -j THREADS,          Compression threads (default one per CPU)\n"
+                  "  -g,                  Filter output through gzip\n"
+                  "  -e THREADS,          Poll channels from THREADS threads instead of\n"
+                  "                       one thread per channel\n"
+                  "  -b BYTES,            Size of output buffers (default 65536)\n"
+                  "  -D,                  Write with O_DIRECT, bypassing the page cache\n"
+                  "  -S SECONDS,          Sync logs to disk at least every SECONDS seconds\n"
+                  "  -s,                  Log to numbered segments, starting a new one on SIGHUP\n"
+                  "  -r BYTES,            Start a new segment after BYTES bytes (implies -s)\n"
+                  "  -R SECONDS,          Start a new segment after SECONDS seconds (implies -s)\n"
+                  "  -i FRAMES,           Index at least every FRAMES frames (default 1024)\n"
+                  "  -t SECONDS,          Index at least every SECONDS seconds (default 1)\n"
+                  "\n"
+                  "Examples:\n"
+                  "  achlog foo bar       Log channels foo and bar\n"
+                  "  achlog -R 600 foo    Log foo to foo.0000, foo.0001, ..., ten minutes each\n"
+                  "\n"
+                  "Report bugs to " PACKAGE_BUGREPORT "\n"
+                );
+            exit(EXIT_SUCCESS);
+        default:
+            posarg(optarg);
+        }
+    }
+    while( optind < argc ) {
+        posarg(argv[optind++]);
+    }
+    if( 0 == n_log ) ACH_DIE("No channels to log\n");
+    if( opt_lz && opt_gzip ) ACH_DIE("Cannot use both -z and -g\n");
+    if( opt_direct && opt_gzip ) ACH_DIE("Cannot use both -D and -g\n");
+    if( opt_rotate && opt_gzip ) ACH_DIE("Cannot rotate gzip output, use -z\n");
+
+    /* Block Signals */
+    /* Have to block these before forking so ctrl-C doesn't kill the
+     * gzip */
+    int sigs[] = {SIGTERM, SIGINT, 0, 0};
+    if( opt_rotate ) sigs[2] = SIGHUP;
+    ach_sig_block_dummy( sigs );
+
+    /* Open Channels */
+    size_t i;
+    for( i = 0; i < n_log; i ++ ) {
+        ach_status_t r = ach_open(&log_desc[i].chan, log_desc[i].name, NULL);
+        if( ACH_OK != r ) {
+            ACH_DIE( "Could not open channel %s: %s\n",
+                     log_desc[i].name, ach_result_to_string(r) );
+        }
+        /* Open log file */
+        log_desc[i].file = achlog_segment_open( log_desc + i, 0 );
+        if( NULL == log_desc[i].file ) {
+            ACH_DIE( "Could not open log for %s\n", log_desc[i].name );
+        }
+    }
+
+    /* get some data */
+    if( clock_gettime(ACH_DEFAULT_CLOCK, &now_ach ) ||
+        clock_gettime(CLOCK_REALTIME,    &now_real ) )
+    {
+        ACH_DIE( "Could not get time: %s\n", strerror(errno) );
+    }
+    if( gethostname( host, sizeof(host) ) ) {
+        ACH_LOG(LOG_ERR, "Could not get host name: %s\n", strerror(errno));
+    }
+    host[sizeof(host)-1] = '\0';
+    passwd = getpwuid(getuid());
+    if( passwd ) {
+        strtok(passwd->pw_gecos, ",");
+    }
+    now_real_str = ctime( &now_real.tv_sec );
+
+    /* Create writer and compression threads, left to exit with the
+     * process */
+    achlog_writer_start();
+    if( opt_rotate ) {
+        for( i = 0; i < n_log; i ++ ) achlog_writer_prepare( log_desc + i );
+    }
+    if( opt_lz ) {
+        if( opt_threads < 0 ) opt_threads = sysconf( _SC_NPROCESSORS_ONLN );
+        achlog_block_start( opt_threads );
+    }
+
+    /* Create Workers */
+    size_t n_thread = n_log;
+    struct ev_thread *ev = NULL;
+    if( opt_ev_threads > 0 ) {
+        /* Deal the channels out to the event threads */
+        n_thread = (size_t)opt_ev_threads < n_log ? (size_t)opt_ev_threads : n_log;
+        ev = (struct ev_thread*)calloc( n_thread, sizeof(ev[0]) );
+        for( i = 0; i < n_thread; i ++ ) {
+            ev[i].chans = (struct ev_chan*)calloc( n_log / n_thread + 1, sizeof(struct ev_chan) );
+            ev[i].handlers = (struct ach_evhandler*)calloc( n_log / n_thread + 1,
+                                                            sizeof(struct ach_evhandler) );
+            ev[i].max = 512;
+            ev[i].rec = (ach_log_rec_t*)malloc( sizeof(ach_log_rec_t) + ev[i].max );
+        }
+        for( i = 0; i < n_log; i ++ ) {
+            struct ev_thread *t = ev + i % n_thread;
+            struct ev_chan *c = t->chans + t->n;
+            c->thread = t;
+            c->desc = log_desc + i;
+            t->handlers[t->n].channel = &log_desc[i].chan;
+            t->handlers[t->n].context = c;
+            t->handlers[t->n].handler = ev_handler;
+            t->n++;
+        }
+    }
+    pthread_t thread[n_thread];
+    for( i = 0; i < n_thread; i ++ ) {
+        int r = ev ?
+            pthread_create( thread+i, NULL, ev_worker, (void*)(ev+i) ) :
+            pthread_create( thread+i, NULL, worker, (void*)(log_desc+i) );
+        if( r ) ACH_DIE( "Couldn't start worker thread: %s\n", strerror(r) );
+    }
+    ach_notify(ACH_SIG_OK);
+
+    /* Wait for Signal */
+    while( SIGHUP == ach_sig_wait( sigs ) ) {
+        rotate_gen++;
+    }
+
+    /* Cancel workers */
+    if( ev ) {
+        ev_stop = 1;
+    } else {
+        ach_cancel_attr_t cattr;
+        ach_cancel_attr_init( &cattr );
+        cattr.async_unsafe = 1;
+        for( i = 0; i < n_log; i ++ ) {
+            enum ach_status r = ach_cancel( &log_desc[i].chan, &cattr );
+            if( ACH_OK != r ) {
+                fprintf(stderr, "Ach cancel failed\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+
+    /* Join worker threads */
+    for( i = 0; i < n_thread; i ++ ) {
+        int r = pthread_join( thread[i], NULL );
+        if( r ) ACH_DIE( "Couldn't join worker thread: %s\n", strerror(r) );
+    }
+    achlog_writer_drain();
+
+    /* Close files, removing the unused next segments */
+    for( i = 0; i < n_log; i ++ ) {
+        achlog_writer_close( log_desc[i].file );
+        struct achlog_file *next = log_desc[i].next;
+        if( next ) {
+            size_t n = strlen(next->path) + sizeof(".idx");
+            char buf[n];
+            strcpy(buf, next->path);
+            strcat(buf, ".idx");
+            if( unlink(next->path) || unlink(buf) ) {
+                ACH_LOG( LOG_WARNING, "Could not remove unused segment %s: %s\n",
+                         next->path, strerror(errno) );
+            }
+            achlog_writer_close( next );
+        }
+    }
+
+    return 0;
+}
+
+static FILE *filter( const char *program, const char *channel, const char *suffix ) {
+    size_t n = strlen(channel) + strlen(suffix) + 1;
+    char buf[n];
+    strcpy(buf, channel);
+    strcat(buf, suffix);
+    FILE *fout = fopen( buf, "w");
+    if( NULL == fout ) {
+        ACH_DIE( "Could not open log file %s: %s\n",
+                 buf, strerror(errno) );
+    }
+    int oldout = dup(STDOUT_FILENO);
+    if( oldout < 0 )  {
+        ACH_DIE( "Could not dup stdout: %s\n", strerror(errno) );
+    }
+    if( dup2(fileno(fout), STDOUT_FILENO) < 0 ) {
+        ACH_DIE( "Could not dup output: %s\n", strerror(errno) );
+    }
+    FILE *f = popen(program, "w");
+    if( NULL == f ) {
+        ACH_DIE( "Could not popen `%s': %s\n", program, strerror(errno) );
+    }
+    if( dup2(oldout, STDOUT_FILENO) < 0 ) {
+        ACH_DIE( "Could not dup stdout back: %s\n", strerror(errno) );
+    }
+    if( close(oldout) ) {
+        ACH_LOG( LOG_WARNING, "Could not close dup'ed stdout: %s\n", strerror(errno) );
+    }
+    if( fclose(fout) )  {
+        ACH_LOG( LOG_WARNING, "Could not close dup'ed output file: %s\n", strerror(errno) );
+    }
+
+    return f;
+}
@@ -0,0 +1,181 @@
+/*
+ * Copyright (c) 2015, Rice University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *     * Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials
+ *       provided with the distribution.
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written
+ *       permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Compression of achlog records in blocks on a shared thread pool.
+ *
+ * Each channel fills one block at a time from a small ring.  Filled
+ * blocks are queued for the pool, and the channel's logger writes
+ * finished blocks from the head of its ring, so blocks are written in
+ * the order they were filled.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <syslog.h>
+#include "ach.h"
+#include "achutil.h"
+#include "achlog.h"
+
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;  /* queued */
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;  /* compressed */
+static struct achlog_block *pool_head = NULL, *pool_tail = NULL;
+static long pool_threads = 0;
+
+static void compress( struct achlog_block *b ) {
+    size_t bound = sizeof(ach_log_rec_t) + 8 + ach_lz_bound(b->raw_len);
+    if( bound > b->out_max ) {
+        free( b->out );
+        b->out_max = bound;
+        b->out = (uint8_t*)malloc( bound );
+    }
+    uint8_t *p = b->out + sizeof(ach_log_rec_t);
+    size_t i;
+    for( i = 0; i < 8; i ++ )
+        p[i] = (uint8_t)(b->raw_len >> (8 * i));
+    size_t n = ach_lz_compress_level( b->raw, b->raw_len, p + 8,
+                                      b->out_max - sizeof(ach_log_rec_t) - 8,
+                                      opt_level );
+    ach_log_rec_set( (ach_log_rec_t*)b->out, ACH_LOG_REC_BLOCK,
+                     b->seq, b->time, 8 + n );
+    b->out_len = sizeof(ach_log_rec_t) + 8 + n;
+}
+
+static void *compressor( void *arg ) {
+    (void)arg;
+    pthread_mutex_lock( &pool_mutex );
+    for(;;) {
+        while( NULL == pool_head ) {
+            pthread_cond_wait( &pool_cond, &pool_mutex );
+        }
+        struct achlog_block *b = pool_head;
+        pool_head = b->next;
+        if( NULL == pool_head ) pool_tail = NULL;
+        pthread_mutex_unlock( &pool_mutex );
+
+        compress( b );
+
+        pthread_mutex_lock( &pool_mutex );
+        b->state = ACHLOG_BLOCK_DONE;
+        pthread_cond_broadcast( &done_cond );
+    }
+    return NULL;
+}
+
+void achlog_block_start( long n ) {
+    long j;
+    pool_threads = n;
+    for( j = 0; j < n; j ++ ) {
+        pthread_t t;
+        int r = pthread_create( &t, NULL, compressor, NULL );
+        if( r ) ACH_DIE( "Couldn't start compression thread: %s\n", strerror(r) );
+        pthread_detach( t );
+    }
+}
+
+struct achlog_block *achlog_block_cur( struct achlog_desc *desc ) {
+    return desc->ring + (desc->ring_head + desc->n_flight) % ACHLOG_BLOCK_RING;
+}
+
+int achlog_block_write( struct achlog_desc *desc, size_t wait ) {
+    while( desc->n_flight ) {
+        struct achlog_block *b = desc->ring + desc->ring_head;
+        pthread_mutex_lock( &pool_mutex );
+        while( wait && ACHLOG_BLOCK_DONE != b->state ) {
+            pthread_cond_wait( &done_cond, &pool_mutex );
+        }
+        enum achlog_block_state state = b->state;
+        pthread_mutex_unlock( &pool_mutex );
+        if( ACHLOG_BLOCK_DONE != state ) break;
+
+        uint64_t offset = desc->offset;
+        if( achlog_write_rec( desc, (ach_log_rec_t*)b->out, b->out_len ) ) return -1;
+        achlog_write_idx( desc, b->time, b->seq, offset, b->frames );
+        b->state = ACHLOG_BLOCK_FREE;
+        b->raw_len = 0;
+        b->frames = 0;
+        desc->ring_head = (desc->ring_head + 1) % ACHLOG_BLOCK_RING;
+        desc->n_flight--;
+        if( wait ) wait--;
+    }
+    return 0;
+}
+
+int achlog_block_submit( struct achlog_desc *desc ) {
+    struct achlog_block *b = achlog_block_cur( desc );
+    if( 0 == b->raw_len ) return 0;
+    desc->n_flight++;
+    if( 0 == pool_threads ) {
+        compress( b );
+        b->state = ACHLOG_BLOCK_DONE;
+    } else {
+        pthread_mutex_lock( &pool_mutex );
+        b->state = ACHLOG_BLOCK_QUEUED;
+        b->next = NULL;
+        if( pool_tail ) pool_tail->next = b;
+        else pool_head = b;
+        pool_tail = b;
+        pthread_cond_signal( &pool_cond );
+        pthread_mutex_unlock( &pool_mutex );
+    }
+    /* The next block to fill must be free */
+    return achlog_block_write( desc, ACHLOG_BLOCK_RING == desc->n_flight ? 1 : 0 );
+}
+
+void achlog_block_append( struct achlog_block *b, const void *p, size_t n ) {
+    if( b->raw_len + n > b->raw_max ) {
+        b->raw_max = b->raw_len + n > ACHLOG_BLOCK_SIZE ? b->raw_len + n : ACHLOG_BLOCK_SIZE;
+        b->raw = (uint8_t*)realloc( b->raw, b->raw_max );
+    }
+    memcpy( b->raw + b->raw_len, p, n );
+    b->raw_len += n;
+}
+
+void achlog_block_free( struct achlog_desc *desc ) {
+    size_t i;
+    for( i = 0; i < ACHLOG_BLOCK_RING; i ++ ) {
+        free( desc->ring[i].raw );
+        free( desc->ring[i].out );
+        desc->ring[i].raw = desc->ring[i].out = NULL;
+        desc->ring[i].raw_max = desc->ring[i].out_max = 0;
+    }
+}
@@ -0,0 +1,399 @@
+/*
+ * Copyright (c) 2015, Rice University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *     * Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials
+ *       provided with the distribution.
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written
+ *       permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Output for achlog.
+ *
+ * Loggers copy records into aligned buffers from a shared pool, and a
+ * single writer thread writes filled buffers to the log files in the
+ * order they were queued.  Loggers only wait when too many buffers
+ * are queued, so slow disks delay capture only after
+ * ACHLOG_BUF_QUEUE buffers have backed up.
+ *
+ * The writer preallocates file space ahead of the data, in chunks
+ * that double up to ACHLOG_PREALLOC_MAX, so that the file system
+ * can lay out the log contiguously.  With O_DIRECT, each write must
+ * cover whole blocks.  The data past the last whole block is written
+ * as is through file->tail_fd, which is opened without O_DIRECT, and
+ * also kept in file->tail to rewrite with the next buffer, so the
+ * file never holds more than the records written so far.  Unused
+ * preallocated space is trimmed on close.
+ *
+ * When logs are rotated, the writer also opens each channel's next
+ * segment ahead of time and closes old segments after their last
+ * buffer, so loggers never wait on open, preallocation, or close.
+ */
+
+#define _GNU_SOURCE
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "ach.h"
+#include "achutil.h"
+#include "achlog.h"
+
+static pthread_mutex_t wr_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;    /* buffer queued */
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;     /* buffer written */
+static struct achlog_buf *free_list = NULL;
+static struct achlog_buf *queue_head = NULL, *queue_tail = NULL;
+static size_t n_queued = 0;     /* queued or being written */
+
+static uint64_t now_ns( void ) {
+    struct timespec t;
+    clock_gettime( ACH_DEFAULT_CLOCK, &t );
+    return (uint64_t)t.tv_sec * 1000000000 + (uint64_t)t.tv_nsec;
+}
+
+static int write_all( struct achlog_file *f, int fd,
+                      const uint8_t *p, size_t n, uint64_t off )
+{
+    while( n ) {
+        ssize_t r = f->regular ?
+            pwrite( fd, p, n, (off_t)off ) :
+            write( fd, p, n );
+        if( r < 0 ) {
+            if( EINTR == errno ) continue;
+            ACH_LOG( LOG_ERR, "Could not write log %s: %s\n",
+                     f->path, strerror(errno) );
+            return errno;
+        }
+        p += r;
+        n -= (size_t)r;
+        off += (uint64_t)r;
+    }
+    return 0;
+}
+
+/* Preallocate space through offset end */
+static void prealloc( struct achlog_file *f, uint64_t end ) {
+    if( f->alloc_end >= end ) return;
+    if( 0 == f->alloc_size ) f->alloc_size = ACHLOG_PREALLOC_MIN;
+    uint64_t len = end - f->alloc_end;
+    if( len < f->alloc_size ) len = f->alloc_size;
+    if( fallocate( f->fd, FALLOC_FL_KEEP_SIZE, (off_t)f->alloc_end, (off_t)len ) ) {
+        ACH_LOG( LOG_DEBUG, "Not preallocating %s: %s\n", f->path, strerror(errno) );
+        f->alloc_end = UINT64_MAX;
+        return;
+    }
+    f->alloc_end += len;
+    if( f->alloc_size < ACHLOG_PREALLOC_MAX ) f->alloc_size *= 2;
+}
+
+/* Push written data to disk as the sync policy asks */
+static int sync_policy( struct achlog_file *f, uint64_t off, uint64_t len ) {
+    if( opt_sync < 0 || !f->regular ) return 0;
+    /* Start writeback now rather than in bursts later */
+    if( !opt_direct ) {
+        sync_file_range( f->fd, (off_t)off, (off_t)len, SYNC_FILE_RANGE_WRITE );
+    }
+    uint64_t now = now_ns();
+    if( now - f->sync_time >= (uint64_t)(opt_sync * 1e9) ) {
+        if( fdatasync( f->fd ) ) {
+            ACH_LOG( LOG_ERR, "Could not sync log %s: %s\n",
+                     f->path, strerror(errno) );
+            return errno;
+        }
+        /* Synced data won't be read back, keep it out of the cache,
+         * except for the last page, which the next write fills */
+        uint64_t end = (off + len) & ~(uint64_t)(ACHLOG_ALIGN - 1);
+        if( !opt_direct && end > f->sync_off ) {
+            posix_fadvise( f->fd, (off_t)f->sync_off, (off_t)(end - f->sync_off),
+                           POSIX_FADV_DONTNEED );
+            f->sync_off = end;
+        }
+        f->sync_time = now;
+    }
+    return 0;
+}
+
+static int write_buf( struct achlog_buf *b ) {
+    struct achlog_file *f = b->file;
+    if( !f->regular ) {
+        int r = write_all( f, f->fd, b->data, b->len, 0 );
+        if( !r ) f->file_off += b->len;
+        return r;
+    }
+
+    if( !opt_direct ) {
+        prealloc( f, f->file_off + b->len );
+        int r = write_all( f, f->fd, b->data, b->len, f->file_off );
+        if( r ) return r;
+        f->file_off += b->len;
+        return sync_policy( f, f->file_off - b->len, b->len );
+    }
+
+    /* Prepend the partial block from last time, so the write starts
+     * on a block boundary */
+    size_t t = f->tail_len;
+    if( t ) {
+        memmove( b->data + t, b->data, b->len );
+        memcpy( b->data, f->tail, t );
+    }
+    uint64_t base = f->file_off - t;
+    size_t total = t + b->len;
+    size_t whole = total & ~(size_t)(ACHLOG_ALIGN - 1);
+    prealloc( f, base + total );
+    int r = write_all( f, f->fd, b->data, whole, base );
+    if( r ) return r;
+    /* Padding the partial block would show readers zeros past the
+     * last record, so write exactly what is there */
+    f->tail_len = total - whole;
+    r = write_all( f, f->tail_fd, b->data + whole, f->tail_len, base + whole );
+    if( r ) return r;
+    memcpy( f->tail, b->data + whole, f->tail_len );
+    f->file_off = base + total;
+    return sync_policy( f, base, total );
+}
+
+/* Open the segment after the current one of desc */
+static struct achlog_file *open_next( struct achlog_desc *desc ) {
+    struct achlog_file *f = achlog_segment_open( desc, desc->segment + 1 );
+    if( f && f->regular ) {
+        /* Reserve room for the whole segment, if we know its size */
+        uint64_t n = opt_rotate_size;
+        if( n < ACHLOG_PREALLOC_MIN ) n = ACHLOG_PREALLOC_MIN;
+        if( n > ACHLOG_PREALLOC_MAX ) n = ACHLOG_PREALLOC_MAX;
+        prealloc( f, n );
+    }
+    return f;
+}
+
+static void *writer( void *arg ) {
+    (void)arg;
+    pthread_mutex_lock( &wr_mutex );
+    for(;;) {
+        while( NULL == queue_head ) {
+            pthread_cond_wait( &queue_cond, &wr_mutex );
+        }
+        struct achlog_buf *b = queue_head;
+        queue_head = b->next;
+        if( NULL == queue_head ) queue_tail = NULL;
+        int error = b->desc->error;
+        pthread_mutex_unlock( &wr_mutex );
+
+        struct achlog_file *next = NULL;
+        switch( b->op ) {
+        case ACHLOG_BUF_WRITE:
+            if( !error ) error = write_buf( b );
+            break;
+        case ACHLOG_BUF_OPEN:
+            /* failures are reported when the segment is needed */
+            next = open_next( b->desc );
+            error = 0;
+            break;
+        case ACHLOG_BUF_CLOSE:
+            achlog_writer_close( b->file );
+            error = 0;
+            break;
+        }
+
+        pthread_mutex_lock( &wr_mutex );
+        if( error ) b->desc->error = error;
+        if( ACHLOG_BUF_OPEN == b->op ) {
+            b->desc->next = next;
+            b->desc->next_ready = 1;
+        }
+        b->next = free_list;
+        free_list = b;
+        n_queued--;
+        pthread_cond_broadcast( &done_cond );
+    }
+    return NULL;
+}
+
+void achlog_writer_start( void ) {
+    pthread_t t;
+    int r = pthread_create( &t, NULL, writer, NULL );
+    if( r ) ACH_DIE( "Couldn't start writer thread: %s\n", strerror(r) );
+    pthread_detach( t );
+}
+
+static struct achlog_buf *buf_get( void ) {
+    pthread_mutex_lock( &wr_mutex );
+    while( n_queued >= ACHLOG_BUF_QUEUE ) {
+        pthread_cond_wait( &done_cond, &wr_mutex );
+    }
+    struct achlog_buf *b = free_list;
+    if( b ) free_list = b->next;
+    pthread_mutex_unlock( &wr_mutex );
+
+    if( NULL == b ) {
+        /* room to prepend an O_DIRECT partial block */
+        void *data = NULL;
+        b = (struct achlog_buf*)malloc( sizeof(*b) );
+        if( NULL == b ||
+            posix_memalign( &data, ACHLOG_ALIGN, opt_buf_size + ACHLOG_ALIGN ) )
+        {
+            ACH_DIE( "Could not allocate output buffer\n" );
+        }
+        b->data = (uint8_t*)data;
+    }
+    b->len = 0;
+    return b;
+}
+
+/* Queue b for the writer, returning the channel's write error */
+static int queue( struct achlog_buf *b, enum achlog_buf_op op,
+                  struct achlog_desc *desc, struct achlog_file *file )
+{
+    pthread_mutex_lock( &wr_mutex );
+    int error = desc->error;
+    if( b ) {
+        b->op = op;
+        b->desc = desc;
+        b->file = file;
+        b->next = NULL;
+        if( queue_tail ) queue_tail->next = b;
+        else queue_head = b;
+        queue_tail = b;
+        n_queued++;
+        pthread_cond_signal( &queue_cond );
+    }
+    pthread_mutex_unlock( &wr_mutex );
+    return error;
+}
+
+int achlog_write( struct achlog_desc *desc, const void *p, size_t n, uint64_t now ) {
+    const uint8_t *src = (const uint8_t*)p;
+    while( n ) {
+        if( NULL == desc->buf ) {
+            desc->buf = buf_get();
+            desc->buf->time = now;
+        }
+        struct achlog_buf *b = desc->buf;
+        size_t k = opt_buf_size - b->len;
+        if( k > n ) k = n;
+        memcpy( b->data + b->len, src, k );
+        b->len += k;
+        src += k;
+        n -= k;
+        if( opt_buf_size == b->len && achlog_flush(desc) ) return -1;
+    }
+    return 0;
+}
+
+int achlog_flush( struct achlog_desc *desc ) {
+    struct achlog_buf *b = desc->buf;
+    desc->buf = NULL;
+    return queue( b, ACHLOG_BUF_WRITE, desc, desc->file ) ? -1 : 0;
+}
+
+void achlog_writer_drain( void ) {
+    pthread_mutex_lock( &wr_mutex );
+    while( n_queued ) {
+        pthread_cond_wait( &done_cond, &wr_mutex );
+    }
+    pthread_mutex_unlock( &wr_mutex );
+}
+
+void achlog_writer_prepare( struct achlog_desc *desc ) {
+    desc->next = NULL;
+    desc->next_ready = 0;
+    queue( buf_get(), ACHLOG_BUF_OPEN, desc, NULL );
+}
+
+int achlog_writer_rotate( struct achlog_desc *desc ) {
+    if( achlog_flush( desc ) ) return -1;
+
+    /* Only waits if the last rotation was very recent */
+    pthread_mutex_lock( &wr_mutex );
+    while( !desc->next_ready ) {
+        pthread_cond_wait( &done_cond, &wr_mutex );
+    }
+    struct achlog_file *next = desc->next;
+    pthread_mutex_unlock( &wr_mutex );
+    if( NULL == next ) {
+        ACH_LOG( LOG_ERR, "Could not rotate log for %s\n", desc->name );
+        return -1;
+    }
+
+    queue( buf_get(), ACHLOG_BUF_CLOSE, desc, desc->file );
+    desc->file = next;
+    desc->segment++;
+    achlog_writer_prepare( desc );
+    return 0;
+}
+
+void achlog_writer_open( struct achlog_file *f ) {
+    struct stat st;
+    f->regular = ( 0 == fstat(f->fd, &st) && S_ISREG(st.st_mode) );
+    if( opt_direct ) {
+        f->tail = (uint8_t*)malloc( ACHLOG_ALIGN );
+    }
+    f->sync_time = now_ns();
+}
+
+void achlog_writer_close( struct achlog_file *f ) {
+    if( f->regular ) {
+        if( opt_sync >= 0 && fdatasync( f->fd ) ) {
+            ACH_LOG( LOG_ERR, "Could not sync log %s: %s\n",
+                     f->path, strerror(errno) );
+        }
+        /* drop unused preallocated space */
+        if( f->alloc_end > f->file_off &&
+            ftruncate( f->fd, (off_t)f->file_off ) )
+        {
+            ACH_LOG( LOG_ERR, "Could not truncate log %s: %s\n",
+                     f->path, strerror(errno) );
+        }
+    }
+    if( f->pipe ) {
+        if( pclose(f->fout) < 0 ) {
+            ACH_LOG( LOG_ERR, "Could not pclose output for %s: %s\n",
+                     f->path, strerror(errno) );
+        }
+    } else {
+        fclose( f->fout );
+    }
+    if( f->fidx ) {
+        fclose( f->fidx );
+    }
+    if( f->tail_fd >= 0 ) {
+        close( f->tail_fd );
+    }
+    free( f->tail );
+    free( f->path );
+    free( f );
+}
@@ -0,0 +1,337 @@
+/*
+ * Copyright (c) 2015, Rice University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *     * Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials
+ *       provided with the distribution.
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written
+ *       permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Merge achlog files and cut time windows from them.
+ *
+ * As in achreplay, records from all logs are merged by real capture
+ * time with a binary heap that holds only the current record of each
+ * log, so memory use depends on the number of logs and not on their
+ * size.  Each log is first sought to the start of the window through
+ * its index, and it leaves the merge at its first record past the
+ * end, so records outside the window are not read, except for those
+ * between the start and the index entry before it.
+ *
+ * The merged records are listed as text, or written to a new log.
+ * A new log of one channel is an ordinary version 1 log.  A new log
+ * of several channels is version 2, with each record tagged with its
+ * channel.  Record times in the new log are real times.  Sequence
+ * numbers are only in order in a new log of one channel from one
+ * log, so only that log is indexed by sequence number.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <syslog.h>
+#include "ach.h"
+#include "achutil.h"
+#include "logsource.h"
+
+/* Index the new log at least this often, as achlog does */
+#define IDX_FRAMES 1024
+#define IDX_NS 1000000000
+
+static const char *opt_out = NULL;
+static const char *opt_start = NULL;
+static const char *opt_end = NULL;
+
+static struct log_source *sources = NULL;
+static size_t n_sources = 0;
+
+/* Channels of the output, by number */
+static const char **out_names = NULL;
+static size_t n_out = 0;
+
+/* A window bound: seconds after the start of the earliest log, or
+ * seconds since the epoch when prefixed with "@" */
+static uint64_t parse_bound( const char *arg, uint64_t log_start ) {
+    /* parse exactly, since epoch times in nanoseconds exceed the
+     * precision of a double */
+    int abs = ('@' == arg[0]);
+    const char *p = arg + abs;
+    uint64_t sec = 0, nsec = 0, scale = 1000000000;
+    int digits = 0;
+    for( ; *p >= '0' && *p <= '9'; p ++, digits ++ ) sec = sec * 10 + (uint64_t)(*p - '0');
+    if( '.' == *p ) {
+        for( p ++; *p >= '0' && *p <= '9'; p ++, digits ++ ) {
+            if( scale > 1 ) {
+                scale /= 10;
+                nsec += scale * (uint64_t)(*p - '0');
+            }
+        }
+    }
+    if( 0 == digits || *p ) ACH_DIE( "Invalid time: %s\n", arg );
+    return (abs ? 0 : log_start) + sec * 1000000000 + nsec;
+}
+
+/* Number an output channel, reusing the number of a channel with the
+ * same name */
+static uint32_t out_channel( const char *name ) {
+    size_t i;
+    for( i = 0; i < n_out; i ++ ) {
+        if( 0 == strcmp(name, out_names[i]) ) return (uint32_t)i;
+    }
+    out_names = (const char**)realloc( out_names, (n_out + 1) * sizeof(out_names[0]) );
+    out_names[n_out] = name;
+    return (uint32_t)n_out++;
+}
+
+/* The new log */
+static FILE *fout = NULL;
+static FILE *fidx = NULL;
+static uint64_t out_offset = 0;
+static uint64_t idx_frames = 0;
+static uint64_t idx_time = 0;
+static int indexed = 0;
+static int seq_ordered = 0;    /* the new log has one channel from one log */
+
+static void out_write( const void *p, size_t n ) {
+    if( n && 1 != fwrite( p, n, 1, fout ) ) {
+        ACH_DIE( "Could not write %s: %s\n", opt_out, strerror(errno) );
+    }
+    out_offset += n;
+}
+
+static void out_open( uint64_t base ) {
+    fout = fopen( opt_out, "w" );
+    if( NULL == fout ) ACH_DIE( "Could not open %s: %s\n", opt_out, strerror(errno) );
+    size_t n = strlen(opt_out) + sizeof(".idx");
+    char buf[n];
+    strcpy( buf, opt_out );
+    strcat( buf, ".idx" );
+    fidx = fopen( buf, "w" );
+    if( NULL == fidx ) ACH_DIE( "Could not open %s: %s\n", buf, strerror(errno) );
+    if( 1 != fwrite( ACH_LOG_IDX_MAGIC "\0\0", 8, 1, fidx ) ) {
+        ACH_DIE( "Could not write %s: %s\n", buf, strerror(errno) );
+    }
+
+    /* With the same ach and real start times, record times are real
+     * times */
+    time_t sec = (time_t)(base / 1000000000);
+    unsigned long nsec = (unsigned long)(base % 1000000000);
+    fprintf( fout, "ACHLOG\n" );
+    if( 1 == n_out ) {
+        fprintf( fout, "channel-name: %s\n", out_names[0] );
+    } else {
+        size_t i;
+        for( i = 0; i < n_out; i ++ ) {
+            fprintf( fout, "channel-%"PRIuPTR": %s\n", i, out_names[i] );
+        }
+    }
+    fprintf( fout,
+             "log-version: %d\n"
+             "log-time-ach: %lu.%09lu\n"
+             "log-time-real: %lu.%09lu # %s"
+             "log-merged-from: %"PRIuPTR" logs\n"
+             ".\n",
+             (1 == n_out) ? ACH_LOG_VERSION : ACH_LOG_VERSION_MULTI,
+             (unsigned long)sec, nsec, (unsigned long)sec, nsec, ctime(&sec),
+             n_sources );
+    if( ferror(fout) ) ACH_DIE( "Could not write %s: %s\n", opt_out, strerror(errno) );
+    out_offset = (uint64_t)ftell( fout );
+}
+
+/* Copy the current record of s to the new log */
+static void out_record( struct log_source *s ) {
+    const struct ach_log_frame *f = &s->frame;
+    uint32_t chan = ((uint32_t*)s->chans)[f->channel];
+    if( ACH_LOG_REC_FRAME == f->type &&
+        ( !indexed || idx_frames >= IDX_FRAMES || s->time - idx_time >= IDX_NS ) )
+    {
+        ach_log_idx_t ent;
+        ach_log_idx_set( &ent, s->time, seq_ordered ? f->seq : ACH_LOG_IDX_NO_SEQ,
+                         out_offset );
+        if( 1 != fwrite( &ent, sizeof(ent), 1, fidx ) ) {
+            ACH_DIE( "Could not write index for %s: %s\n", opt_out, strerror(errno) );
+        }
+        indexed = 1;
+        idx_frames = 0;
+        idx_time = s->time;
+    }
+    if( ACH_LOG_REC_FRAME == f->type ) idx_frames++;
+
+    ach_log_rec_t rec;
+    ach_log_rec_set( &rec, f->type, f->seq, s->time, f->size );
+    if( n_out > 1 ) ach_log_rec_set_channel( &rec, chan );
+    out_write( &rec, sizeof(rec) );
+    if( ACH_LOG_REC_FRAME == f->type ) out_write( f->data, (size_t)f->size );
+}
+
+/* List the current record of s */
+static void print_record( struct log_source *s ) {
+    const struct ach_log_frame *f = &s->frame;
+    printf( "%"PRIu64".%09"PRIu64" %s %c %"PRIu64" %"PRIu64"\n",
+            s->time / 1000000000, s->time % 1000000000,
+            s->log.channels[f->channel], f->type, f->seq, f->size );
+}
+
+int main( int argc, char **argv ) {
+    int c;
+    while( (c = getopt( argc, argv, "o:s:e:vh?V")) != -1 ) {
+        switch(c) {
+        case 'o':
+            opt_out = optarg;
+            break;
+        case 's':
+            opt_start = optarg;
+            break;
+        case 'e':
+            opt_end = optarg;
+            break;
+        case 'v':
+            ach_verbosity ++;
+            break;
+        case 'V':   /* version     */
+            ach_print_version("achlogmerge");
+            exit(EXIT_SUCCESS);
+        case '?':
+        case 'h':
+            puts( "Usage: achlogmerge [OPTIONS] logs...\n"
+                  "Merge achlog files by capture time"
+                  "\n"
+                  "Options:\n"
+                  "  -o FILE,             Write the merged records to log FILE instead of\n"
+                  "                       listing them\n"
+                  "  -s SECONDS,          Start SECONDS after the start of the earliest log,\n"
+                  "                       or at SECONDS since the epoch for @SECONDS\n"
+                  "  -e SECONDS,          End SECONDS after the start of the earliest log,\n"
+                  "                       or at SECONDS since the epoch for @SECONDS\n"
+                  "  -v,                  Be verbose\n"
+                  "  -?,                  Show help\n"
+                  "\n"
+                  "Examples:\n"
+                  "  achlogmerge foo bar  List the frames of logs foo and bar in order\n"
+                  "  achlogmerge -s 60 -e 120 -o cut foo bar\n"
+                  "                       Write the second minute of foo and bar to log cut\n"
+                  "\n"
+                  "Report bugs to " PACKAGE_BUGREPORT "\n"
+                );
+            exit(EXIT_SUCCESS);
+        default:
+            log_source_add( &sources, &n_sources, optarg );
+        }
+    }
+    while( optind < argc ) {
+        log_source_add( &sources, &n_sources, argv[optind++] );
+    }
+    if( 0 == n_sources ) ACH_DIE("No logs to merge\n");
+
+    /* Open logs */
+    size_t i;
+    uint64_t log_start = UINT64_MAX;
+    size_t n_chans = 0;
+    for( i = 0; i < n_sources; i ++ ) {
+        struct log_source *s = sources + i;
+        uint64_t t = log_source_open( s );
+        if( t < log_start ) log_start = t;
+        if( s->log.version < 1 ) {
+            ACH_DIE( "Log %s has no timing information\n", s->path );
+        }
+        uint32_t *out_chan = (uint32_t*)malloc( s->log.n_channels * sizeof(out_chan[0]) );
+        s->chans = out_chan;
+        size_t j;
+        for( j = 0; j < s->log.n_channels; j ++ ) {
+            out_chan[j] = out_channel( s->log.channels[j] );
+        }
+        n_chans += s->log.n_channels;
+    }
+    /* Sequence numbers of different channels, or of one channel in
+     * different logs, interleave out of order */
+    seq_ordered = ( 1 == n_chans );
+    uint64_t start = opt_start ? parse_bound( opt_start, log_start ) : 0;
+    uint64_t end = opt_end ? parse_bound( opt_end, log_start ) : UINT64_MAX;
+
+    /* Find the first record of each log in the window */
+    struct log_source *heap[n_sources];
+    size_t n_heap = 0;
+    for( i = 0; i < n_sources; i ++ ) {
+        struct log_source *s = sources + i;
+        if( opt_start ) {
+            int64_t t = (int64_t)start - s->offset;
+            enum ach_status r = ach_log_seek( &s->log, ACH_LOG_KEY_TIME, t > 0 ? (uint64_t)t : 0 );
+            if( ACH_STALE_FRAMES == r ) continue;  /* nothing after the start */
+            if( ACH_OK != r ) {
+                ACH_DIE( "Could not seek in log %s: %s\n", s->path,
+                         ACH_FAILED_SYSCALL == r ? strerror(errno) : ach_result_to_string(r) );
+            }
+        }
+        if( 0 == log_source_next(s, 0) && s->time <= end ) {
+            heap[n_heap++] = s;
+        }
+    }
+    for( i = n_heap / 2; i > 0; i -- ) log_source_heap_down( heap, n_heap, i-1 );
+
+    /* Merge */
+    if( opt_out ) {
+        out_open( opt_start ? start : log_start );
+    }
+    size_t count = 0;
+    while( n_heap ) {
+        struct log_source *s = heap[0];
+        if( opt_out ) out_record( s );
+        else print_record( s );
+        count ++;
+        if( log_source_next(s, 0) || s->time > end ) {
+            heap[0] = heap[--n_heap];
+        }
+        log_source_heap_down( heap, n_heap, 0 );
+    }
+    ACH_LOG( LOG_INFO, "Merged %"PRIuPTR" records\n", count );
+
+    if( opt_out && ( fclose(fout) || fclose(fidx) ) ) {
+        ACH_DIE( "Could not close %s: %s\n", opt_out, strerror(errno) );
+    }
+    if( fflush(stdout) ) {
+        ACH_DIE( "Could not write output: %s\n", strerror(errno) );
+    }
+    int exit_status = EXIT_SUCCESS;
+    for( i = 0; i < n_sources; i ++ ) {
+        if( sources[i].failed ) exit_status = EXIT_FAILURE;
+        free( sources[i].chans );
+    }
+    /* Channel names belong to the logs */
+    for( i = 0; i < n_sources; i ++ ) {
+        ach_log_close( &sources[i].log );
+    }
+    free( out_names );
+    free( sources );
+    return exit_status;
+}
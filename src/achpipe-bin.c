@@ -85,6 +85,17 @@
  *
  * These commands are sent as four ascii bytes, no '\\n' and no '\\0'.
  *
+ * \section zero-copy Zero-Copy Output
+ *
+ * With -Z, when its output is a pipe, as when feeding \c ssh or
+ * \c nc, a subscribing achpipe process gets frames into a page-aligned
+ * ring buffer and vmsplice()s them into the pipe, so the kernel
+ * references the ring pages rather than copying them.  The reader of
+ * the pipe must read() it; one that splice()s the pages onward could
+ * send them after achpipe has reused them.  A publishing achpipe
+ * process reads its input with large unbuffered reads and puts each
+ * frame to the channel straight from the read buffer.
+ *
  * \section comparison-proper Comparison to Ach Proper
  *
  * Note that ach normally communicates using shared memory.  The pipe
@@ -96,6 +107,7 @@
  * \sa Todo List
  */
 
+#define _GNU_SOURCE
 #ifdef HAVE_CONFIG_H
 #include "config.h"
 #endif
@@ -111,6 +123,10 @@
 #include <time.h>
 #include <errno.h>
 #include <inttypes.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include "ach.h"
 #include "achutil.h"
 
@@ -149,6 +165,15 @@ static int _relsleep( struct timespec t ) {
 /** Initial size of ach frame buffer */
 #define INIT_BUF_SIZE 512
 
+/** Size of the publish read buffer */
+#define READ_BUF_SIZE (256*1024)
+
+/** Pipe capacity to assume when F_GETPIPE_SZ is unavailable */
+#define DEFAULT_PIPE_SIZE (64*1024)
+
+/** Size of the frame header that precedes the data */
+#define FRAME_HEADER_SIZE (sizeof(ach_pipe_frame_t) - 1)
+
 /*
   #define HEADER_LINE_MAX 4096
   #define HEADER_LABEL_MAX 512
@@ -175,6 +200,8 @@ int opt_last = 0;
 int opt_sync = 0;
 /** CLI option: frequency */
 double opt_freq = 0;
+/** CLI option: vmsplice() output into a pipe */
+int opt_splice = 0;
 /*
 /// CLI option: read option headers
 int opt_read_headers = 0;
@@ -327,8 +354,169 @@ void hard_assert(int test, const char fmt[], ... ) {
   }
 */
 
+/** Unbuffered input for the publishing loop.
+ *
+ * Reads as much as the descriptor has available, up to the buffer
+ * size, so that many small frames are taken in one read().
+ */
+struct read_buf {
+    int fd;       /**< input file descriptor */
+    char *buf;    /**< buffered input */
+    size_t size;  /**< size of buf */
+    size_t start; /**< offset of first unconsumed byte */
+    size_t end;   /**< offset past last buffered byte */
+};
+
+/** Buffer at least need bytes from start.
+ *
+ * \return 0 on success, -1 on end of file, error, or signal.
+ */
+static int read_buf_fill( struct read_buf *rb, size_t need ) {
+    if( rb->end - rb->start >= need ) return 0;
+    /* make room */
+    if( need > rb->size ) {
+        size_t size = rb->size;
+        while( size < need ) size *= 2;
+        char *buf = (char*)malloc( size );
+        hard_assert( NULL != buf, "Couldn't allocate %"PRIuPTR" bytes\n", size );
+        memcpy( buf, rb->buf + rb->start, rb->end - rb->start );
+        free( rb->buf );
+        rb->buf = buf;
+        rb->size = size;
+        rb->end -= rb->start;
+        rb->start = 0;
+    } else if( rb->start + need > rb->size ) {
+        memmove( rb->buf, rb->buf + rb->start, rb->end - rb->start );
+        rb->end -= rb->start;
+        rb->start = 0;
+    }
+    /* read */
+    while( rb->end - rb->start < need ) {
+        ssize_t r = read( rb->fd, rb->buf + rb->end, rb->size - rb->end );
+        if( r > 0 ) {
+            rb->end += (size_t)r;
+        } else if( r < 0 && EINTR == errno && !sig_received ) {
+            continue;
+        } else {
+            if( r < 0 ) verbprintf( 1, "read: %s\n", strerror(errno) );
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/** Output for the subscribing loop.
+ *
+ * Frames are received into a page-aligned ring and, with -Z when the
+ * output is a pipe, vmsplice()d into it.  The pipe then references
+ * the ring pages until the reader consumes them, so a region of the
+ * ring is only reused once more than a pipe's capacity of later
+ * frames has been written after it.  Each frame takes at most a
+ * quarter of the ring and the ring is at least four times the pipe
+ * capacity, so at least half the ring, and more than the pipe holds,
+ * is always written between uses of any region.  The ring grows for
+ * larger frames; the old ring may be unmapped immediately since the
+ * pipe holds its own references to the pages.
+ *
+ * This holds only for a reader that read()s the pipe.  One that
+ * splice()s it onward, as into a socket, keeps references to the
+ * pages past the pipe and would see them overwritten by later
+ * frames, so vmsplice() is opt-in.
+ */
+struct out_ring {
+    int fd;             /**< output file descriptor */
+    int splice;         /**< whether to vmsplice() into fd */
+    size_t pipe_size;   /**< capacity of the output pipe */
+    char *buf;          /**< page-aligned ring */
+    size_t size;        /**< size of buf */
+    size_t off;         /**< offset of the next frame */
+};
+
+/** Map a ring with slots for frames of up to data_size bytes */
+static void out_ring_map( struct out_ring *ring, size_t data_size ) {
+    size_t page = (size_t)sysconf( _SC_PAGESIZE );
+    size_t slot = FRAME_HEADER_SIZE + data_size;
+    if( slot < ring->pipe_size ) slot = ring->pipe_size;
+    size_t size = (4*slot + page - 1) & ~(page - 1);
+    char *buf = (char*)mmap( NULL, size, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+    hard_assert( MAP_FAILED != buf,
+                 "Couldn't map %"PRIuPTR" bytes: %s\n", size, strerror(errno) );
+    if( ring->buf ) munmap( ring->buf, ring->size );
+    ring->buf = buf;
+    ring->size = size;
+    ring->off = 0;
+}
+
+/** Set up output to fd */
+static void out_ring_init( struct out_ring *ring, int fd ) {
+    struct stat st;
+    memset( ring, 0, sizeof(*ring) );
+    ring->fd = fd;
+    ring->pipe_size = DEFAULT_PIPE_SIZE;
+    if( 0 == fstat( fd, &st ) && S_ISFIFO(st.st_mode) ) {
+        ring->splice = opt_splice;
+#ifdef F_GETPIPE_SZ
+        int r = fcntl( fd, F_GETPIPE_SZ );
+        if( r > 0 ) ring->pipe_size = (size_t)r;
+#endif
+    }
+    verbprintf( 1, "Output: %s\n", ring->splice ? "vmsplice" : "write" );
+    out_ring_map( ring, INIT_BUF_SIZE );
+}
+
+/** Get space for the next frame.
+ *
+ * \param[out] max the number of data bytes the frame can hold
+ */
+static ach_pipe_frame_t *out_ring_frame( struct out_ring *ring, size_t *max ) {
+    size_t slot = ring->size / 4;
+    if( ring->off + slot > ring->size ) ring->off = 0;
+    ach_pipe_frame_t *frame = (ach_pipe_frame_t*)(ring->buf + ring->off);
+    memcpy( frame->magic, "achpipe", 8 );
+    *max = slot - FRAME_HEADER_SIZE;
+    return frame;
+}
+
+/** Write the frame from out_ring_frame().
+ *
+ * \return 0 on success, -1 on error or signal.
+ */
+static int out_ring_send( struct out_ring *ring, ach_pipe_frame_t *frame ) {
+    size_t size = FRAME_HEADER_SIZE + (size_t)ach_pipe_get_size(frame);
+    char *ptr = (char*)frame;
+    size_t n = 0;
+    while( n < size ) {
+        ssize_t r;
+        if( ring->splice ) {
+            struct iovec iov;
+            iov.iov_base = ptr + n;
+            iov.iov_len = size - n;
+            r = vmsplice( ring->fd, &iov, 1, 0 );
+            if( r < 0 && (EINVAL == errno || ENOSYS == errno) ) {
+                verbprintf( 1, "vmsplice: %s, using write\n", strerror(errno) );
+                ring->splice = 0;
+                continue;
+            }
+        } else {
+            r = write( ring->fd, ptr + n, size - n );
+        }
+        if( r > 0 ) {
+            n += (size_t)r;
+        } else if( r < 0 && EINTR == errno && !sig_received ) {
+            continue;
+        } else {
+            if( r < 0 ) verbprintf( 1, "write: %s\n", strerror(errno) );
+            return -1;
+        }
+    }
+    /* keep the next header aligned */
+    ring->off += (size + 15) & ~(size_t)15;
+    return 0;
+}
+
 /** publishing loop */
-void publish( FILE *fin, char *chan_name )  {
+void publish( int fd, char *chan_name )  {
     verbprintf(1, "Publishing()\n");
     /* assert(STDIN_FILENO == fd ); */
     ach_channel_t chan;
@@ -342,39 +530,42 @@ void publish( FILE *fin, char *chan_name )  {
     }
 
     { /* publish loop */
-        uint64_t max = INIT_BUF_SIZE;
-        ach_pipe_frame_t *frame = ach_pipe_alloc( max );
+        struct read_buf rb;
+        rb.fd = fd;
+        rb.size = READ_BUF_SIZE;
+        rb.buf = (char*)malloc( rb.size );
+        rb.start = rb.end = 0;
+        hard_assert( NULL != rb.buf, "Couldn't allocate read buffer\n" );
         while( ! sig_received ) {
             /* get size */
-            size_t s = fread( frame, 1, 16, fin );
-            verbprintf( 2, "Read %d bytes\n", s );
-            if( 16 != s ) break;
+            if( read_buf_fill( &rb, FRAME_HEADER_SIZE ) ) break;
+            const ach_pipe_frame_t *frame =
+                (const ach_pipe_frame_t*)(rb.buf + rb.start);
             if( memcmp("achpipe", frame->magic, 8) ) break;
             uint64_t cnt = ach_pipe_get_size( frame );
             /* FIXME: sanity check that cnt is not something outrageous */
-            /* make sure buf can hold it */
-            if( (size_t)cnt > max ) {
-                max = cnt;
-                free( frame );
-                frame = ach_pipe_alloc( max );
-            }
             /* get data */
-            s = fread( frame->data, 1, (size_t)cnt, fin );
-            if( cnt != s ) break;
+            if( read_buf_fill( &rb, FRAME_HEADER_SIZE + (size_t)cnt ) ) break;
+            frame = (const ach_pipe_frame_t*)(rb.buf + rb.start);
+            verbprintf( 2, "Read frame %"PRIu64"\n", cnt );
             /* put data */
             ach_status_t r = ach_put( &chan, frame->data, cnt );
             hard_assert( r == ACH_OK, "Invalid ach put %s\n",
                          ach_result_to_string( r ) );
+            rb.start += FRAME_HEADER_SIZE + (size_t)cnt;
         }
-        free(frame);
+        free(rb.buf);
 
     }
-    ach_close( &chan );
+    ach_status_t r = ach_close( &chan );
+    if( ACH_OK != r ) {
+        fprintf( stderr, "Couldn't close channel: %s\n", ach_result_to_string(r) );
+    }
 }
 
 
 /** subscribing loop */
-void subscribe( FILE *fin, FILE *fout, char *chan_name ) {
+void subscribe( int fd_in, int fd_out, char *chan_name ) {
     verbprintf(1, "Subscribing()\n");
     verbprintf(1, "Synchronous: %s\n", opt_sync ? "yes" : "no");
     /* get channel */
@@ -390,8 +581,8 @@ void subscribe( FILE *fin, FILE *fout, char *chan_name ) {
                      chan_name, ach_result_to_string(r) );
     }
     /* frame buffer */
-    size_t max = INIT_BUF_SIZE;
-    ach_pipe_frame_t *frame = ach_pipe_alloc( max );
+    struct out_ring ring;
+    out_ring_init( &ring, fd_out );
     int t0 = 1;
 
 
@@ -409,13 +600,21 @@ void subscribe( FILE *fin, FILE *fout, char *chan_name ) {
         char cmd[4] = {0};
         if( opt_sync ) {
             /* wait for the pull command */
-            size_t rc = fread( cmd, 1, 4, fin);
+            size_t rc = 0;
+            while( rc < 4 ) {
+                ssize_t r = read( fd_in, cmd + rc, 4 - rc );
+                if( r > 0 ) rc += (size_t)r;
+                else if( !(r < 0 && EINTR == errno && !sig_received) ) break;
+            }
             hard_assert(4 == rc, "Invalid command read: %d\n", rc );
             verbprintf(2, "Command %s\n", cmd );
         }
         /* read the data */
         int got_frame = 0;
+        ach_pipe_frame_t *frame;
         do {
+            size_t max;
+            frame = out_ring_frame( &ring, &max );
             size_t frame_size = 0;
             ach_status_t r = ACH_BUG;
             if( opt_sync ) {
@@ -442,9 +641,7 @@ void subscribe( FILE *fin, FILE *fout, char *chan_name ) {
             if( ACH_OVERFLOW == r ) {
                 /* enlarge buffer and retry on overflow */
                 assert(frame_size > max );
-                max = frame_size;
-                free(frame);
-                frame = ach_pipe_alloc( max );
+                out_ring_map( &ring, frame_size );
             } else if (ACH_OK == r || ACH_MISSED_FRAME == r || t0 ) {
                 got_frame = 1;
                 ach_pipe_set_size( frame, frame_size );
@@ -460,14 +657,9 @@ void subscribe( FILE *fin, FILE *fout, char *chan_name ) {
 
         /* stream send */
         {
-            size_t size = sizeof(ach_pipe_frame_t) - 1 + ach_pipe_get_size(frame);
-            size_t r = fwrite( frame, 1, size, fout );
-            if( r != size ) {
-                break;
-            }
-            if( fflush( fout ) ) break;
+            if( out_ring_send( &ring, frame ) ) break;
             if( opt_sync ) {
-                fsync( fileno(fout) ); /* fails w/ sbcl, and maybe that's ok */
+                fsync( fd_out ); /* fails w/ sbcl, and maybe that's ok */
             }
             verbprintf( 2, "Printed output\n");
         }
@@ -478,8 +670,11 @@ void subscribe( FILE *fin, FILE *fout, char *chan_name ) {
             _relsleep(period);
         }
     }
-    free(frame);
-    ach_close( &chan );
+    munmap( ring.buf, ring.size );
+    ach_status_t r = ach_close( &chan );
+    if( ACH_OK != r ) {
+        fprintf( stderr, "Couldn't close channel: %s\n", ach_result_to_string(r) );
+    }
 }
 
 
@@ -520,7 +715,7 @@ void sighandler_install() {
 /** main */
 int main( int argc, char **argv ) {
     int c;
-    while( (c = getopt( argc, argv, "p:s:z:vlcf:h?V")) != -1 ) {
+    while( (c = getopt( argc, argv, "p:s:z:vlcf:Zh?V")) != -1 ) {
         switch(c) {
         case 'p':
             opt_pub = 1;
@@ -538,6 +733,7 @@ int main( int argc, char **argv ) {
             hard_assert( strlen( optarg ) < ACH_CHAN_NAME_MAX-1,
                          "Channel name argument to long" );
             strncpy( opt_remote_chan_name, optarg, ACH_CHAN_NAME_MAX );
+            break;
         case 'v':
             opt_verbosity ++;
             break;
@@ -550,6 +746,9 @@ int main( int argc, char **argv ) {
         case 'f':
             opt_freq = atof(optarg);
             break;
+        case 'Z':
+            opt_splice = 1;
+            break;
         case 'V':   /* version     */
             ach_print_version("achpipe.bin");
             exit(EXIT_SUCCESS);
@@ -564,6 +763,8 @@ int main( int argc, char **argv ) {
                   "  -l CHANNEL-NAME,     Get latest messages\n"
                   "  -c,                  Synchronous mode\n"
                   "  -f FREQUENCY,        Output to stream at FREQUENCY\n"
+                  "  -Z,                  vmsplice() output into a pipe, for readers that\n"
+                  "                       read() the pipe rather than splice() it\n"
                   "  -o OCTAL,            Mode for created channel\n"
                   "  -v,                  Be verbose\n" );
             exit(EXIT_SUCCESS);
@@ -601,9 +802,9 @@ int main( int argc, char **argv ) {
     sighandler_install();
     /* run */
     if (opt_pub) {
-        publish( stdin, opt_chan_name );
+        publish( STDIN_FILENO, opt_chan_name );
     } else if (opt_sub) {
-        subscribe( stdin, stdout, opt_chan_name );
+        subscribe( STDIN_FILENO, STDOUT_FILENO, opt_chan_name );
     } else {
         assert(0);
     }
@@ -0,0 +1,217 @@
+/*
+ * Copyright (c) 2015, Rice University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *     * Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials
+ *       provided with the distribution.
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written
+ *       permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Replay achlog files into their channels.
+ *
+ * Frames from all logs are merged by capture time with a binary heap
+ * and put to their channels, as named in each log's header, sleeping
+ * to reproduce the logged timing scaled by the speed factor.  Capture
+ * times are converted to the real-time clock using each log's
+ * log-time-ach and log-time-real headers so that logs from different
+ * hosts merge correctly.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <syslog.h>
+#include "ach.h"
+#include "achutil.h"
+#include "logsource.h"
+
+static double opt_speed = 1.0;
+static int opt_fast = 0;
+static double opt_start_time = -1;
+static int opt_start_seq = 0;
+static uint64_t start_seq = 0;
+
+static struct log_source *sources = NULL;
+static size_t n_sources = 0;
+
+int main( int argc, char **argv ) {
+    int c;
+    while( (c = getopt( argc, argv, "s:ft:q:vh?V")) != -1 ) {
+        switch(c) {
+        case 's':
+            opt_speed = atof(optarg);
+            if( opt_speed <= 0 ) ACH_DIE( "Invalid speed: %s\n", optarg );
+            break;
+        case 'f':
+            opt_fast = 1;
+            break;
+        case 't':
+            opt_start_time = atof(optarg);
+            break;
+        case 'q':
+            opt_start_seq = 1;
+            start_seq = strtoull(optarg, NULL, 10);
+            break;
+        case 'v':
+            ach_verbosity ++;
+            break;
+        case 'V':   /* version     */
+            ach_print_version("achreplay");
+            exit(EXIT_SUCCESS);
+        case '?':
+        case 'h':
+            puts( "Usage: achreplay [OPTIONS] logs...\n"
+                  "Replay achlog files into their channels"
+                  "\n"
+                  "Options:\n"
+                  "  -s SPEED,            Replay SPEED times faster than logged (default 1)\n"
+                  "  -f,                  Replay as fast as possible\n"
+                  "  -t SECONDS,          Start SECONDS after the start of the earliest log\n"
+                  "  -q SEQ,              Start at sequence number SEQ in each log\n"
+                  "  -v,                  Be verbose\n"
+                  "  -?,                  Show help\n"
+                  "\n"
+                  "Examples:\n"
+                  "  achreplay foo bar    Replay logs foo and bar to channels foo and bar\n"
+                  "  achreplay -s 10 foo  Replay log foo ten times faster\n"
+                  "\n"
+                  "Report bugs to " PACKAGE_BUGREPORT "\n"
+                );
+            exit(EXIT_SUCCESS);
+        default:
+            log_source_add( &sources, &n_sources, optarg );
+        }
+    }
+    while( optind < argc ) {
+        log_source_add( &sources, &n_sources, argv[optind++] );
+    }
+    if( 0 == n_sources ) ACH_DIE("No logs to replay\n");
+
+    /* Open logs and channels */
+    size_t i;
+    uint64_t log_start = UINT64_MAX;
+    for( i = 0; i < n_sources; i ++ ) {
+        struct log_source *s = sources + i;
+        uint64_t t = log_source_open( s );
+        if( t < log_start ) log_start = t;
+        if( s->log.version < 1 && (opt_start_time >= 0 || opt_start_seq || !opt_fast) ) {
+            ACH_DIE( "Log %s has no timing information, replay it with -f\n", s->path );
+        }
+        if( s->log.n_channels > 1 && opt_start_seq ) {
+            ACH_DIE( "Log %s has several channels, so -q does not apply\n", s->path );
+        }
+        ach_channel_t *chans = (ach_channel_t*)calloc( s->log.n_channels, sizeof(chans[0]) );
+        s->chans = chans;
+        size_t j;
+        for( j = 0; j < s->log.n_channels; j ++ ) {
+            enum ach_status r = ach_open( &chans[j], s->log.channels[j], NULL );
+            if( ACH_OK != r ) {
+                ACH_DIE( "Could not open channel %s: %s\n",
+                         s->log.channels[j], ach_result_to_string(r) );
+            }
+        }
+    }
+
+    /* Find the first frame of each log */
+    struct log_source *heap[n_sources];
+    size_t n_heap = 0;
+    for( i = 0; i < n_sources; i ++ ) {
+        struct log_source *s = sources + i;
+        enum ach_status r = ACH_OK;
+        if( opt_start_seq ) {
+            r = ach_log_seek( &s->log, ACH_LOG_KEY_SEQ, start_seq );
+        } else if( opt_start_time >= 0 ) {
+            int64_t t = (int64_t)(log_start + (uint64_t)(opt_start_time * 1e9)) - s->offset;
+            r = ach_log_seek( &s->log, ACH_LOG_KEY_TIME, t > 0 ? (uint64_t)t : 0 );
+        }
+        if( ACH_STALE_FRAMES == r ) continue;  /* nothing after the start */
+        if( ACH_EINVAL == r ) {
+            ACH_DIE( "Log %s is not in sequence order, so -q does not apply\n", s->path );
+        }
+        if( ACH_OK != r ) {
+            ACH_DIE( "Could not seek in log %s: %s\n", s->path,
+                     ACH_FAILED_SYSCALL == r ? strerror(errno) : ach_result_to_string(r) );
+        }
+        if( 0 == log_source_next(s, 1) ) {
+            heap[n_heap++] = s;
+        }
+    }
+    for( i = n_heap / 2; i > 0; i -- ) log_source_heap_down( heap, n_heap, i-1 );
+
+    /* Replay */
+    struct timespec now;
+    clock_gettime( ACH_DEFAULT_CLOCK, &now );
+    uint64_t wall0 = log_source_ns( &now );
+    uint64_t time0 = n_heap ? heap[0]->time : 0;
+    size_t count = 0;
+    while( n_heap ) {
+        struct log_source *s = heap[0];
+        if( !opt_fast ) {
+            uint64_t t = wall0 + (uint64_t)((double)(s->time - time0) / opt_speed);
+            struct timespec ts = { .tv_sec = (time_t)(t / 1000000000),
+                                   .tv_nsec = (long)(t % 1000000000) };
+            while( EINTR == clock_nanosleep( ACH_DEFAULT_CLOCK, TIMER_ABSTIME, &ts, NULL ) );
+        }
+        enum ach_status r = ach_put( (ach_channel_t*)s->chans + s->frame.channel, s->frame.data,
+                                     (size_t)s->frame.size );
+        if( ACH_OK != r ) {
+            ACH_DIE( "Could not put frame to %s: %s\n",
+                     s->log.channels[s->frame.channel], ach_result_to_string(r) );
+        }
+        count ++;
+        if( log_source_next(s, 1) ) {
+            heap[0] = heap[--n_heap];
+        }
+        log_source_heap_down( heap, n_heap, 0 );
+    }
+    ACH_LOG( LOG_INFO, "Replayed %"PRIuPTR" frames\n", count );
+
+    int exit_status = EXIT_SUCCESS;
+    for( i = 0; i < n_sources; i ++ ) {
+        ach_channel_t *chans = (ach_channel_t*)sources[i].chans;
+        if( sources[i].failed ) exit_status = EXIT_FAILURE;
+        size_t j;
+        for( j = 0; j < sources[i].log.n_channels; j ++ ) {
+            enum ach_status r = ach_close( &chans[j] );
+            if( ACH_OK != r ) {
+                ACH_LOG( LOG_ERR, "Could not close channel %s: %s\n",
+                         sources[i].log.channels[j], ach_result_to_string(r) );
+            }
+        }
+        free( sources[i].chans );
+        ach_log_close( &sources[i].log );
+    }
+    return exit_status;
+}
@@ -50,10 +50,12 @@
 
 #include <time.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <string.h>
 #include <poll.h>
+#include <pthread.h>
 
 #include <netinet/in.h>
 #include <arpa/nameser.h>
@@ -105,7 +107,7 @@ struct srv_data {
 
 enum ach_status
 parse_dns_srv ( unsigned char *buf, size_t len,
-                char *phost, size_t host_len, int *pport )
+                char *phost, size_t host_len, int *pport, uint32_t *pttl )
 {
     if( len < sizeof(struct dns_packet) )
         return ACH_OVERFLOW;
@@ -159,6 +161,7 @@ parse_dns_srv ( unsigned char *buf, size_t len,
             uint16_t port    = (uint16_t)ntohs( ndata->port );
             if( pri < minpri ) {
                 *pport = port;
+                *pttl = hrec.ttl;
                 minpri = pri;
                 int size2 = dn_expand( buf, msgend, ndata->target, phost, (int)host_len );
                 if( size2 < 0 ) {
@@ -180,26 +183,16 @@ parse_dns_srv ( unsigned char *buf, size_t len,
 
 #define ANSWER_SIZE 4096
 
-enum ach_status
-ach_srv_search( const char *channel, const char *domain,
-                char *host, size_t host_len,
-                int *port )
+/* Query the network for srvname */
+static enum ach_status
+srv_query( const char *srvname, int mdns,
+           char *host, size_t host_len,
+           int *port, uint32_t *ttl )
 {
-    ach_set_errstr( "" );
-
-    /* Create Query */
-    /* RFC 6763 service "subtype" are bogus */
-    const char srv_type[] = "._ach._tcp.";
-    char srvname[strlen(channel) + strlen(srv_type) + strlen(domain) + 1];
-    srvname[0] = '\0';
-    strcat(srvname, channel);
-    strcat(srvname, srv_type);
-    strcat(srvname, domain);
-
     /* Perform Query */
     unsigned char answer[ANSWER_SIZE] = {0};
     int len_a;
-    if( 0 == strcasecmp("local", domain) ) {
+    if( mdns ) {
         /* Magically do mdns lookup */
         len_a = mdns_res_search( srvname, C_IN, T_SRV, answer, ANSWER_SIZE );
         if( len_a < 0 ) {
@@ -216,7 +209,170 @@ ach_srv_search( const char *channel, const char *domain,
     }
 
     /* Process Result */
-    return parse_dns_srv( answer, (size_t)len_a, host, host_len, port );
+    return parse_dns_srv( answer, (size_t)len_a, host, host_len, port, ttl );
+}
+
+/*-- Resolver Cache --*/
+
+/* Answers are cached per query name and shared by every lookup in
+ * the process.  A fresh answer returns at once.  A stale answer is
+ * returned while a background thread refreshes it, so reconnects
+ * never wait on the network for a name that resolved before.  A name
+ * with no answer yet is queried once, and concurrent lookups of it
+ * wait for that query.  Failures are cached briefly so that many
+ * lookups of a missing name do not each wait out the mDNS timeout.
+ */
+
+#define SRV_TTL_MIN 1       /**< floor for answers with TTL 0, in seconds */
+#define SRV_TTL_MAX 3600    /**< cap on cached answers, in seconds */
+#define SRV_TTL_FAIL 5      /**< time to cache failures, in seconds */
+
+struct srv_entry {
+    struct srv_entry *next;
+    char *name;               /**< query name */
+    int mdns;                 /**< query via mDNS */
+    int busy;                 /**< a query is running */
+    int valid;                /**< holds a result */
+    time_t expires;           /**< monotonic seconds */
+    enum ach_status status;
+    const char *errstr;
+    int port;
+    char host[NS_MAXDNAME];
+};
+
+static pthread_mutex_t srv_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t srv_cond = PTHREAD_COND_INITIALIZER;
+static struct srv_entry *srv_cache = NULL;
+
+static time_t
+srv_now( void )
+{
+    struct timespec now;
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    return now.tv_sec;
+}
+
+/* Query e->name and store the result, call without srv_lock */
+static void
+srv_update( struct srv_entry *e )
+{
+    char host[NS_MAXDNAME];
+    int port = 0;
+    uint32_t ttl = 0;
+    ach_set_errstr( "" );
+    enum ach_status r = srv_query( e->name, e->mdns, host, sizeof(host), &port, &ttl );
+    const char *errstr = ach_errstr();
+
+    if( ttl < SRV_TTL_MIN ) ttl = SRV_TTL_MIN;
+    if( ttl > SRV_TTL_MAX ) ttl = SRV_TTL_MAX;
+
+    pthread_mutex_lock( &srv_lock );
+    if( ACH_OK == r ) {
+        strcpy( e->host, host );
+        e->port = port;
+        e->status = ACH_OK;
+        e->expires = srv_now() + (time_t)ttl;
+    } else if( e->valid && ACH_OK == e->status ) {
+        /* keep serving the old answer, retry later */
+        e->expires = srv_now() + SRV_TTL_FAIL;
+    } else {
+        e->status = r;
+        e->errstr = errstr;
+        e->expires = srv_now() + SRV_TTL_FAIL;
+    }
+    e->valid = 1;
+    e->busy = 0;
+    pthread_cond_broadcast( &srv_cond );
+    pthread_mutex_unlock( &srv_lock );
+}
+
+static void *
+srv_refresh( void *arg )
+{
+    srv_update( (struct srv_entry*)arg );
+    return NULL;
+}
+
+/* Find or add the entry for name, call with srv_lock */
+static struct srv_entry *
+srv_entry( const char *name, int mdns )
+{
+    struct srv_entry *e;
+    for( e = srv_cache; e; e = e->next ) {
+        if( e->mdns == mdns && 0 == strcasecmp(e->name, name) ) return e;
+    }
+    e = (struct srv_entry*)calloc( 1, sizeof(*e) );
+    e->name = strdup( name );
+    e->mdns = mdns;
+    e->next = srv_cache;
+    srv_cache = e;
+    return e;
+}
+
+enum ach_status
+ach_srv_search( const char *channel, const char *domain,
+                char *host, size_t host_len,
+                int *port )
+{
+    ach_set_errstr( "" );
+
+    /* Create Query */
+    /* RFC 6763 service "subtype" are bogus */
+    const char srv_type[] = "._ach._tcp.";
+    char srvname[strlen(channel) + strlen(srv_type) + strlen(domain) + 1];
+    srvname[0] = '\0';
+    strcat(srvname, channel);
+    strcat(srvname, srv_type);
+    strcat(srvname, domain);
+
+    /* Magically do mdns lookup for "local" */
+    int mdns = ( 0 == strcasecmp("local", domain) );
+
+    pthread_mutex_lock( &srv_lock );
+    struct srv_entry *e = srv_entry( srvname, mdns );
+    for(;;) {
+        if( e->valid && srv_now() < e->expires ) {
+            /* fresh */
+            break;
+        } else if( e->valid && ACH_OK == e->status ) {
+            /* stale, refresh in the background */
+            if( ! e->busy ) {
+                pthread_attr_t attr;
+                pthread_t thread;
+                e->busy = 1;
+                if( pthread_attr_init( &attr ) ||
+                    pthread_attr_setdetachstate( &attr, PTHREAD_CREATE_DETACHED ) ||
+                    pthread_create( &thread, &attr, srv_refresh, e ) )
+                {
+                    e->busy = 0;
+                }
+                pthread_attr_destroy( &attr );
+            }
+            break;
+        } else if( e->busy ) {
+            /* someone else is asking */
+            pthread_cond_wait( &srv_cond, &srv_lock );
+        } else {
+            /* ask */
+            e->busy = 1;
+            pthread_mutex_unlock( &srv_lock );
+            srv_update( e );
+            pthread_mutex_lock( &srv_lock );
+        }
+    }
+
+    enum ach_status r = e->status;
+    if( ACH_OK != r ) {
+        ach_set_errstr( e->errstr );
+    } else if( strlen(e->host) >= host_len ) {
+        ach_set_errstr( "host buffer too small" );
+        r = ACH_OVERFLOW;
+    } else {
+        strcpy( host, e->host );
+        *port = e->port;
+    }
+    pthread_mutex_unlock( &srv_lock );
+    return r;
 }
 
 
@@ -72,6 +72,7 @@
 
 #include "ach.h"
 #include "ach/private_posix.h"
+#include "ach/experimental.h"
 #include "libach/vtab.h"
 
 #include <sys/wait.h>
@@ -287,6 +288,36 @@ ach_get( ach_channel_t *chan, void *buf, size_t size,
 }
 
 
+enum ach_status
+ach_get_seq( ach_channel_t *chan, uint64_t seq,
+             void *buf, size_t size, size_t *frame_size )
+{
+    return chan->vtab->get_seq( chan, seq, buf, size, frame_size );
+}
+
+enum ach_status
+libach_get_seq_notsup( ach_channel_t *chan, uint64_t seq,
+                       void *buf, size_t size, size_t *frame_size )
+{
+    (void)chan; (void)seq; (void)buf; (void)size; (void)frame_size;
+    return ACH_ENOTSUP;
+}
+
+enum ach_status
+ach_put_transfer( ach_channel_t *chan, ach_put_fun transfer, void *cx,
+                  const void *obj, size_t len )
+{
+    return chan->vtab->put_transfer( chan, transfer, cx, obj, len );
+}
+
+enum ach_status
+libach_put_transfer_notsup( ach_channel_t *chan, ach_put_fun transfer, void *cx,
+                            const void *obj, size_t len )
+{
+    (void)chan; (void)transfer; (void)cx; (void)obj; (void)len;
+    return ACH_ENOTSUP;
+}
+
 enum ach_status
 ach_flush( ach_channel_t *chan )
 {
@@ -446,6 +477,14 @@ ach_channel_map( const struct ach_channel *channel, enum ach_map *mapping )
     return ACH_OK;
 }
 
+enum ach_status
+ach_channel_seq( const struct ach_channel *channel, uint64_t *seq )
+{
+    if( ACH_MAP_KERNEL == channel->vtab->map ) return ACH_ENOTSUP;
+    *seq = channel->seq_num;
+    return ACH_OK;
+}
+
 enum ach_status
 ach_channel_clock( const struct ach_channel *channel, clockid_t *clock )
 {
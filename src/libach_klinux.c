@@ -366,6 +366,8 @@ libach_vtab_klinux = {
     .flush = libach_flush_klinux,
     .put = libach_put_klinux,
     .get = libach_get_klinux,
+    .get_seq = libach_get_seq_notsup,
+    .put_transfer = libach_put_transfer_notsup,
     .cancel = libach_cancel_klinux,
     .close = libach_close_klinux,
     .unlink = libach_unlink_klinux,
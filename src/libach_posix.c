@@ -503,6 +503,41 @@ libach_get_posix( ach_channel_t *chan, void *buf, size_t size,
                      frame_size, ptime, options );
 }
 
+static enum ach_status
+libach_get_seq_posix( ach_channel_t *chan, uint64_t seq,
+                      void *buf, size_t size, size_t *frame_size )
+{
+    ach_header_t *shm = chan->shm;
+    enum ach_status r, retval;
+
+    if( ACH_OK != (r=check_guards(shm)) ) return r;
+    if( ACH_OK != (r=rdlock(chan, 0, NULL)) ) return r;
+
+    /* Used index entries are contiguous, ending with last_seq */
+    size_t used = shm->index_cnt - shm->index_free;
+    if( 0 == seq || seq > shm->last_seq ) {
+        retval = ACH_STALE_FRAMES;
+    } else if( shm->last_seq - seq >= used ) {
+        retval = ACH_MISSED_FRAME;
+    } else {
+        size_t i = ( last_index_i(shm) + shm->index_cnt
+                     - (size_t)(shm->last_seq - seq) ) % shm->index_cnt;
+        ach_index_t *idx = ACH_SHM_INDEX(shm) + i;
+        if( idx->seq_num != seq ||
+            idx->offset + idx->size > shm->data_size )
+        {
+            ACH_ERRF("ach corrupt: bad index entry for seq %" PRIu64 "\n", seq );
+            retval = ACH_CORRUPT;
+        } else {
+            *frame_size = idx->size;
+            retval = get_fun_posix( &size, &buf, ACH_SHM_DATA(shm) + idx->offset, idx->size );
+        }
+    }
+
+    if( ACH_OK != (r=unrdlock(shm)) ) return r;
+    return retval;
+}
+
 static enum ach_status
 libach_cancel_posix( ach_channel_t *chan, const ach_cancel_attr_t *attr )
 {
@@ -653,6 +688,13 @@ libach_put_posix( ach_channel_t *chan, const void *buf, size_t len )
     return ach_xput( chan, put_fun_posix, &len, buf, len );
 }
 
+static enum ach_status
+libach_put_transfer_posix( ach_channel_t *chan, ach_put_fun transfer, void *cx,
+                           const void *obj, size_t len )
+{
+    return ach_xput( chan, transfer, cx, obj, len );
+}
+
 
 static enum ach_status
 libach_flush_posix( ach_channel_t *chan )
@@ -728,6 +770,8 @@ libach_vtab_user = {
     .flush = libach_flush_posix,
     .put = libach_put_posix,
     .get = libach_get_posix,
+    .get_seq = libach_get_seq_posix,
+    .put_transfer = libach_put_transfer_posix,
     .cancel = libach_cancel_posix,
     .close = libach_close_user,
     .unlink = libach_unlink_user,
@@ -745,6 +789,8 @@ libach_vtab_anon = {
     .flush = libach_flush_posix,
     .put = libach_put_posix,
     .get = libach_get_posix,
+    .get_seq = libach_get_seq_posix,
+    .put_transfer = libach_put_transfer_posix,
     .cancel = libach_cancel_posix,
     .close = libach_close_anon,
     .unlink = libach_unlink_anon,
@@ -0,0 +1,476 @@
+/*
+ * Copyright (c) 2015, Rice University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *     * Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials
+ *       provided with the distribution.
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written
+ *       permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Record headers, index and reader for achlog files.
+ *
+ * The reader maps the whole log and hands out frames in place.  It
+ * advises sequential access for the mapping and asks for the pages
+ * ACH_LOG_READAHEAD past the current record ahead of time, so scans
+ * of large logs are not stalled on page faults.  Pages behind the
+ * current record are released, so a scan holds only a window of the
+ * log in memory.
+ */
+
+#include <time.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "ach.h"
+#include "achutil.h"
+
+/* Bytes ahead of the current record to ask the kernel to read */
+#define ACH_LOG_READAHEAD (8*1024*1024)
+
+/* Limit on channel numbers, against corrupt headers */
+#define ACH_LOG_MAX_CHANNELS 65536
+
+static void put64( uint8_t *p, uint64_t x ) {
+    size_t i;
+    for( i = 0; i < 8; i ++ )
+        p[i] = (x >> (8 * i)) & 0xFF;
+}
+
+static uint64_t get64( const uint8_t *p ) {
+    uint64_t x = 0;
+    size_t i;
+    for( i = 0; i < 8; i ++ )
+        x |= (uint64_t)p[i] << (8 * i);
+    return x;
+}
+
+void ach_log_rec_set( ach_log_rec_t *rec, uint8_t type,
+                      uint64_t seq, uint64_t time, uint64_t size )
+{
+    memset( rec, 0, sizeof(*rec) );
+    rec->type = type;
+    put64( rec->seq_bytes, seq );
+    put64( rec->time_bytes, time );
+    put64( rec->size_bytes, size );
+}
+
+uint8_t ach_log_rec_get( const ach_log_rec_t *rec,
+                         uint64_t *seq, uint64_t *time, uint64_t *size )
+{
+    if( seq ) *seq = get64( rec->seq_bytes );
+    if( time ) *time = get64( rec->time_bytes );
+    if( size ) *size = get64( rec->size_bytes );
+    return rec->type;
+}
+
+void ach_log_rec_set_channel( ach_log_rec_t *rec, uint32_t channel )
+{
+    size_t i;
+    for( i = 0; i < 4; i ++ )
+        rec->channel_bytes[i] = (channel >> (8 * i)) & 0xFF;
+}
+
+uint32_t ach_log_rec_get_channel( const ach_log_rec_t *rec )
+{
+    uint32_t x = 0;
+    size_t i;
+    for( i = 0; i < 4; i ++ )
+        x |= (uint32_t)rec->channel_bytes[i] << (8 * i);
+    return x;
+}
+
+void ach_log_idx_set( ach_log_idx_t *ent,
+                      uint64_t time, uint64_t seq, uint64_t offset )
+{
+    put64( ent->time_bytes, time );
+    put64( ent->seq_bytes, seq );
+    put64( ent->offset_bytes, offset );
+}
+
+void ach_log_idx_get( const ach_log_idx_t *ent,
+                      uint64_t *time, uint64_t *seq, uint64_t *offset )
+{
+    if( time ) *time = get64( ent->time_bytes );
+    if( seq ) *seq = get64( ent->seq_bytes );
+    if( offset ) *offset = get64( ent->offset_bytes );
+}
+
+size_t ach_log_idx_find( const ach_log_idx_t *ents, size_t n,
+                         enum ach_log_key key, uint64_t value )
+{
+    /* invariant: entries before lo are <= value, entries at or after
+     * hi are > value */
+    size_t lo = 0, hi = n;
+    while( lo < hi ) {
+        size_t mid = lo + (hi - lo) / 2;
+        const uint8_t *p = (ACH_LOG_KEY_SEQ == key) ?
+            ents[mid].seq_bytes : ents[mid].time_bytes;
+        if( get64(p) <= value ) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo ? lo - 1 : 0;
+}
+
+static void parse_time( const char *s, struct timespec *t ) {
+    unsigned long sec = 0, nsec = 0;
+    sscanf( s, "%lu.%lu", &sec, &nsec );
+    t->tv_sec = (time_t)sec;
+    t->tv_nsec = (long)nsec;
+}
+
+/* Name channel i from a "channel-i" header */
+static int set_channel( struct ach_log_file *lf, unsigned long i, const char *name ) {
+    if( i >= ACH_LOG_MAX_CHANNELS ) return -1;
+    if( i >= lf->n_channels ) {
+        char **p = (char**)realloc( lf->channels, (i + 1) * sizeof(p[0]) );
+        if( NULL == p ) return -1;
+        memset( p + lf->n_channels, 0, (i + 1 - lf->n_channels) * sizeof(p[0]) );
+        lf->channels = p;
+        lf->n_channels = i + 1;
+    }
+    free( lf->channels[i] );
+    lf->channels[i] = strdup( name );
+    return 0;
+}
+
+static void load_idx( struct ach_log_file *lf, const char *path ) {
+    size_t n = strlen(path) + sizeof(".idx");
+    char buf[n];
+    strcpy(buf, path);
+    strcat(buf, ".idx");
+    FILE *f = fopen(buf, "r");
+    if( NULL == f ) return;
+
+    char magic[8];
+    if( 1 == fread(magic, sizeof(magic), 1, f) &&
+        0 == memcmp(magic, ACH_LOG_IDX_MAGIC "\0\0", 8) &&
+        0 == fseeko(f, 0, SEEK_END) )
+    {
+        off_t end = ftello(f);
+        size_t cnt = (end > 8) ? (size_t)(end - 8) / sizeof(ach_log_idx_t) : 0;
+        lf->idx = (ach_log_idx_t*)malloc( cnt * sizeof(ach_log_idx_t) + 1 );
+        if( lf->idx && 0 == fseeko(f, 8, SEEK_SET) ) {
+            lf->n_idx = fread( lf->idx, sizeof(ach_log_idx_t), cnt, f );
+        }
+    }
+    fclose(f);
+}
+
+/* Map the whole file, or remap it if it has grown */
+static enum ach_status
+map( struct ach_log_file *lf ) {
+    struct stat st;
+    if( fstat(lf->fd, &st) ) return ACH_FAILED_SYSCALL;
+    if( !S_ISREG(st.st_mode) ) {
+        errno = ENODEV;
+        return ACH_FAILED_SYSCALL;
+    }
+    size_t len = (size_t)st.st_size;
+    if( len <= lf->map_len ) return ACH_OK;
+
+    void *p = mmap( NULL, len, PROT_READ, MAP_SHARED, lf->fd, 0 );
+    if( MAP_FAILED == p ) return ACH_FAILED_SYSCALL;
+    if( lf->map ) munmap( (void*)lf->map, lf->map_len );
+    lf->map = (const uint8_t*)p;
+    lf->map_len = len;
+    lf->ahead = lf->behind = 0;
+    madvise( p, len, MADV_SEQUENTIAL );
+    return ACH_OK;
+}
+
+/* Ask for the pages ahead of pos before they are needed, and release
+ * those behind it so that long scans do not fill memory */
+static void readahead( struct ach_log_file *lf ) {
+    if( lf->pos + ACH_LOG_READAHEAD / 2 < lf->ahead ) return;
+    size_t page = (size_t)sysconf( _SC_PAGESIZE );
+    size_t start = lf->pos & ~(page - 1);
+    if( start > lf->behind ) {
+        madvise( (void*)(lf->map + lf->behind), start - lf->behind, MADV_DONTNEED );
+        lf->behind = start;
+    }
+    if( start < lf->ahead ) start = lf->ahead;
+    size_t end = lf->pos + ACH_LOG_READAHEAD;
+    if( end > lf->map_len ) end = lf->map_len;
+    if( end > start ) {
+        madvise( (void*)(lf->map + start), end - start, MADV_WILLNEED );
+    }
+    lf->ahead = end;
+}
+
+enum ach_status
+ach_log_open( struct ach_log_file *lf, const char *path )
+{
+    memset( lf, 0, sizeof(*lf) );
+    lf->fd = open( path, O_RDONLY | O_CLOEXEC );
+    if( lf->fd < 0 ) return ACH_FAILED_SYSCALL;
+    enum ach_status r = map( lf );
+    if( ACH_OK != r ) {
+        int e = errno;
+        ach_log_close( lf );
+        errno = e;
+        return r;
+    }
+
+    /* Header lines, up to "." */
+    int magic = 0, done = 0, bad = 0;
+    while( !done && lf->pos < lf->map_len ) {
+        const char *p = (const char*)lf->map + lf->pos;
+        const char *nl = (const char*)memchr( p, '\n', lf->map_len - lf->pos );
+        if( NULL == nl || nl - p >= 1024 ) break;
+        size_t n = (size_t)(nl - p);
+        char line[1024];
+        memcpy( line, p, n );
+        line[n] = '\0';
+        lf->pos += n + 1;
+
+        char *val = strchr(line, ':');
+        if( !magic ) {
+            magic = (0 == strcmp(line, "ACHLOG"));
+            if( !magic ) break;
+        } else if( 0 == strcmp(line, ".") ) {
+            done = 1;
+        } else if( val ) {
+            *val++ = '\0';
+            val += strspn(val, " ");
+            if( 0 == strcmp(line, "channel-name") ) {
+                free( lf->channel );
+                lf->channel = strdup(val);
+            } else if( 0 == strncmp(line, "channel-", 8) &&
+                       line[8] >= '0' && line[8] <= '9' )
+            {
+                if( set_channel( lf, strtoul(line + 8, NULL, 10), val ) ) bad = 1;
+            } else if( 0 == strcmp(line, "log-version") ) {
+                lf->version = atoi(val);
+            } else if( 0 == strcmp(line, "log-time-ach") ) {
+                parse_time( val, &lf->time_ach );
+            } else if( 0 == strcmp(line, "log-time-real") ) {
+                parse_time( val, &lf->time_real );
+            }
+        }
+    }
+    /* Single channel logs have channel-name, and others number their
+     * channels.  lf->channel is not separately owned. */
+    size_t i;
+    if( lf->version < ACH_LOG_VERSION_MULTI ) {
+        for( i = 0; i < lf->n_channels; i ++ ) free( lf->channels[i] );
+        free( lf->channels );
+        lf->channels = NULL;
+        lf->n_channels = 0;
+        if( lf->channel ) set_channel( lf, 0, lf->channel );
+    }
+    free( lf->channel );
+    lf->channel = NULL;
+    for( i = 0; i < lf->n_channels; i ++ ) {
+        if( NULL == lf->channels[i] ) bad = 1;
+    }
+    if( !done || bad || 0 == lf->n_channels || lf->version > ACH_LOG_VERSION_MULTI ) {
+        ach_log_close( lf );
+        return ACH_BAD_HEADER;
+    }
+    lf->channel = lf->channels[0];
+
+    lf->data_offset = lf->pos;
+    if( lf->version > 0 ) load_idx( lf, path );
+    return ACH_OK;
+}
+
+/* Make room for size bytes in *buf */
+static int reserve( void **buf, size_t *max, uint64_t size ) {
+    if( size <= *max ) return 0;
+    if( size > SIZE_MAX - 1 ) return -1;
+    free( *buf );
+    *buf = malloc( (size_t)size );
+    *max = *buf ? (size_t)size : 0;
+    return *buf ? 0 : -1;
+}
+
+/* Take the next record from the current block */
+static enum ach_status
+block_rec( struct ach_log_file *lf ) {
+    size_t avail = lf->block_len - lf->block_pos;
+    if( avail < sizeof(lf->rec) ) return ACH_CORRUPT;
+    memcpy( &lf->rec, lf->block + lf->block_pos, sizeof(lf->rec) );
+    lf->block_pos += sizeof(lf->rec);
+
+    uint64_t size;
+    switch( ach_log_rec_get(&lf->rec, NULL, NULL, &size) ) {
+    case ACH_LOG_REC_GAP:
+        lf->data = NULL;
+        return ACH_OK;
+    case ACH_LOG_REC_FRAME:
+        if( size > lf->block_len - lf->block_pos ) return ACH_CORRUPT;
+        lf->data = lf->block + lf->block_pos;
+        lf->block_pos += (size_t)size;
+        return ACH_OK;
+    default:
+        return ACH_CORRUPT;
+    }
+}
+
+/* Decompress the block record whose data is at p */
+static enum ach_status
+load_block( struct ach_log_file *lf, const uint8_t *p, size_t size ) {
+    if( size < 8 ) return ACH_CORRUPT;
+    uint64_t raw = get64( p );
+    if( reserve( (void**)&lf->block, &lf->block_max, raw ) ) {
+        return raw > SIZE_MAX - 1 ? ACH_CORRUPT : ACH_FAILED_SYSCALL;
+    }
+    size_t len;
+    if( ach_lz_decompress( p + 8, size - 8, lf->block, lf->block_max, &len ) ||
+        len != raw )
+    {
+        return ACH_CORRUPT;
+    }
+    lf->block_len = len;
+    lf->block_pos = 0;
+    return ACH_OK;
+}
+
+/* Check that n bytes past pos are mapped, remapping if the file has
+ * grown.  A record the writer has only partly written is not there
+ * yet. */
+static enum ach_status
+available( struct ach_log_file *lf, size_t n ) {
+    if( lf->map_len - lf->pos >= n ) return ACH_OK;
+    if( ACH_OK != map( lf ) ) return ACH_FAILED_SYSCALL;
+    return ( lf->map_len - lf->pos >= n ) ? ACH_OK : ACH_STALE_FRAMES;
+}
+
+static enum ach_status
+read_rec( struct ach_log_file *lf ) {
+    for(;;) {
+        if( lf->block_pos < lf->block_len ) return block_rec( lf );
+
+        /* version 0 records are the magic and size of an
+         * ach_pipe_frame_t */
+        size_t n = (lf->version > 0) ? sizeof(lf->rec) : 16;
+        enum ach_status r = available( lf, n );
+        if( ACH_OK != r ) return r;
+        readahead( lf );
+        const uint8_t *p = lf->map + lf->pos;
+        if( lf->version > 0 ) {
+            memcpy( &lf->rec, p, sizeof(lf->rec) );
+        } else {
+            ach_log_rec_set( &lf->rec, ACH_LOG_REC_FRAME, 0, 0, get64(p + 8) );
+        }
+
+        uint64_t size;
+        uint8_t type = ach_log_rec_get( &lf->rec, NULL, NULL, &size );
+        if( ACH_LOG_REC_GAP == type ) {
+            lf->pos += n;
+            lf->data = NULL;
+            return ACH_OK;
+        }
+        if( ACH_LOG_REC_FRAME != type && ACH_LOG_REC_BLOCK != type ) {
+            return ACH_CORRUPT;
+        }
+        if( size > SIZE_MAX - n ) return ACH_CORRUPT;
+        r = available( lf, n + (size_t)size );
+        if( ACH_OK != r ) return r;
+        lf->pos += n;
+        p = lf->map + lf->pos;
+        lf->pos += (size_t)size;
+        if( ACH_LOG_REC_FRAME == type ) {
+            lf->data = p;
+            return ACH_OK;
+        }
+        r = load_block( lf, p, (size_t)size );
+        if( ACH_OK != r ) return r;
+    }
+}
+
+enum ach_status
+ach_log_next( struct ach_log_file *lf, struct ach_log_frame *frame )
+{
+    if( !lf->pending ) {
+        enum ach_status r = read_rec( lf );
+        if( ACH_OK != r ) return r;
+    }
+    lf->pending = 0;
+    frame->type = ach_log_rec_get( &lf->rec, &frame->seq, &frame->time, &frame->size );
+    frame->channel = (lf->version >= ACH_LOG_VERSION_MULTI) ?
+        ach_log_rec_get_channel( &lf->rec ) : 0;
+    frame->data = lf->data;
+    return ( frame->channel < lf->n_channels ) ? ACH_OK : ACH_CORRUPT;
+}
+
+enum ach_status
+ach_log_seek( struct ach_log_file *lf, enum ach_log_key key, uint64_t value )
+{
+    if( ACH_LOG_KEY_SEQ == key &&
+        ( lf->version >= ACH_LOG_VERSION_MULTI ||
+          ( lf->n_idx && ACH_LOG_IDX_NO_SEQ == get64(lf->idx[0].seq_bytes) ) ) )
+    {
+        return ACH_EINVAL;
+    }
+
+    uint64_t offset = lf->data_offset;
+    if( lf->n_idx ) {
+        uint64_t t, s, o;
+        ach_log_idx_get( lf->idx + ach_log_idx_find(lf->idx, lf->n_idx, key, value),
+                         &t, &s, &o );
+        if( (ACH_LOG_KEY_SEQ == key ? s : t) <= value ) offset = o;
+    }
+    if( offset > lf->map_len ) return ACH_CORRUPT;
+    lf->pos = (size_t)offset;
+    lf->ahead = 0;
+    lf->behind = lf->pos & ~((size_t)sysconf( _SC_PAGESIZE ) - 1);
+    lf->pending = 0;
+    lf->block_len = lf->block_pos = 0;
+
+    for(;;) {
+        enum ach_status r = read_rec( lf );
+        if( ACH_OK != r ) return r;
+        uint64_t seq, time;
+        if( ACH_LOG_REC_FRAME == ach_log_rec_get( &lf->rec, &seq, &time, NULL ) &&
+            (ACH_LOG_KEY_SEQ == key ? seq : time) >= value )
+        {
+            lf->pending = 1;
+            return ACH_OK;
+        }
+    }
+}
+
+void ach_log_close( struct ach_log_file *lf )
+{
+    if( lf->map ) munmap( (void*)lf->map, lf->map_len );
+    if( lf->fd >= 0 ) close( lf->fd );
+    size_t i;
+    for( i = 0; i < lf->n_channels; i ++ ) free( lf->channels[i] );
+    free( lf->channels );
+    free( lf->idx );
+    free( lf->block );
+    memset( lf, 0, sizeof(*lf) );
+}
@@ -0,0 +1,105 @@
+/*
+ * Copyright (c) 2015, Rice University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *     * Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials
+ *       provided with the distribution.
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written
+ *       permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Read achlog files for achreplay and achlogmerge.
+ *
+ * Each tool keeps the current record of every log in a binary heap
+ * ordered by real capture time, so merging needs memory only for one
+ * record per log.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <syslog.h>
+#include "ach.h"
+#include "achutil.h"
+#include "logsource.h"
+
+uint64_t log_source_ns( const struct timespec *t ) {
+    return (uint64_t)t->tv_sec * 1000000000 + (uint64_t)t->tv_nsec;
+}
+
+void log_source_add( struct log_source **sources, size_t *n, const char *path ) {
+    *sources = (struct log_source*)realloc( *sources, (1 + *n) * sizeof((*sources)[0]) );
+    memset( *sources + *n, 0, sizeof((*sources)[0]) );
+    (*sources)[(*n)++].path = path;
+}
+
+uint64_t log_source_open( struct log_source *s ) {
+    enum ach_status r = ach_log_open( &s->log, s->path );
+    if( ACH_OK != r ) {
+        ACH_DIE( "Could not open log %s: %s\n", s->path,
+                 ACH_FAILED_SYSCALL == r ? strerror(errno) : ach_result_to_string(r) );
+    }
+    s->offset = (int64_t)( log_source_ns(&s->log.time_real) -
+                           log_source_ns(&s->log.time_ach) );
+    return log_source_ns( &s->log.time_real );
+}
+
+int log_source_next( struct log_source *s, int frames_only ) {
+    for(;;) {
+        enum ach_status r = ach_log_next( &s->log, &s->frame );
+        if( ACH_STALE_FRAMES == r ) return -1;
+        if( ACH_OK != r ) {
+            ACH_LOG( LOG_ERR, "Could not read %s: %s\n",
+                     s->path, ACH_FAILED_SYSCALL == r ? strerror(errno) : ach_result_to_string(r) );
+            s->failed = 1;
+            return -1;
+        }
+        if( !frames_only || ACH_LOG_REC_FRAME == s->frame.type ) {
+            s->time = (uint64_t)((int64_t)s->frame.time + s->offset);
+            return 0;
+        }
+    }
+}
+
+void log_source_heap_down( struct log_source **heap, size_t n, size_t i ) {
+    for(;;) {
+        size_t m = i, l = 2*i + 1, r = 2*i + 2;
+        if( l < n && heap[l]->time < heap[m]->time ) m = l;
+        if( r < n && heap[r]->time < heap[m]->time ) m = r;
+        if( m == i ) return;
+        struct log_source *tmp = heap[i];
+        heap[i] = heap[m];
+        heap[m] = tmp;
+        i = m;
+    }
+}
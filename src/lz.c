@@ -0,0 +1,216 @@
+/*
+ * Copyright (c) 2015, Rice University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *     * Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials
+ *       provided with the distribution.
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written
+ *       permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Small LZ77 block compressor in the style of LZ4.
+ *
+ * A block is a series of sequences.  Each sequence is a token byte,
+ * whose high nibble is the literal count and low nibble is the match
+ * length minus LZ_MIN_MATCH, then the literals, then a 16-bit little
+ * endian match offset.  A nibble of 15 is followed by bytes adding
+ * to the count, continuing while they are 255.  The last sequence
+ * holds only literals and ends the block.
+ */
+
+#include <time.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ach.h"
+#include "achutil.h"
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 0xFFFF
+#define LZ_HASH_BITS 12
+/* Skip faster through data that doesn't match, by one byte for every
+ * 2^LZ_SKIP_SHIFT literals.  Levels change the shift. */
+#define LZ_SKIP_SHIFT 6
+#define LZ_LEVEL_DEFAULT 3
+#define LZ_LEVEL_MAX 9
+
+static inline uint32_t read32( const uint8_t *p ) {
+    uint32_t x;
+    memcpy( &x, p, sizeof(x) );
+    return x;
+}
+
+static inline uint32_t lz_hash( uint32_t x ) {
+    return (x * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/* Write a length nibble's extension bytes */
+static int put_len( uint8_t **pop, const uint8_t *oend, size_t len ) {
+    uint8_t *op = *pop;
+    for( ; len >= 255; len -= 255 ) {
+        if( op >= oend ) return -1;
+        *op++ = 255;
+    }
+    if( op >= oend ) return -1;
+    *op++ = (uint8_t)len;
+    *pop = op;
+    return 0;
+}
+
+static int get_len( const uint8_t **pip, const uint8_t *iend, size_t *len ) {
+    const uint8_t *ip = *pip;
+    uint8_t b;
+    do {
+        if( ip >= iend ) return -1;
+        b = *ip++;
+        *len += b;
+    } while( 255 == b );
+    *pip = ip;
+    return 0;
+}
+
+static int put_sequence( uint8_t **pop, const uint8_t *oend,
+                         const uint8_t *lit, size_t lit_len,
+                         size_t offset, size_t match_len )
+{
+    uint8_t *op = *pop;
+    if( op >= oend ) return -1;
+    uint8_t *token = op++;
+    *token = (uint8_t)((lit_len < 15 ? lit_len : 15) << 4);
+    if( lit_len >= 15 && put_len(&op, oend, lit_len - 15) ) return -1;
+    if( (size_t)(oend - op) < lit_len ) return -1;
+    memcpy( op, lit, lit_len );
+    op += lit_len;
+
+    if( match_len ) {
+        size_t m = match_len - LZ_MIN_MATCH;
+        *token |= (uint8_t)(m < 15 ? m : 15);
+        if( oend - op < 2 ) return -1;
+        *op++ = (uint8_t)offset;
+        *op++ = (uint8_t)(offset >> 8);
+        if( m >= 15 && put_len(&op, oend, m - 15) ) return -1;
+    }
+    *pop = op;
+    return 0;
+}
+
+size_t ach_lz_bound( size_t n ) {
+    return n + n/255 + 16;
+}
+
+size_t ach_lz_compress( const void *src, size_t n, void *dst, size_t cap ) {
+    return ach_lz_compress_level( src, n, dst, cap, LZ_LEVEL_DEFAULT );
+}
+
+size_t ach_lz_compress_level( const void *src, size_t n, void *dst, size_t cap, int level ) {
+    if( level < 1 ) level = 1;
+    if( level > LZ_LEVEL_MAX ) level = LZ_LEVEL_MAX;
+    const unsigned skip_shift = (unsigned)(LZ_SKIP_SHIFT + level - LZ_LEVEL_DEFAULT);
+    const uint8_t *in = (const uint8_t*)src;
+    const uint8_t *ip = in, *anchor = in;
+    const uint8_t *iend = in + n;
+    uint8_t *op = (uint8_t*)dst;
+    const uint8_t *oend = op + cap;
+    uint32_t table[1 << LZ_HASH_BITS];
+
+    if( n >= LZ_MIN_MATCH ) {
+        const uint8_t *ilimit = iend - LZ_MIN_MATCH;
+        memset( table, 0, sizeof(table) );
+        while( ip <= ilimit ) {
+            uint32_t x = read32(ip);
+            uint32_t h = lz_hash(x);
+            const uint8_t *ref = in + table[h];
+            table[h] = (uint32_t)(ip - in);
+            if( ref < ip && ip - ref <= LZ_MAX_OFFSET && read32(ref) == x ) {
+                /* extend the match */
+                const uint8_t *mp = ip + LZ_MIN_MATCH;
+                const uint8_t *rp = ref + LZ_MIN_MATCH;
+                while( mp < iend && *mp == *rp ) {
+                    mp++;
+                    rp++;
+                }
+                if( put_sequence( &op, oend, anchor, (size_t)(ip - anchor),
+                                  (size_t)(ip - ref), (size_t)(mp - ip) ) )
+                {
+                    return 0;
+                }
+                ip = anchor = mp;
+            } else {
+                ip += 1 + ((size_t)(ip - anchor) >> skip_shift);
+            }
+        }
+    }
+
+    /* trailing literals */
+    if( put_sequence( &op, oend, anchor, (size_t)(iend - anchor), 0, 0 ) ) {
+        return 0;
+    }
+    return (size_t)(op - (uint8_t*)dst);
+}
+
+int ach_lz_decompress( const void *src, size_t n, void *dst, size_t cap, size_t *out_size ) {
+    const uint8_t *ip = (const uint8_t*)src;
+    const uint8_t *iend = ip + n;
+    uint8_t *out = (uint8_t*)dst;
+    uint8_t *op = out;
+    uint8_t *oend = out + cap;
+
+    for(;;) {
+        if( ip >= iend ) return -1;
+        uint8_t token = *ip++;
+
+        /* literals */
+        size_t lit_len = token >> 4;
+        if( 15 == lit_len && get_len(&ip, iend, &lit_len) ) return -1;
+        if( (size_t)(iend - ip) < lit_len || (size_t)(oend - op) < lit_len ) return -1;
+        memcpy( op, ip, lit_len );
+        ip += lit_len;
+        op += lit_len;
+        if( ip == iend ) break;
+
+        /* match */
+        if( iend - ip < 2 ) return -1;
+        size_t offset = (size_t)ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        size_t match_len = token & 0xf;
+        if( 15 == match_len && get_len(&ip, iend, &match_len) ) return -1;
+        match_len += LZ_MIN_MATCH;
+        if( 0 == offset || offset > (size_t)(op - out) ||
+            (size_t)(oend - op) < match_len )
+        {
+            return -1;
+        }
+        /* may overlap, copy forward */
+        const uint8_t *mp = op - offset;
+        size_t i;
+        for( i = 0; i < match_len; i++ ) op[i] = mp[i];
+        op += match_len;
+    }
+
+    *out_size = (size_t)(op - out);
+    return 0;
+}
@@ -54,6 +54,7 @@
 #include <pthread.h>
 #include <stdio.h>
 #include "ach.h"
+#include "ach/experimental.h"
 
 #define OPT_CHAN  "ach-test"
 
@@ -73,6 +74,12 @@ int opt_pub_sleep_us = OPT_PUB_SLEEP_US;
 int opt_n_msgs = OPT_N_MSGS;
 const char *opt_channel_name = OPT_CHAN;
 
+static enum ach_status transfer_int( void *cx, void *chan_dst, const void *obj ) {
+    if( cx ) return *(enum ach_status*)cx;
+    memcpy( chan_dst, obj, sizeof(int) );
+    return ACH_OK;
+}
+
 static void test(ach_status_t r, const char *thing) {
     if( r != ACH_OK ) {
         fprintf(stderr, "%s: %s\n",
@@ -215,6 +222,93 @@ int test_basic() {
         exit(-1);
     }
 
+    /* get by sequence number */
+    uint64_t seq;
+    r = ach_channel_seq( &chan, &seq );
+    test(r, "ach_channel_seq");
+    for( i = 0; i < 8; i ++ ) {
+        p = (int)i;
+        r = ach_put( &chan, &p, sizeof(p) );
+        test(r, "ach_put");
+    }
+    r = ach_get_seq( &chan, seq + 4, &s, sizeof(s), &frame_size );
+    test(r, "ach_get_seq");
+    if(frame_size != sizeof(s) || s != 3 ) exit(-1);
+    r = ach_get_seq( &chan, seq + 9, &s, sizeof(s), &frame_size );
+    if( ACH_STALE_FRAMES != r ) {
+        printf("get seq stale failed: %s\n", ach_result_to_string(r));
+        exit(-1);
+    }
+    r = ach_get_seq( &chan, seq - 64, &s, sizeof(s), &frame_size );
+    if( ACH_MISSED_FRAME != r ) {
+        printf("get seq missed failed: %s\n", ach_result_to_string(r));
+        exit(-1);
+    }
+    /* read position is unchanged */
+    r = ach_get( &chan, &s, sizeof(s), &frame_size, NULL, 0 );
+    test(r, "ach_get after ach_get_seq");
+    if(frame_size != sizeof(s) || s != 0 ) exit(-1);
+
+    /* put by transfer */
+    r = ach_flush( &chan );
+    test(r, "ach_flush");
+    p = 46;
+    r = ach_put_transfer( &chan, transfer_int, NULL, &p, sizeof(p) );
+    test(r, "ach_put_transfer");
+    {
+        enum ach_status fail = ACH_EAGAIN;
+        p = 47;
+        r = ach_put_transfer( &chan, transfer_int, &fail, &p, sizeof(p) );
+        if( ACH_EAGAIN != r ) {
+            printf("failed transfer: %s\n", ach_result_to_string(r));
+            exit(-1);
+        }
+    }
+    r = ach_get( &chan, &s, sizeof(s), &frame_size, NULL, 0 );
+    test(r, "ach_get after ach_put_transfer");
+    if(frame_size != sizeof(s) || s != 46 ) exit(-1);
+    r = ach_get( &chan, &s, sizeof(s), &frame_size, NULL, 0 );
+    if( ACH_STALE_FRAMES != r ) {
+        printf("failed transfer was put: %s\n", ach_result_to_string(r));
+        exit(-1);
+    }
+
+    /* failed transfer into a full channel keeps the old frames */
+    for( i = 0; i < 32; i ++ ) {
+        p = 100 + (int)i;
+        r = ach_put( &chan, &p, sizeof(p) );
+        test(r, "ach_put");
+    }
+    r = ach_get( &chan, &s, sizeof(s), &frame_size, NULL, ACH_O_LAST );
+    if( ACH_OK != r && ACH_MISSED_FRAME != r ) test(r, "ach_get last");
+    r = ach_channel_seq( &chan, &seq );
+    test(r, "ach_channel_seq");
+    {
+        /* large enough to wrap and displace many frames */
+        enum ach_status fail = ACH_EAGAIN;
+        r = ach_put_transfer( &chan, transfer_int, &fail, NULL, 1024 );
+        if( ACH_EAGAIN != r ) {
+            printf("failed transfer: %s\n", ach_result_to_string(r));
+            exit(-1);
+        }
+    }
+    for( i = 0; i < 32; i ++ ) {
+        r = ach_get_seq( &chan, seq - 31 + i, &s, sizeof(s), &frame_size );
+        test(r, "ach_get_seq after failed transfer");
+        if(frame_size != sizeof(s) || s != 100 + (int)i ) {
+            printf("frame lost by failed transfer: %d\n", s);
+            exit(-1);
+        }
+    }
+    p = 48;
+    r = ach_put( &chan, &p, sizeof(p) );
+    test(r, "ach_put after failed transfer");
+    r = ach_get( &chan, &s, sizeof(s), &frame_size, NULL, ACH_O_LAST );
+    if( (ACH_OK != r && ACH_MISSED_FRAME != r) || s != 48 ) {
+        printf("put after failed transfer: %s\n", ach_result_to_string(r));
+        exit(-1);
+    }
+
     /* close */
 
     r = ach_close(&chan);
@@ -0,0 +1,206 @@
+/*
+ * Copyright (c) 2015, Rice University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *     * Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials
+ *       provided with the distribution.
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written
+ *       permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <time.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "ach.h"
+#include "achutil.h"
+#include "achd.h"
+
+#define FRAME_SIZE 4096
+#define FRAMES 1000
+#define KEYFRAME 16
+
+#define TEST(expr) if( !(expr) ) {                                      \
+        fprintf(stderr, "codectest: %s:%d: failed `%s'\n",              \
+                __FILE__, __LINE__, #expr );                            \
+        exit(EXIT_FAILURE);                                             \
+    }
+
+/* A state vector where a few fields change per frame */
+static size_t next_frame( uint8_t *buf, size_t n ) {
+    int k;
+    for( k = 0; k < 8; k++ ) {
+        buf[ (size_t)rand() % n ] = (uint8_t)rand();
+    }
+    /* occasionally change size */
+    if( 0 == rand() % 50 ) {
+        n = 1 + (size_t)rand() % FRAME_SIZE;
+    }
+    return n;
+}
+
+static void test_lz( void ) {
+    static uint8_t in[3*FRAME_SIZE], out[3*FRAME_SIZE], back[3*FRAME_SIZE];
+    size_t n, i, m, size;
+    for( n = 0; n < sizeof(in); n = 2*n + 1 ) {
+        /* repetitive text */
+        for( i = 0; i < n; i++ ) in[i] = (uint8_t)("the quick brown fox "[i % 20] + (i / 200));
+        m = ach_lz_compress( in, n, out, ach_lz_bound(n) );
+        TEST( m > 0 && m <= ach_lz_bound(n) );
+        TEST( 0 == ach_lz_decompress( out, m, back, n, &size ) );
+        TEST( size == n && 0 == memcmp(in, back, n) );
+        if( n > 100 ) TEST( m < n / 2 );
+        /* all levels decompress the same way */
+        int level;
+        for( level = 1; level <= 9; level += 4 ) {
+            size_t ml = ach_lz_compress_level( in, n, out, ach_lz_bound(n), level );
+            TEST( ml > 0 && 0 == ach_lz_decompress( out, ml, back, n, &size ) );
+            TEST( size == n && 0 == memcmp(in, back, n) );
+        }
+        m = ach_lz_compress( in, n, out, ach_lz_bound(n) );
+        /* truncated input must fail */
+        if( m > 1 ) TEST( 0 != ach_lz_decompress( out, m - 1, back, n, &size ) ||
+                          size != n );
+
+        /* noise doesn't fit when asked to shrink */
+        for( i = 0; i < n; i++ ) in[i] = (uint8_t)rand();
+        m = ach_lz_compress( in, n, out, ach_lz_bound(n) );
+        TEST( m > 0 );
+        TEST( 0 == ach_lz_decompress( out, m, back, n, &size ) );
+        TEST( size == n && 0 == memcmp(in, back, n) );
+        if( n > 100 ) TEST( 0 == ach_lz_compress( in, n, out, n ) );
+    }
+}
+
+static void test_roundtrip( int keyframe, const char *compression, size_t ratio ) {
+    struct achd_headers hdr;
+    memset( &hdr, 0, sizeof(hdr) );
+    hdr.delta_keyframe = keyframe;
+    hdr.compression = compression;
+    struct achd_codec *enc = achd_codec_create( &hdr, FRAME_SIZE );
+    struct achd_codec *dec = achd_codec_create( &hdr, FRAME_SIZE );
+    TEST( enc && dec );
+
+    ach_pipe_frame_t *frame = NULL;
+    size_t frame_size = 0;
+    uint8_t buf[FRAME_SIZE] = {0};
+    size_t n = FRAME_SIZE / 2;
+    size_t raw = 0, wire = 0;
+    int i;
+    for( i = 0; i < FRAMES; i ++ ) {
+        n = next_frame( buf, n );
+        achd_encode( enc, buf, n, &frame, &frame_size );
+        size_t m = ach_pipe_get_size( frame );
+        TEST( m <= achd_codec_bound(n) );
+        raw += n;
+        wire += m;
+
+        size_t out_size;
+        const uint8_t *out = achd_decode( dec, frame->data, m, &out_size );
+        TEST( out );
+        TEST( out_size == n );
+        TEST( 0 == memcmp(out, buf, n) );
+    }
+    TEST( wire * ratio < raw );
+
+    free( frame );
+    achd_codec_destroy( enc );
+    achd_codec_destroy( dec );
+}
+
+static void test_loss( void ) {
+    struct achd_headers hdr;
+    memset( &hdr, 0, sizeof(hdr) );
+    hdr.delta_keyframe = KEYFRAME;
+    struct achd_codec *enc = achd_codec_create( &hdr, FRAME_SIZE );
+    struct achd_codec *dec = achd_codec_create( &hdr, FRAME_SIZE );
+
+    ach_pipe_frame_t *frame = NULL;
+    size_t frame_size = 0;
+    uint8_t buf[FRAME_SIZE] = {0};
+    size_t n = FRAME_SIZE;
+    int i, synced = 1;
+    for( i = 0; i < FRAMES; i ++ ) {
+        n = next_frame( buf, n );
+        achd_encode( enc, buf, n, &frame, &frame_size );
+        size_t m = ach_pipe_get_size( frame );
+        int key = !(frame->data[0] & 0x1);
+
+        /* drop some frames */
+        if( 0 == rand() % 10 ) {
+            synced = 0;
+            continue;
+        }
+        if( key ) synced = 1;
+
+        size_t out_size;
+        const uint8_t *out = achd_decode( dec, frame->data, m, &out_size );
+        if( synced ) {
+            TEST( out && out_size == n && 0 == memcmp(out, buf, n) );
+        } else {
+            TEST( NULL == out );
+        }
+
+        /* garbage must not decode */
+        uint8_t junk[64];
+        size_t k;
+        for( k = 0; k < sizeof(junk); k++ ) junk[k] = (uint8_t)rand();
+        junk[0] = 1;
+        struct achd_codec *tmp = achd_codec_create( &hdr, FRAME_SIZE );
+        TEST( NULL == achd_decode( tmp, junk, sizeof(junk), &out_size ) );
+        TEST( NULL == achd_decode( tmp, junk, 3, &out_size ) );
+        achd_codec_destroy( tmp );
+    }
+
+    free( frame );
+    achd_codec_destroy( enc );
+    achd_codec_destroy( dec );
+}
+
+int main( void ) {
+    struct achd_headers hdr;
+    memset( &hdr, 0, sizeof(hdr) );
+    TEST( NULL == achd_codec_create( &hdr, FRAME_SIZE ) );
+
+    /* quiet the expected decode errors */
+    ach_verbosity = -2;
+
+    srand(42);
+    test_lz();
+    test_roundtrip( KEYFRAME, NULL, 4 );
+    test_roundtrip( 0, "lz", 1 );
+    test_roundtrip( KEYFRAME, "lz", 4 );
+    test_loss();
+    return 0;
+}
@@ -0,0 +1,440 @@
+/*
+ * Copyright (c) 2015, Rice University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *     * Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials
+ *       provided with the distribution.
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written
+ *       permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Tests for the achlog file reader */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <time.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ach.h"
+#include "achutil.h"
+
+#define FRAMES 200          /* uncompressed frames */
+#define GAP_AT 100          /* frames before the gap */
+#define GAP 5               /* missed frames */
+#define BLOCK_FRAMES 20     /* frames in the compressed block */
+#define IDX_EVERY 16
+
+#define TEST(expr) if( !(expr) ) {                                      \
+        fprintf(stderr, "logtest: %s:%d: failed `%s'\n",                \
+                __FILE__, __LINE__, #expr );                            \
+        exit(EXIT_FAILURE);                                             \
+    }
+
+static size_t frame_size( uint64_t seq ) {
+    return 1 + (size_t)(seq % 50);
+}
+
+static void frame_data( uint64_t seq, uint8_t *buf ) {
+    memset( buf, (int)(seq & 0xFF), frame_size(seq) );
+}
+
+/* Append a frame record to buf */
+static size_t put_frame( uint8_t *buf, uint64_t seq ) {
+    ach_log_rec_set( (ach_log_rec_t*)buf, ACH_LOG_REC_FRAME, seq, seq * 1000,
+                     frame_size(seq) );
+    frame_data( seq, buf + sizeof(ach_log_rec_t) );
+    return sizeof(ach_log_rec_t) + frame_size(seq);
+}
+
+/* Create a log and write its headers */
+static FILE *new_log( const char *path ) {
+    FILE *f = fopen( path, "w" );
+    TEST( f );
+    fputs( "ACHLOG\n"
+           "channel-name: logtest\n"
+           "log-version: 1\n"
+           "log-time-ach: 1.000000000\n"
+           "log-time-real: 2.000000000 # comment\n"
+           ".\n", f );
+    return f;
+}
+
+/* Write a log of FRAMES frames with a gap after GAP_AT, then a block
+ * of BLOCK_FRAMES frames, and its index.  Returns the last seq. */
+static uint64_t write_log( const char *path ) {
+    FILE *f = new_log( path );
+    char idx_path[256];
+    snprintf( idx_path, sizeof(idx_path), "%s.idx", path );
+    FILE *fidx = fopen( idx_path, "w" );
+    TEST( fidx );
+    TEST( 1 == fwrite( ACH_LOG_IDX_MAGIC "\0\0", 8, 1, fidx ) );
+
+    uint8_t buf[sizeof(ach_log_rec_t) + 64];
+    uint64_t seq = 1;
+    size_t i;
+    for( i = 0; i < FRAMES; i ++, seq ++ ) {
+        if( GAP_AT == i ) {
+            ach_log_rec_t gap;
+            ach_log_rec_set( &gap, ACH_LOG_REC_GAP, seq, seq * 1000, GAP );
+            TEST( 1 == fwrite( &gap, sizeof(gap), 1, f ) );
+            seq += GAP;
+        }
+        if( 0 == i % IDX_EVERY ) {
+            ach_log_idx_t ent;
+            ach_log_idx_set( &ent, seq * 1000, seq, (uint64_t)ftell(f) );
+            TEST( 1 == fwrite( &ent, sizeof(ent), 1, fidx ) );
+        }
+        size_t n = put_frame( buf, seq );
+        TEST( 1 == fwrite( buf, n, 1, f ) );
+    }
+
+    /* a compressed block */
+    uint8_t raw[BLOCK_FRAMES * sizeof(buf)];
+    size_t raw_len = 0;
+    uint64_t first = seq;
+    for( i = 0; i < BLOCK_FRAMES; i ++, seq ++ ) {
+        raw_len += put_frame( raw + raw_len, seq );
+    }
+    size_t cap = ach_lz_bound( raw_len );
+    uint8_t *z = (uint8_t*)malloc( 8 + cap );
+    for( i = 0; i < 8; i ++ ) z[i] = (uint8_t)((uint64_t)raw_len >> (8 * i));
+    size_t zn = ach_lz_compress( raw, raw_len, z + 8, cap );
+    TEST( zn > 0 );
+    ach_log_rec_t rec;
+    ach_log_rec_set( &rec, ACH_LOG_REC_BLOCK, first, first * 1000, 8 + zn );
+    ach_log_idx_t ent;
+    ach_log_idx_set( &ent, first * 1000, first, (uint64_t)ftell(f) );
+    TEST( 1 == fwrite( &ent, sizeof(ent), 1, fidx ) );
+    TEST( 1 == fwrite( &rec, sizeof(rec), 1, f ) );
+    TEST( 1 == fwrite( z, 8 + zn, 1, f ) );
+    free( z );
+
+    TEST( 0 == fclose(f) );
+    TEST( 0 == fclose(fidx) );
+    return seq - 1;
+}
+
+static int in_map( const struct ach_log_file *lf, const void *p ) {
+    const uint8_t *q = (const uint8_t*)p;
+    return q >= lf->map && q < lf->map + lf->map_len;
+}
+
+static void check_frame( const struct ach_log_frame *frame, uint64_t seq ) {
+    uint8_t buf[64];
+    TEST( ACH_LOG_REC_FRAME == frame->type );
+    TEST( seq == frame->seq );
+    TEST( seq * 1000 == frame->time );
+    TEST( frame_size(seq) == frame->size );
+    frame_data( seq, buf );
+    TEST( 0 == memcmp( buf, frame->data, frame_size(seq) ) );
+}
+
+/* Read the whole log */
+static void test_scan( const char *path, uint64_t last ) {
+    struct ach_log_file lf;
+    struct ach_log_frame frame;
+    TEST( ACH_OK == ach_log_open( &lf, path ) );
+    TEST( 0 == strcmp( "logtest", lf.channel ) );
+    TEST( 1 == lf.version );
+    TEST( 1 == lf.time_ach.tv_sec && 2 == lf.time_real.tv_sec );
+    TEST( FRAMES / IDX_EVERY + 2 == lf.n_idx );
+
+    uint64_t seq = 1;
+    size_t i;
+    for( i = 0; i < FRAMES + BLOCK_FRAMES; i ++, seq ++ ) {
+        TEST( ACH_OK == ach_log_next( &lf, &frame ) );
+        if( GAP_AT == i ) {
+            TEST( ACH_LOG_REC_GAP == frame.type );
+            TEST( seq == frame.seq && GAP == frame.size && NULL == frame.data );
+            seq += GAP;
+            TEST( ACH_OK == ach_log_next( &lf, &frame ) );
+        }
+        check_frame( &frame, seq );
+        /* frames are read in place, except from compressed blocks */
+        TEST( (i < FRAMES) == in_map( &lf, frame.data ) );
+    }
+    TEST( seq - 1 == last );
+    TEST( ACH_STALE_FRAMES == ach_log_next( &lf, &frame ) );
+
+    /* frames appended later are found */
+    FILE *f = fopen( path, "a" );
+    TEST( f );
+    uint8_t buf[sizeof(ach_log_rec_t) + 64];
+    size_t n = put_frame( buf, seq );
+    TEST( 1 == fwrite( buf, n, 1, f ) );
+    TEST( 0 == fclose(f) );
+    TEST( ACH_OK == ach_log_next( &lf, &frame ) );
+    check_frame( &frame, seq );
+    TEST( ACH_STALE_FRAMES == ach_log_next( &lf, &frame ) );
+
+    ach_log_close( &lf );
+}
+
+/* Seek with and without the index */
+static void test_seek( const char *path, uint64_t last ) {
+    struct ach_log_file lf;
+    struct ach_log_frame frame;
+    TEST( ACH_OK == ach_log_open( &lf, path ) );
+    int pass;
+    for( pass = 0; pass < 2; pass ++ ) {
+        if( pass ) lf.n_idx = 0;
+        uint64_t seq;
+        for( seq = 1; seq <= last; seq += 7 ) {
+            /* frames in the gap seek to the frame after it */
+            uint64_t want = ( seq > GAP_AT && seq <= GAP_AT + GAP ) ? GAP_AT + GAP + 1 : seq;
+            TEST( ACH_OK == ach_log_seek( &lf, ACH_LOG_KEY_SEQ, seq ) );
+            TEST( ACH_OK == ach_log_next( &lf, &frame ) );
+            check_frame( &frame, want );
+            TEST( ACH_OK == ach_log_seek( &lf, ACH_LOG_KEY_TIME, seq * 1000 - 1 ) );
+            TEST( ACH_OK == ach_log_next( &lf, &frame ) );
+            check_frame( &frame, want );
+        }
+        TEST( ACH_OK == ach_log_next( &lf, &frame ) );
+        TEST( ACH_STALE_FRAMES == ach_log_seek( &lf, ACH_LOG_KEY_SEQ, last + 100 ) );
+    }
+    ach_log_close( &lf );
+}
+
+/* achlog -D writes whole disk blocks, then the partial block after
+ * them.  In between, the log may end in the middle of a frame's
+ * data, which must not be read until the rest is written. */
+static void test_blocks( const char *path ) {
+    enum { BLOCK = 4096 };
+    struct ach_log_file lf;
+    struct ach_log_frame frame;
+    static uint8_t buf[4 * BLOCK];
+
+    FILE *f = new_log( path );
+    size_t hdr = (size_t)ftell( f );
+
+    /* frames until one's data crosses a block boundary */
+    size_t end = hdr, cut = 0;
+    uint64_t seq, split = 0;
+    for( seq = 1; 0 == split; seq ++ ) {
+        TEST( end + sizeof(ach_log_rec_t) + 64 <= hdr + sizeof(buf) );
+        size_t data = end + sizeof(ach_log_rec_t);
+        end += put_frame( buf + end - hdr, seq );
+        size_t block = (data / BLOCK + 1) * BLOCK;
+        if( block < end ) {
+            split = seq;
+            cut = block;
+        }
+    }
+
+    TEST( 1 == fwrite( buf, cut - hdr, 1, f ) );
+    TEST( 0 == fflush(f) );
+    TEST( ACH_OK == ach_log_open( &lf, path ) );
+    for( seq = 1; seq < split; seq ++ ) {
+        TEST( ACH_OK == ach_log_next( &lf, &frame ) );
+        check_frame( &frame, seq );
+    }
+    TEST( ACH_STALE_FRAMES == ach_log_next( &lf, &frame ) );
+
+    TEST( 1 == fwrite( buf + cut - hdr, end - cut, 1, f ) );
+    TEST( 0 == fclose(f) );
+    TEST( ACH_OK == ach_log_next( &lf, &frame ) );
+    check_frame( &frame, split );
+    TEST( ACH_STALE_FRAMES == ach_log_next( &lf, &frame ) );
+    ach_log_close( &lf );
+}
+
+/* A frame the writer has only partly written is read once the rest
+ * arrives */
+static void test_partial( const char *path ) {
+    struct ach_log_file lf;
+    struct ach_log_frame frame;
+    uint8_t buf[sizeof(ach_log_rec_t) + 64];
+
+    FILE *f = new_log( path );
+    TEST( 0 == fflush(f) );
+    TEST( ACH_OK == ach_log_open( &lf, path ) );
+    TEST( ACH_STALE_FRAMES == ach_log_next( &lf, &frame ) );
+
+    size_t n = put_frame( buf, 1 );
+    size_t cut[] = {sizeof(ach_log_rec_t) / 2, sizeof(ach_log_rec_t) + 1};
+    size_t i, done = 0;
+    for( i = 0; i < sizeof(cut)/sizeof(cut[0]); i ++ ) {
+        TEST( 1 == fwrite( buf + done, cut[i] - done, 1, f ) );
+        TEST( 0 == fflush(f) );
+        done = cut[i];
+        TEST( ACH_STALE_FRAMES == ach_log_next( &lf, &frame ) );
+    }
+    TEST( 1 == fwrite( buf + done, n - done, 1, f ) );
+    TEST( 0 == fclose(f) );
+    TEST( ACH_OK == ach_log_next( &lf, &frame ) );
+    check_frame( &frame, 1 );
+    TEST( ACH_STALE_FRAMES == ach_log_next( &lf, &frame ) );
+    ach_log_close( &lf );
+}
+
+/* A version 2 log of two channels, frames alternating between them */
+static void test_multi( const char *path ) {
+    struct ach_log_file lf;
+    struct ach_log_frame frame;
+    uint8_t buf[sizeof(ach_log_rec_t) + 64];
+
+    FILE *f = fopen( path, "w" );
+    TEST( f );
+    fputs( "ACHLOG\n"
+           "channel-1: b\n"
+           "channel-0: a\n"
+           "log-version: 2\n"
+           "log-time-ach: 1.000000000\n"
+           "log-time-real: 2.000000000\n"
+           ".\n", f );
+    uint64_t i;
+    for( i = 0; i < 6; i ++ ) {
+        size_t n = put_frame( buf, 1 + i/2 );
+        ach_log_rec_set_channel( (ach_log_rec_t*)buf, (uint32_t)(i % 2) );
+        TEST( 1 == fwrite( buf, n, 1, f ) );
+    }
+    TEST( 0 == fflush(f) );
+
+    TEST( ACH_OK == ach_log_open( &lf, path ) );
+    TEST( ACH_LOG_VERSION_MULTI == lf.version );
+    TEST( 2 == lf.n_channels );
+    TEST( 0 == strcmp( "a", lf.channels[0] ) && 0 == strcmp( "b", lf.channels[1] ) );
+    TEST( 0 == strcmp( "a", lf.channel ) );
+    for( i = 0; i < 6; i ++ ) {
+        TEST( ACH_OK == ach_log_next( &lf, &frame ) );
+        check_frame( &frame, 1 + i/2 );
+        TEST( i % 2 == frame.channel );
+    }
+    TEST( ACH_STALE_FRAMES == ach_log_next( &lf, &frame ) );
+
+    /* sequence numbers are per channel, so only time seeks apply */
+    TEST( ACH_EINVAL == ach_log_seek( &lf, ACH_LOG_KEY_SEQ, 2 ) );
+    TEST( ACH_OK == ach_log_seek( &lf, ACH_LOG_KEY_TIME, 2000 ) );
+    TEST( ACH_OK == ach_log_next( &lf, &frame ) );
+    check_frame( &frame, 2 );
+    TEST( 0 == frame.channel );
+
+    for( i = 3; i < 6; i ++ ) {
+        TEST( ACH_OK == ach_log_next( &lf, &frame ) );
+        TEST( i % 2 == frame.channel );
+    }
+    TEST( ACH_STALE_FRAMES == ach_log_next( &lf, &frame ) );
+
+    /* a record of a channel not in the header */
+    size_t n = put_frame( buf, 4 );
+    ach_log_rec_set_channel( (ach_log_rec_t*)buf, 2 );
+    TEST( 1 == fwrite( buf, n, 1, f ) );
+    TEST( 0 == fclose(f) );
+    TEST( ACH_CORRUPT == ach_log_next( &lf, &frame ) );
+    ach_log_close( &lf );
+
+    /* channel numbers must be contiguous */
+    f = fopen( path, "w" );
+    TEST( f );
+    fputs( "ACHLOG\n"
+           "channel-0: a\n"
+           "channel-2: b\n"
+           "log-version: 2\n"
+           ".\n", f );
+    TEST( 0 == fclose(f) );
+    TEST( ACH_BAD_HEADER == ach_log_open( &lf, path ) );
+}
+
+/* A merged log of one channel whose index has no sequence numbers */
+static void test_no_seq( const char *path ) {
+    struct ach_log_file lf;
+    struct ach_log_frame frame;
+    uint8_t buf[sizeof(ach_log_rec_t) + 64];
+    char idx_path[256];
+    snprintf( idx_path, sizeof(idx_path), "%s.idx", path );
+
+    FILE *f = new_log( path );
+    FILE *fidx = fopen( idx_path, "w" );
+    TEST( fidx );
+    TEST( 1 == fwrite( ACH_LOG_IDX_MAGIC "\0\0", 8, 1, fidx ) );
+    uint64_t seqs[] = {5, 1, 6, 2};
+    size_t i;
+    for( i = 0; i < sizeof(seqs)/sizeof(seqs[0]); i ++ ) {
+        ach_log_idx_t ent;
+        ach_log_idx_set( &ent, seqs[i] * 1000, ACH_LOG_IDX_NO_SEQ, (uint64_t)ftell(f) );
+        TEST( 1 == fwrite( &ent, sizeof(ent), 1, fidx ) );
+        /* times must still be in order */
+        size_t n = put_frame( buf, seqs[i] );
+        ach_log_rec_set( (ach_log_rec_t*)buf, ACH_LOG_REC_FRAME, seqs[i], 1000 * (i+1),
+                         frame_size(seqs[i]) );
+        TEST( 1 == fwrite( buf, n, 1, f ) );
+    }
+    TEST( 0 == fclose(f) );
+    TEST( 0 == fclose(fidx) );
+
+    TEST( ACH_OK == ach_log_open( &lf, path ) );
+    TEST( 4 == lf.n_idx );
+    TEST( ACH_EINVAL == ach_log_seek( &lf, ACH_LOG_KEY_SEQ, 2 ) );
+    TEST( ACH_OK == ach_log_seek( &lf, ACH_LOG_KEY_TIME, 3000 ) );
+    TEST( ACH_OK == ach_log_next( &lf, &frame ) );
+    TEST( 6 == frame.seq );
+    ach_log_close( &lf );
+    TEST( 0 == unlink(idx_path) );
+}
+
+static void test_bad( const char *path ) {
+    struct ach_log_file lf;
+    FILE *f = fopen( path, "w" );
+    TEST( f );
+    fputs( "NOTALOG\nchannel-name: x\n.\n", f );
+    TEST( 0 == fclose(f) );
+    TEST( ACH_BAD_HEADER == ach_log_open( &lf, path ) );
+
+    f = fopen( path, "w" );
+    TEST( f );
+    TEST( 0 == fclose(f) );
+    TEST( ACH_BAD_HEADER == ach_log_open( &lf, path ) );
+
+    TEST( 0 == unlink(path) );
+    TEST( ACH_FAILED_SYSCALL == ach_log_open( &lf, path ) );
+}
+
+int main( void ) {
+    char path[] = "logtest-XXXXXX";
+    int fd = mkstemp( path );
+    TEST( fd >= 0 );
+    close( fd );
+    char idx_path[sizeof(path) + 4];
+    snprintf( idx_path, sizeof(idx_path), "%s.idx", path );
+
+    uint64_t last = write_log( path );
+    test_scan( path, last );
+    test_seek( path, last );
+    TEST( 0 == unlink(idx_path) );
+    test_blocks( path );
+    test_partial( path );
+    test_multi( path );
+    test_no_seq( path );
+    test_bad( path );
+    return 0;
+}